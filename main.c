@@ -7,6 +7,14 @@
 #include <stdbool.h>
 #include <string.h>
 #include <math.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
@@ -195,41 +203,410 @@ vec3 mat3_mul(mat3 m, vec3 v) {
 	};
 }
 
-#define MAX_SPRITE_ANGLES 16
+#define ARENA_BLOCK_SIZE (16 * 1024 * 1024)
+#define ARENA_ALIGN 16
+
+// A chunk of memory that an arena hands out from the front. The data starts
+// at the first aligned address after the header.
+typedef struct ArenaBlock {
+	struct ArenaBlock* next;
+	size_t size;
+	size_t used;
+} ArenaBlock;
+
+// SDL allocates the SDL_Surface itself even when the pixels come from an
+// arena, so the arena keeps a list of them to free on reset
+typedef struct ArenaSurface {
+	SDL_Surface* surface;
+	struct ArenaSurface* next;
+} ArenaSurface;
+
+// Bump allocator for data that lives and dies together, like everything a
+// track loads. Nothing is freed on its own; Arena_Reset drops it all at once
+// and keeps the memory for next time.
+typedef struct Arena {
+	const char* name;
+	ArenaBlock* blocks; // Allocations come from the first block
+	ArenaSurface* surfaces;
+	size_t used; // Bytes handed out since the last reset
+	size_t reserved; // Bytes in all blocks
+	size_t highWater; // Most bytes ever handed out between resets
+} Arena;
+
+size_t Arena_AlignUp(size_t x) {
+	return (x + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
 
-typedef struct Sprite {
-	SDL_Surface* img;
-	int numAngles;
-	int w;
-	int h;
-	vec3 pos;
-	float angle;
-} Sprite;
+void Arena_AddBlock(Arena* a, size_t size) {
+	ArenaBlock* b = malloc(Arena_AlignUp(sizeof(ArenaBlock)) + size);
+	if (b == NULL) {
+		fprintf(stderr, "Out of memory in %s arena\n", a->name);
+		exit(EXIT_FAILURE);
+	}
+	b->next = a->blocks;
+	b->size = size;
+	b->used = 0;
+	a->blocks = b;
+	a->reserved += size;
+}
 
-#define MAX_SPRITES 1024
-Sprite sprites[MAX_SPRITES];
-int numSprites = 0;
+void* Arena_Alloc(Arena* a, size_t size) {
+	size = Arena_AlignUp(size);
+	if (a->blocks == NULL || a->blocks->size - a->blocks->used < size) {
+		Arena_AddBlock(a, size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE);
+	}
 
-int AddSprite(const char* path);
+	ArenaBlock* b = a->blocks;
+	void* p = (uint8_t*)b + Arena_AlignUp(sizeof(ArenaBlock)) + b->used;
+	b->used += size;
 
-typedef struct Enemy {
-	int sprite;
-	vec2 pos;
+	a->used += size;
+	if (a->used > a->highWater) {
+		a->highWater = a->used;
+	}
+	return p;
+}
 
-	vec2* path;
-	int pathLength;
-	int pathIndex;
-	vec2 dir;
+void* Arena_Calloc(Arena* a, size_t count, size_t size) {
+	void* p = Arena_Alloc(a, count * size);
+	memset(p, 0, count * size);
+	return p;
+}
 
-	float speed;
+// A surface whose pixels are in the arena. It is freed by Arena_Reset.
+SDL_Surface* Arena_CreateSurface(Arena* a, int w, int h, Uint32 format) {
+	int pitch = (w * SDL_BYTESPERPIXEL(format) + 3) & ~3;
+	void* pixels = Arena_Alloc(a, (size_t)pitch * h);
+	SDL_Surface* surf = SDL_CreateRGBSurfaceWithFormatFrom(pixels, w, h, SDL_BITSPERPIXEL(format), pitch, format);
+	if (surf == NULL) {
+		fprintf(stderr, "Unable to create surface: %s\n", SDL_GetError());
+		exit(EXIT_FAILURE);
+	}
+
+	ArenaSurface* node = Arena_Alloc(a, sizeof(ArenaSurface));
+	node->surface = surf;
+	node->next = a->surfaces;
+	a->surfaces = node;
+	return surf;
+}
+
+// Copies src into a new arena surface, converting it to the given format
+SDL_Surface* Arena_ConvertSurface(Arena* a, SDL_Surface* src, Uint32 format) {
+	SDL_Surface* conv = SDL_ConvertSurfaceFormat(src, format, 0);
+	if (conv == NULL) {
+		fprintf(stderr, "Unable to convert surface: %s\n", SDL_GetError());
+		exit(EXIT_FAILURE);
+	}
+
+	SDL_Surface* surf = Arena_CreateSurface(a, conv->w, conv->h, format);
+	for (int y = 0; y < conv->h; y++) {
+		memcpy((uint8_t*)surf->pixels + y * surf->pitch, (uint8_t*)conv->pixels + y * conv->pitch, conv->w * SDL_BYTESPERPIXEL(format));
+	}
+	SDL_FreeSurface(conv);
+	return surf;
+}
+
+// Frees everything allocated from the arena. If that took more than one
+// block they are merged into one that fits the high water mark, so the next
+// user of the arena gets by with a single block and memory stays flat.
+void Arena_Reset(Arena* a) {
+	for (ArenaSurface* s = a->surfaces; s != NULL; s = s->next) {
+		SDL_FreeSurface(s->surface);
+	}
+	a->surfaces = NULL;
+
+	if (a->blocks != NULL && a->blocks->next != NULL) {
+		while (a->blocks != NULL) {
+			ArenaBlock* next = a->blocks->next;
+			free(a->blocks);
+			a->blocks = next;
+		}
+		a->reserved = 0;
+		size_t size = Arena_AlignUp(a->highWater);
+		Arena_AddBlock(a, size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE);
+	}
+	else if (a->blocks != NULL) {
+		a->blocks->used = 0;
+	}
+	a->used = 0;
+}
+
+void Arena_Free(Arena* a) {
+	Arena_Reset(a);
+	free(a->blocks);
+	a->blocks = NULL;
+	a->reserved = 0;
+}
+
+void Arena_Report(const Arena* a) {
+	printf("%s arena: %.1f MB used, %.1f MB high water, %.1f MB reserved\n",
+		a->name, a->used / 1048576.0, a->highWater / 1048576.0, a->reserved / 1048576.0);
+}
+
+#define MAX_SPRITE_ANGLES 16
+#define MAX_SPRITE_LEVELS 8
+#define MAX_SPRITE_IMAGES 64
+
+// A sprite sheet and its mip chain, built when the image is loaded. Level n
+// is the sheet at 1/2^n size. Each rotation frame is downscaled on its own
+// so frames don't bleed into each other.
+typedef struct SpriteImage {
+	char path[256];
+	SDL_Surface* levels[MAX_SPRITE_LEVELS];
+	int numLevels;
+	int numAngles;
+	int frameW; // Size of a frame at level 0
+	int frameH;
+} SpriteImage;
+
+#define MAX_SPRITES 4096
+
+// Sprites are stored as arrays of each field rather than an array of
+// structs, so drawing can cull, sort and project all of them as linear
+// passes over just the fields it needs. Where sprites are changes every
+// tick and is copied into every snapshot, while what they look like is fixed
+// once the track has loaded, so the two are kept apart.
+typedef struct SpritePositions {
+	float x[MAX_SPRITES];
+	float y[MAX_SPRITES];
+	float z[MAX_SPRITES];
+	float angle[MAX_SPRITES];
+	int count;
+} SpritePositions;
+
+typedef struct SpriteLooks {
+	float w[MAX_SPRITES];
+	float h[MAX_SPRITES];
+	SpriteImage* image[MAX_SPRITES]; // Only read for sprites that are in view
+} SpriteLooks;
+
+void Sprite_Place(SpritePositions* sp, int i, float x, float y) {
+	sp->x[i] = x;
+	sp->y[i] = y;
+	sp->z[i] = 0;
+}
+
+// Copies only the sprites in use
+void SpritePositions_Copy(SpritePositions* dst, const SpritePositions* src) {
+	int n = src->count;
+	memcpy(dst->x, src->x, n * sizeof(float));
+	memcpy(dst->y, src->y, n * sizeof(float));
+	memcpy(dst->z, src->z, n * sizeof(float));
+	memcpy(dst->angle, src->angle, n * sizeof(float));
+	dst->count = n;
+}
+
+typedef struct TrackLoad TrackLoad;
+typedef struct World World;
+
+int AddSprite(TrackLoad* tl, const char* path);
+int AddSpriteRotations(TrackLoad* tl, const char* path);
+int AddSpriteImage(TrackLoad* tl, SpriteImage* image);
+SpriteImage* LoadSpriteImage(TrackLoad* tl, const char* path, bool rotations);
+
+#define NUM_LAPS 3
+#define MARKER_RADIUS 100
+#define MARKER_LATERAL 200 // How far to the side of a segment a kart can be and still pass its end
+
+// A racing line, with the distance along the lap to each marker precomputed
+typedef struct RacePath {
+	vec2* points;
+	float* dist; // Distance along the lap from the finish marker to each marker
+	int length;
+	int finishMarker; // Passing this marker completes a lap
+	float lapLength;
+} RacePath;
+
+void RacePath_Init(RacePath* rp, Arena* arena, vec2* points, int length, int finishMarker) {
+	rp->points = points;
+	rp->length = length;
+	rp->finishMarker = finishMarker;
+
+	// dist[finishMarker] is the full lap, since reaching it ends the lap
+	rp->dist = Arena_Alloc(arena, length * sizeof(float));
+	float dist = 0;
+	for (int i = 1; i <= length; i++) {
+		int a = (finishMarker + i - 1) % length;
+		int b = (finishMarker + i) % length;
+		vec2 d = vec2_sub(points[b], points[a]);
+		dist += sqrtf(vec2_dot(d, d));
+		rp->dist[b] = dist;
+	}
+	rp->lapLength = dist;
+}
+
+// Where a kart is along its racing line. Each frame the kart is projected
+// onto the segment leading to its next marker, so updating is O(1) no matter
+// how long the path is.
+typedef struct RaceProgress {
+	const RacePath* route;
+
+	int target;
+	vec2 segStart;
+	float segStartDist;
+	float segLength;
+	float fraction;
 
 	int lap;
-} Enemy;
+	float distance; // Laps as a continuous number, used to rank karts
+	int finishPlace; // 0 until the kart has finished the race
+} RaceProgress;
+
+void RaceProgress_BeginSegment(RaceProgress* rp, vec2 from, int target) {
+	vec2 d = vec2_sub(rp->route->points[target], from);
+
+	rp->target = target;
+	rp->segStart = from;
+	rp->segLength = sqrtf(vec2_dot(d, d));
+	rp->segStartDist = rp->route->dist[target] - rp->segLength;
+	rp->fraction = 0;
+}
+
+void RaceProgress_Init(RaceProgress* rp, const RacePath* route, vec2 start, int firstTarget, int lap) {
+	rp->route = route;
+	rp->lap = lap;
+	rp->finishPlace = 0;
+	RaceProgress_BeginSegment(rp, start, firstTarget);
+	rp->distance = rp->lap + rp->segStartDist / route->lapLength;
+}
+
+float RaceProgress_Project(RaceProgress* rp, vec2 pos) {
+	if (rp->segLength < 1e-3f) {
+		return 1;
+	}
+	vec2 ab = vec2_sub(rp->route->points[rp->target], rp->segStart);
+	vec2 ap = vec2_sub(pos, rp->segStart);
+	return vec2_dot(ap, ab) / (rp->segLength * rp->segLength);
+}
+
+// Returns true on the tick the kart finishes the race, and the caller gives
+// it its place
+bool RaceProgress_Update(RaceProgress* rp, vec2 pos) {
+	bool finished = false;
+	float t = RaceProgress_Project(rp, pos);
+
+	const RacePath* route = rp->route;
+	vec2 toTarget = vec2_sub(pos, route->points[rp->target]);
+	bool nearMarker = vec2_dot(toTarget, toTarget) < MARKER_RADIUS * MARKER_RADIUS;
+
+	// Being past the end of the segment only counts alongside it, otherwise
+	// a kart off across the grass beyond a bend would tick markers off
+	bool pastEnd = t >= 1;
+	if (pastEnd && rp->segLength >= 1e-3f) {
+		vec2 ab = vec2_sub(route->points[rp->target], rp->segStart);
+		vec2 ap = vec2_sub(pos, rp->segStart);
+		float side = (ap.x * ab.y - ap.y * ab.x) / rp->segLength;
+		pastEnd = fabsf(side) < MARKER_LATERAL;
+	}
+
+	if (nearMarker || pastEnd) {
+		int passed = rp->target;
+		if (passed == route->finishMarker) {
+			rp->lap++;
+			finished = rp->lap > NUM_LAPS && rp->finishPlace == 0;
+		}
+
+		RaceProgress_BeginSegment(rp, route->points[passed], (passed + 1) % route->length);
+		t = RaceProgress_Project(rp, pos);
+	}
+
+	rp->fraction = clampf(t, 0, 1);
+	rp->distance = rp->lap + (rp->segStartDist + rp->fraction * rp->segLength) / route->lapLength;
+	return finished;
+}
 
-#define NUM_ENEMIES 2
-Enemy enemies[NUM_ENEMIES];
+// Whether a is ahead of b in the race
+bool RaceProgress_Ahead(const RaceProgress* a, const RaceProgress* b) {
+	if (a->finishPlace != 0 || b->finishPlace != 0) {
+		if (a->finishPlace == 0) {
+			return false;
+		}
+		if (b->finishPlace == 0) {
+			return true;
+		}
+		return a->finishPlace < b->finishPlace;
+	}
+	return a->distance > b->distance;
+}
 
-void NextTrack();
+#define DEFAULT_NUM_ENEMIES 2
+#define MAX_ENEMIES 1024
+#define ENEMY_SPACING 40
+#define ENEMY_TOP_SPEED 200
+#define ENEMY_ACCELERATION 2
+#define ENEMY_BRAKING 300
+#define ENEMY_MAX_OFFSET 48 // How far a bump can push a kart off its path
+#define ENEMY_OFFSET_RETURN 1 // How quickly it steers back, per second
+#define ENEMY_EDGE_MARGIN 24 // How close karts get to the edge of the road
+#define ENEMY_EDGE_STEER 60 // How quickly they steer away from it, texels per second
+#define ENEMY_PATH_STEP 4 // Spacing of the samples along a path spline
+#define SPLINE_SUBDIVISIONS 16
+#define MAX_ENEMY_PATHS 32
+
+// Players in a networked race
+#define MAX_CLIENTS 16
+
+// Players sharing the screen
+#define MAX_LOCAL_PLAYERS 4
+
+// Can be changed with --players
+int numLocalPlayers = 1;
+
+// Can be changed with --karts. Read by the track loader.
+int numEnemies = DEFAULT_NUM_ENEMIES;
+
+// A racing line smoothed into a Catmull-Rom spline through its markers, and
+// sampled at equal distances along it. Where a kart is and how fast it should
+// be going are then both a lookup by how far it has gone.
+typedef struct PathSpline {
+	vec2* points; // numSamples + 1 of them, the last is the first again
+	vec2* dirs;
+	float* speed; // Top speed at each sample, from the terrain there
+	int numSamples;
+	float step;
+	float invStep;
+	float length;
+	float* markerDist; // Distance along the spline to each marker
+} PathSpline;
+
+// One of the paths/N.txt racing lines, and the sprite sheet of the karts on it
+typedef struct EnemyPath {
+	RacePath route;
+	PathSpline spline;
+	SpriteImage* image;
+} EnemyPath;
+
+// Enemy karts, stored as parallel arrays so that the per-tick update is a
+// handful of flat loops the compiler can vectorize.
+typedef struct Enemies {
+	int count;
+
+	float posX[MAX_ENEMIES];
+	float posY[MAX_ENEMIES];
+	float dirX[MAX_ENEMIES];
+	float dirY[MAX_ENEMIES];
+	float speed[MAX_ENEMIES];
+
+	// Where the kart is along its path's spline, and how far to the left of
+	// it bumps have pushed it
+	float dist[MAX_ENEMIES];
+	float offset[MAX_ENEMIES];
+	float pathLength[MAX_ENEMIES];
+	float topSpeed[MAX_ENEMIES]; // At the kart's spot on its path, looked up each tick
+
+	int path[MAX_ENEMIES];
+	int sprite[MAX_ENEMIES];
+	RaceProgress progress[MAX_ENEMIES];
+
+	EnemyPath* paths;
+	int numPaths;
+} Enemies;
+
+void Transition_init(World* w);
+void Game_init(World* w);
+void Over_init();
+void Net_ClientTick(World* w, uint16_t keys);
+void Net_ClientKeepAlive(World* w);
 
 SDL_Window* window;
 SDL_Renderer* renderer;
@@ -321,7 +698,7 @@ void drawStringf(DrawStringInfo* dsi, const char* fmt, ...) {
 }
 
 void SetPixel(int x, int y, rgb colour) {
-	if (x > 0 && x < GAME_WIDTH && y > 0 && y < GAME_HEIGHT) {
+	if (x >= 0 && x < GAME_WIDTH && y >= 0 && y < GAME_HEIGHT) {
 		uint8_t* pixelData = textureData;
 		pixelData[y * rowPitch + x * 3 + 0] = colour.r;
 		pixelData[y * rowPitch + x * 3 + 1] = colour.g;
@@ -329,20 +706,103 @@ void SetPixel(int x, int y, rgb colour) {
 	}
 }
 
-bool gameRunning;
+SDL_atomic_t gameRunning; // Cleared by either thread when --sim-thread is on
+bool showStats = false;
+
+// Can be turned on with --sim-thread
+bool useSimThread = false;
+
+typedef enum NetMode {
+	Net_None,
+	Net_Server, // --server, runs the race without a window
+	Net_Client, // --connect, draws the race the server runs
+} NetMode;
+
+NetMode netMode = Net_None;
 int frame;
 float globalTime = 0;
 float lastGlobalTime = 0;
 float global_dt = 1.0f / 60;
 
-int trackNumber = 0;
-
 uint8_t* keyboardState = NULL;
 uint8_t* lastKeyboardState = NULL;
+int numKeyboardKeys;
 
+// Mouse motion since the last tick, summed over every event
 int mousexrel;
 int mouseyrel;
 
+#define MOUSE_SENSITIVITY 1
+#define PLAYER_TURN_SPEED deg2rad(90)
+
+// The keys the simulation reads. Recordings and network packets carry them as
+// one bit each, in this order.
+typedef enum InputKey {
+	INPUT_W,
+	INPUT_A,
+	INPUT_S,
+	INPUT_D,
+	INPUT_SPACE,
+	INPUT_LSHIFT,
+	INPUT_I,
+	INPUT_K,
+	INPUT_RETURN,
+	NUM_INPUT_KEYS
+} InputKey;
+
+const SDL_Scancode inputKeys[NUM_INPUT_KEYS] = {
+	[INPUT_W] = SDL_SCANCODE_W,
+	[INPUT_A] = SDL_SCANCODE_A,
+	[INPUT_S] = SDL_SCANCODE_S,
+	[INPUT_D] = SDL_SCANCODE_D,
+	[INPUT_SPACE] = SDL_SCANCODE_SPACE,
+	[INPUT_LSHIFT] = SDL_SCANCODE_LSHIFT,
+	[INPUT_I] = SDL_SCANCODE_I,
+	[INPUT_K] = SDL_SCANCODE_K,
+	[INPUT_RETURN] = SDL_SCANCODE_RETURN,
+};
+
+#define INPUT_BIT(key) (1 << (key))
+
+uint16_t Input_GetKeyBits(const uint8_t* keys) {
+	uint16_t bits = 0;
+	for (int i = 0; i < NUM_INPUT_KEYS; i++) {
+		if (keys[inputKeys[i]]) {
+			bits |= INPUT_BIT(i);
+		}
+	}
+	return bits;
+}
+
+// Driving keys for each split-screen player, in the order of INPUT_W to
+// INPUT_D
+const SDL_Scancode splitScreenKeys[MAX_LOCAL_PLAYERS][4] = {
+	{SDL_SCANCODE_W, SDL_SCANCODE_A, SDL_SCANCODE_S, SDL_SCANCODE_D},
+	{SDL_SCANCODE_UP, SDL_SCANCODE_LEFT, SDL_SCANCODE_DOWN, SDL_SCANCODE_RIGHT},
+	{SDL_SCANCODE_T, SDL_SCANCODE_F, SDL_SCANCODE_G, SDL_SCANCODE_H},
+	{SDL_SCANCODE_I, SDL_SCANCODE_J, SDL_SCANCODE_K, SDL_SCANCODE_L},
+};
+
+uint16_t Input_GetPlayerKeyBits(const uint8_t* keys, int player) {
+	if (player == 0) {
+		return Input_GetKeyBits(keys);
+	}
+
+	uint16_t bits = 0;
+	for (int i = 0; i < 4; i++) {
+		if (keys[splitScreenKeys[player][i]]) {
+			bits |= INPUT_BIT(INPUT_W + i);
+		}
+	}
+	return bits;
+}
+
+void Input_SetKeyBits(uint8_t* keys, uint16_t bits) {
+	for (int i = 0; i < NUM_INPUT_KEYS; i++) {
+		keys[inputKeys[i]] = (bits >> i) & 1;
+	}
+}
+
 typedef enum CameraMode {
 	FreeFlyCamera,
 	FirstPerson,
@@ -407,187 +867,1829 @@ rgba SampleSurface_rgba(SDL_Surface* surf, int x, int y) {
 	return (rgba){r,g,b,a};
 }
 
-typedef struct PlayerState {
-	vec2* path;
-	int pathLen;
-	int markerNumber;
+typedef enum TerrainClass {
+	TERRAIN_OFFROAD = 0,
+	TERRAIN_ROAD,
+	TERRAIN_GRASS,
+	TERRAIN_TREE,
+	NUM_TERRAIN_CLASSES
+} TerrainClass;
 
-	int lapNumber;
-} PlayerState;
+typedef struct TerrainInfo {
+	float drag;
+} TerrainInfo;
 
-PlayerState mainPlayerState;
+const TerrainInfo terrainInfo[NUM_TERRAIN_CLASSES] = {
+	[TERRAIN_OFFROAD] = {.drag = 15},
+	[TERRAIN_ROAD] = {.drag = 5},
+	[TERRAIN_GRASS] = {.drag = 15},
+	[TERRAIN_TREE] = {.drag = 15},
+};
 
-void InitPlayerState(PlayerState* ps, const char* path) {
-	FILE* f = fopen(path, "r");
+#define TERRAIN_TILE_LOG2 4
+#define TERRAIN_TILE_SIZE (1 << TERRAIN_TILE_LOG2)
+#define TERRAIN_BLOCK_BYTES (TERRAIN_TILE_SIZE * TERRAIN_TILE_SIZE / 2)
+#define TERRAIN_TILE_MIXED 0x80000000u
+
+// attributes.png cut into 16x16 tiles. A tile that is all one class is
+// stored as just that class, and the rest point at a block of 4 bit
+// classes, two texels per byte. Most of a track is one big field of grass,
+// so memory grows with the length of the edges rather than the area.
+typedef struct TerrainMap {
+	uint32_t* tiles; // A TerrainClass, or TERRAIN_TILE_MIXED | block number
+	uint8_t* blocks;
+	int numBlocks;
+	int tilesX;
+	int tilesY;
+	int w;
+	int h;
+} TerrainMap;
 
-	int numPoints;
-	fscanf(f, "%d", &numPoints);
-	vec2* points = malloc(numPoints * sizeof(vec2));
-	for (int i = 0; i < numPoints; i++) {
-		fscanf(f, "%f,%f", &points[i].x, &points[i].y);
+TerrainClass ClassifyAttribute(rgb c) {
+	if (c.r == 255 && c.g == 0 && c.b == 0) {
+		return TERRAIN_ROAD;
+	}
+	if (c.r == 0 && c.g == 255 && c.b == 0) {
+		return TERRAIN_GRASS;
+	}
+	if (c.r == 0 && c.g == 0 && c.b == 255) {
+		return TERRAIN_TREE;
+	}
+	return TERRAIN_OFFROAD;
+}
 
-		if (SHOW_PATH_MARKERS) {
-			vec2 point = points[i];
-			int s = AddSprite("player_path_marker.png");
-			sprites[s].pos = (vec3){point.x, point.y, 0};
+// Texels past the edge of the attributes count as off-road, which fills out
+// the tiles along the right and bottom edges
+TerrainClass ClassifyAttributeAt(SDL_Surface* attributes, int x, int y) {
+	if (x >= attributes->w || y >= attributes->h) {
+		return TERRAIN_OFFROAD;
+	}
+	return ClassifyAttribute(SampleSurface(attributes, x, y));
+}
+
+void TerrainMap_Init(TerrainMap* tm, Arena* arena, SDL_Surface* attributes) {
+	tm->w = attributes->w;
+	tm->h = attributes->h;
+	tm->tilesX = (tm->w + TERRAIN_TILE_SIZE - 1) >> TERRAIN_TILE_LOG2;
+	tm->tilesY = (tm->h + TERRAIN_TILE_SIZE - 1) >> TERRAIN_TILE_LOG2;
+	tm->tiles = Arena_Alloc(arena, (size_t)tm->tilesX * tm->tilesY * sizeof(uint32_t));
+
+	// Find the mixed tiles first so their blocks can be allocated in one go
+	tm->numBlocks = 0;
+	for (int ty = 0; ty < tm->tilesY; ty++) {
+		for (int tx = 0; tx < tm->tilesX; tx++) {
+			int x0 = tx << TERRAIN_TILE_LOG2;
+			int y0 = ty << TERRAIN_TILE_LOG2;
+			TerrainClass first = ClassifyAttributeAt(attributes, x0, y0);
+			bool mixed = false;
+			for (int i = 0; i < TERRAIN_TILE_SIZE && !mixed; i++) {
+				for (int j = 0; j < TERRAIN_TILE_SIZE && !mixed; j++) {
+					mixed = ClassifyAttributeAt(attributes, x0 + j, y0 + i) != first;
+				}
+			}
+			tm->tiles[ty * tm->tilesX + tx] = mixed ? TERRAIN_TILE_MIXED | tm->numBlocks++ : first;
 		}
 	}
 
-	ps->path = points;
-	ps->pathLen = numPoints;
-	ps->markerNumber = 0;
+	tm->blocks = Arena_Calloc(arena, tm->numBlocks, TERRAIN_BLOCK_BYTES);
+	for (int t = 0; t < tm->tilesX * tm->tilesY; t++) {
+		if (!(tm->tiles[t] & TERRAIN_TILE_MIXED)) {
+			continue;
+		}
 
-	ps->lapNumber = 1;
+		uint8_t* block = tm->blocks + (size_t)(tm->tiles[t] & ~TERRAIN_TILE_MIXED) * TERRAIN_BLOCK_BYTES;
+		int x0 = (t % tm->tilesX) << TERRAIN_TILE_LOG2;
+		int y0 = (t / tm->tilesX) << TERRAIN_TILE_LOG2;
+		for (int i = 0; i < TERRAIN_TILE_SIZE; i++) {
+			for (int j = 0; j < TERRAIN_TILE_SIZE; j++) {
+				int index = (i << TERRAIN_TILE_LOG2) | j;
+				block[index >> 1] |= ClassifyAttributeAt(attributes, x0 + j, y0 + i) << ((index & 1) << 2);
+			}
+		}
+	}
 }
 
-void InitEnemyAI(Enemy* enemy, const char* path) {
-	FILE* f = fopen(path, "r");
-	
-	char spritePath[1024];
-	fscanf(f, "%s", spritePath);
-	enemy->sprite = AddSpriteRotations(spritePath);
-	
-	int numPoints;
-	fscanf(f, "%d", &numPoints);
-	vec2* points = malloc(numPoints * sizeof(vec2));
-	for (int i = 0; i < numPoints; i++) {
-		fscanf(f, "%f,%f", &points[i].x, &points[i].y);
+uint32_t TerrainMap_Tile(const TerrainMap* tm, int x, int y) {
+	return tm->tiles[(y >> TERRAIN_TILE_LOG2) * tm->tilesX + (x >> TERRAIN_TILE_LOG2)];
+}
 
-		if (SHOW_PATH_MARKERS) {
-			vec2 point = points[i];
-			int s = AddSprite("path_marker.png");
-			sprites[s].pos = (vec3){point.x, point.y, 0};
-		}
+// Anything outside the map counts as off-road
+TerrainClass TerrainMap_Get(const TerrainMap* tm, int x, int y) {
+	if ((unsigned)x >= (unsigned)tm->w || (unsigned)y >= (unsigned)tm->h) {
+		return TERRAIN_OFFROAD;
 	}
-	enemy->path = points;
-	enemy->pathLength = numPoints;
-	enemy->pathIndex = -1;
 
-	enemy->pos = enemy->path[0];
+	uint32_t tile = TerrainMap_Tile(tm, x, y);
+	if (!(tile & TERRAIN_TILE_MIXED)) {
+		return tile;
+	}
 
-	enemy->speed = 200;
+	const uint8_t* block = tm->blocks + (size_t)(tile & ~TERRAIN_TILE_MIXED) * TERRAIN_BLOCK_BYTES;
+	int index = ((y & (TERRAIN_TILE_SIZE - 1)) << TERRAIN_TILE_LOG2) | (x & (TERRAIN_TILE_SIZE - 1));
+	return (block[index >> 1] >> ((index & 1) << 2)) & 0xF;
+}
 
-	enemy->lap = 1;
+////////////////////
+// Virtual texturing
+//
+// Tracks too big to hold in memory are cut into tiles and stored in a page
+// file (track.pages, made with --build-pages). Only the tiles around the
+// cameras are kept in a fixed size cache, which a background thread fills
+// as they come into view. Until a tile arrives the floor is drawn from a
+// low resolution copy of the whole track, which is always resident.
+
+#define PAGE_FILE_MAGIC "SBKP"
+#define PAGE_FILE_VERSION 1
+
+// DrawFloorFixed steps across the track in 16.16 fixed point
+#define MAX_TRACK_LOG2 15
+
+#define VT_TILE_LOG2 7
+#define VT_TILE_SIZE (1 << VT_TILE_LOG2)
+#define VT_TILE_MASK (VT_TILE_SIZE - 1)
+#define VT_TILE_BYTES (VT_TILE_SIZE * VT_TILE_SIZE * 3)
+#define VT_CACHE_TILES 512 // 24 MB
+#define VT_LOW_RES_LOG2 10 // The low resolution copy is at most 1024x1024
+#define VT_QUEUE_SIZE 64 // Must be a power of 2
+#define VT_STREAM_DISTANCE 2048 // Further than this the low resolution copy is used
+#define VT_PREFETCH_DISTANCE 1024
+
+// Page table entries for tiles that aren't in the cache
+#define VT_MISSING -1
+#define VT_LOADING -2
+
+typedef struct PageFileHeader {
+	char magic[4];
+	uint32_t version;
+	int32_t sizeLog2;
+	int32_t tileLog2;
+	int32_t lowResLog2;
+	int32_t terrainW;
+	int32_t terrainH;
+	int32_t terrainBlocks;
+	uint64_t tilesOffset; // Tiles in row order, each VT_TILE_SIZE rows of RGB24
+	uint64_t lowResOffset;
+	uint64_t terrainOffset; // TerrainMap tiles, then its blocks
+} PageFileHeader;
+
+// Cache slots passed between the main thread and the tile loader. Each end
+// only has one thread pushing and one popping, so it needs no lock.
+typedef struct SlotQueue {
+	int slots[VT_QUEUE_SIZE];
+	SDL_atomic_t head;
+	SDL_atomic_t tail;
+} SlotQueue;
+
+void SlotQueue_Push(SlotQueue* q, int slot) {
+	unsigned tail = SDL_AtomicGet(&q->tail);
+	q->slots[tail % VT_QUEUE_SIZE] = slot;
+	SDL_AtomicSet(&q->tail, tail + 1);
 }
 
-typedef struct Track {
-	SDL_Surface* trackImage;
-	SDL_Surface* attributeImage;
-	int size_log2;
-	char trackName[1024];
-} Track;
+bool SlotQueue_Pop(SlotQueue* q, int* slot) {
+	unsigned head = SDL_AtomicGet(&q->head);
+	if (head == (unsigned)SDL_AtomicGet(&q->tail)) {
+		return false;
+	}
+	*slot = q->slots[head % VT_QUEUE_SIZE];
+	SDL_AtomicSet(&q->head, head + 1);
+	return true;
+}
 
-Camera mainCamera;
+typedef struct VirtualTexture {
+	int fd;
+	uint64_t tilesOffset;
+	int sizeLog2;
+	int tilesLog2; // Tiles along each side of the track
+
+	// The cache slot of every tile, or VT_MISSING/VT_LOADING. Only the main
+	// thread changes this, and never while a frame is being drawn.
+	int* pageTable;
+
+	uint8_t* cache;
+	int numSlots;
+	int* slotTile; // Tile in each slot, or -1
+	uint32_t* slotUsed; // Frame each slot was last in view
+
+	uint8_t* lowRes;
+	int lowResLog2;
+	int lowResShift;
+
+	SlotQueue requests;
+	SlotQueue loaded;
+	SDL_sem* wake; // Posted once per request, and once more to stop
+	SDL_Thread* thread;
+	int inFlight;
+
+	uint32_t frame;
+	int numLoads;
+	int numEvictions;
+} VirtualTexture;
+
+void VirtualTexture_Read(VirtualTexture* vt, void* dst, size_t size, uint64_t offset) {
+	if (pread(vt->fd, dst, size, offset) != (ssize_t)size) {
+		fprintf(stderr, "Unable to read page file: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
 
-void Track_Load(Track* tr, const char* path) {
-	char buf[1024];
+void VirtualTexture_ReadTile(VirtualTexture* vt, int tile, int slot) {
+	VirtualTexture_Read(vt, vt->cache + (size_t)slot * VT_TILE_BYTES, VT_TILE_BYTES, vt->tilesOffset + (uint64_t)tile * VT_TILE_BYTES);
+}
 
-	//memset(buf, 0, sizeof(buf));
-	sprintf(buf, "%s/track.png", path);
+// Opens a page file and reads the parts that are always resident: the low
+// resolution copy of the track, and the terrain
+VirtualTexture* VirtualTexture_Open(Arena* arena, const char* path, TerrainMap* terrain) {
+	VirtualTexture* vt = Arena_Calloc(arena, 1, sizeof(VirtualTexture));
+	vt->fd = open(path, O_RDONLY);
+	if (vt->fd < 0) {
+		fprintf(stderr, "Unable to open page file %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
 
-	SDL_Surface* surf = IMG_Load(buf);
-	if (surf == NULL) {
-		fprintf(stderr, "Unable to load track: %s\n", IMG_GetError());
+	PageFileHeader header;
+	if (pread(vt->fd, &header, sizeof(header), 0) != sizeof(header) || memcmp(header.magic, PAGE_FILE_MAGIC, 4) != 0 || header.version != PAGE_FILE_VERSION) {
+		fprintf(stderr, "%s is not a page file\n", path);
+		exit(EXIT_FAILURE);
+	}
+	if (header.sizeLog2 < VT_TILE_LOG2 || header.sizeLog2 > MAX_TRACK_LOG2) {
+		fprintf(stderr, "Page file %s is for a %d pixel track, tracks must be %d to %d pixels across\n",
+			path, 1 << header.sizeLog2, VT_TILE_SIZE, 1 << MAX_TRACK_LOG2);
+		exit(EXIT_FAILURE);
+	}
+	if (header.tileLog2 != VT_TILE_LOG2) {
+		fprintf(stderr, "Page file %s has %dx%d tiles, expected %dx%d. Rebuild it with --build-pages.\n",
+			path, 1 << header.tileLog2, 1 << header.tileLog2, VT_TILE_SIZE, VT_TILE_SIZE);
 		exit(EXIT_FAILURE);
 	}
 
-	if (surf->w != surf->h || !IsPowerOfTwo(surf->w)) {
-		fprintf(stderr, "Invalid track size: %dx%d. Track width and height must be the same and a power of 2.\n", surf->w, surf->h);
+	vt->sizeLog2 = header.sizeLog2;
+	vt->tilesLog2 = header.sizeLog2 - VT_TILE_LOG2;
+	vt->tilesOffset = header.tilesOffset;
+	int numTiles = 1 << (vt->tilesLog2 * 2);
+
+	vt->pageTable = Arena_Alloc(arena, numTiles * sizeof(int));
+	for (int i = 0; i < numTiles; i++) {
+		vt->pageTable[i] = VT_MISSING;
+	}
+
+	vt->numSlots = numTiles < VT_CACHE_TILES ? numTiles : VT_CACHE_TILES;
+	vt->cache = Arena_Alloc(arena, (size_t)vt->numSlots * VT_TILE_BYTES);
+	vt->slotTile = Arena_Alloc(arena, vt->numSlots * sizeof(int));
+	vt->slotUsed = Arena_Calloc(arena, vt->numSlots, sizeof(uint32_t));
+	for (int i = 0; i < vt->numSlots; i++) {
+		vt->slotTile[i] = -1;
 	}
 
-	int size_log2 = log2f(surf->w);
+	vt->lowResLog2 = header.lowResLog2;
+	vt->lowResShift = header.sizeLog2 - header.lowResLog2;
+	size_t lowResSize = (size_t)3 << (header.lowResLog2 * 2);
+	vt->lowRes = Arena_Alloc(arena, lowResSize);
+	VirtualTexture_Read(vt, vt->lowRes, lowResSize, header.lowResOffset);
+
+	terrain->w = header.terrainW;
+	terrain->h = header.terrainH;
+	terrain->tilesX = (terrain->w + TERRAIN_TILE_SIZE - 1) >> TERRAIN_TILE_LOG2;
+	terrain->tilesY = (terrain->h + TERRAIN_TILE_SIZE - 1) >> TERRAIN_TILE_LOG2;
+	terrain->numBlocks = header.terrainBlocks;
+	size_t tilesSize = (size_t)terrain->tilesX * terrain->tilesY * sizeof(uint32_t);
+	size_t blocksSize = (size_t)terrain->numBlocks * TERRAIN_BLOCK_BYTES;
+	terrain->tiles = Arena_Alloc(arena, tilesSize);
+	terrain->blocks = Arena_Alloc(arena, blocksSize);
+	VirtualTexture_Read(vt, terrain->tiles, tilesSize, header.terrainOffset);
+	VirtualTexture_Read(vt, terrain->blocks, blocksSize, header.terrainOffset + tilesSize);
+
+	return vt;
+}
 
-	SDL_Surface* surf2 = SDL_ConvertSurfaceFormat(surf, SDL_PIXELFORMAT_RGB24, 0);
-	tr->trackImage = surf2;
-	tr->size_log2 = size_log2;
+typedef struct TileDistance {
+	int tile;
+	float distance;
+} TileDistance;
 
-	//memset(buf, 0, sizeof(buf));
-	sprintf(buf, "%s/attributes.png", path);
+int cmp_tiles(const void* a, const void* b) {
+	float da = ((const TileDistance*)a)->distance;
+	float db = ((const TileDistance*)b)->distance;
+	return (da > db) - (da < db);
+}
 
-	SDL_Surface* attr_surf = IMG_Load(buf);
-	SDL_Surface* attr_surf2 = SDL_ConvertSurfaceFormat(attr_surf, SDL_PIXELFORMAT_RGB24, 0);
-	tr->attributeImage = attr_surf2;
+// Loads the tiles around where the race starts before the track is shown,
+// so the first frames don't have to fall back to the low resolution copy
+void VirtualTexture_Prefetch(VirtualTexture* vt, vec2 pos) {
+	int tiles = 1 << vt->tilesLog2;
+	int radius = VT_PREFETCH_DISTANCE / VT_TILE_SIZE + 1;
+	int cx = (int)pos.x >> VT_TILE_LOG2;
+	int cy = (int)pos.y >> VT_TILE_LOG2;
+
+	TileDistance* near = malloc((2 * radius + 1) * (2 * radius + 1) * sizeof(TileDistance));
+	int numNear = 0;
+	for (int ty = cy - radius; ty <= cy + radius; ty++) {
+		for (int tx = cx - radius; tx <= cx + radius; tx++) {
+			if (tx < 0 || ty < 0 || tx >= tiles || ty >= tiles) {
+				continue;
+			}
+			vec2 d = vec2_sub((vec2){(tx + 0.5f) * VT_TILE_SIZE, (ty + 0.5f) * VT_TILE_SIZE}, pos);
+			near[numNear++] = (TileDistance){(ty << vt->tilesLog2) + tx, sqrtf(vec2_dot(d, d))};
+		}
+	}
+	qsort(near, numNear, sizeof(TileDistance), cmp_tiles);
+
+	for (int i = 0; i < numNear && i < vt->numSlots / 2; i++) {
+		VirtualTexture_ReadTile(vt, near[i].tile, i);
+		vt->slotTile[i] = near[i].tile;
+		vt->pageTable[near[i].tile] = i;
+	}
+	free(near);
+}
+
+int VirtualTexture_Thread(void* data) {
+	VirtualTexture* vt = data;
+	while (true) {
+		SDL_SemWait(vt->wake);
+
+		// Being woken with nothing to load means stop
+		int slot;
+		if (!SlotQueue_Pop(&vt->requests, &slot)) {
+			return 0;
+		}
+		VirtualTexture_ReadTile(vt, vt->slotTile[slot], slot);
+		SlotQueue_Push(&vt->loaded, slot);
+	}
+}
+
+void VirtualTexture_Start(VirtualTexture* vt) {
+	vt->wake = SDL_CreateSemaphore(0);
+	vt->thread = SDL_CreateThread(VirtualTexture_Thread, "TileLoader", vt);
+	if (vt->thread == NULL) {
+		fprintf(stderr, "Unable to create tile loader thread: %s\n", SDL_GetError());
+		exit(EXIT_FAILURE);
+	}
+}
 
+void VirtualTexture_Close(VirtualTexture* vt) {
+	SDL_SemPost(vt->wake);
+	SDL_WaitThread(vt->thread, NULL);
+	SDL_DestroySemaphore(vt->wake);
+	close(vt->fd);
+	printf("Streamed %d tiles, evicted %d\n", vt->numLoads, vt->numEvictions);
+}
+
+void PageFile_Write(FILE* f, const void* data, size_t size) {
+	if (fwrite(data, 1, size, f) != size) {
+		fprintf(stderr, "Unable to write page file: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Cuts a track's track.png and attributes.png into a page file. This needs
+// the whole track in memory once, but only once.
+void PageFile_Build(const char* trackPath) {
+	char buf[1024];
+	sprintf(buf, "%s/track.png", trackPath);
+	SDL_Surface* surf = IMG_Load(buf);
+	if (surf == NULL) {
+		fprintf(stderr, "Unable to load track: %s\n", IMG_GetError());
+		exit(EXIT_FAILURE);
+	}
+	if (surf->w != surf->h || !IsPowerOfTwo(surf->w) || surf->w < VT_TILE_SIZE || surf->w > 1 << MAX_TRACK_LOG2) {
+		fprintf(stderr, "Invalid track size: %dx%d. Track width and height must be the same and a power of 2, from %d to %d.\n", surf->w, surf->h, VT_TILE_SIZE, 1 << MAX_TRACK_LOG2);
+		exit(EXIT_FAILURE);
+	}
+	SDL_Surface* image = SDL_ConvertSurfaceFormat(surf, SDL_PIXELFORMAT_RGB24, 0);
 	SDL_FreeSurface(surf);
-	SDL_FreeSurface(attr_surf);
 
-	if (ENABLE_TREES) {
-		for (int i = 0; i < tr->attributeImage->h; i++) {
-			for (int j = 0; j < tr->attributeImage->w; j++) {
-				rgb c = SampleSurface(tr->attributeImage, j, i);
-				if (memcmp(&c, &(rgb){0, 0, 255}, sizeof(rgb)) == 0) {
-					int s = AddSprite("tree.png");
-					sprites[s].pos = (vec3){j, i, 0};
+	PageFileHeader header = {
+		.version = PAGE_FILE_VERSION,
+		.sizeLog2 = log2f(image->w),
+		.tileLog2 = VT_TILE_LOG2,
+	};
+	memcpy(header.magic, PAGE_FILE_MAGIC, 4);
+	header.lowResLog2 = header.sizeLog2 < VT_LOW_RES_LOG2 ? header.sizeLog2 : VT_LOW_RES_LOG2;
+
+	char pagesPath[1024];
+	sprintf(pagesPath, "%s/track.pages", trackPath);
+	FILE* f = fopen(pagesPath, "wb");
+	if (f == NULL) {
+		fprintf(stderr, "Unable to create %s\n", pagesPath);
+		exit(EXIT_FAILURE);
+	}
+	// Written again at the end, once the offsets are known
+	PageFile_Write(f, &header, sizeof(header));
+
+	header.tilesOffset = ftell(f);
+	int tiles = image->w / VT_TILE_SIZE;
+	for (int ty = 0; ty < tiles; ty++) {
+		for (int tx = 0; tx < tiles; tx++) {
+			for (int i = 0; i < VT_TILE_SIZE; i++) {
+				const uint8_t* row = (const uint8_t*)image->pixels + (size_t)(ty * VT_TILE_SIZE + i) * image->pitch + tx * VT_TILE_SIZE * 3;
+				PageFile_Write(f, row, VT_TILE_SIZE * 3);
+			}
+		}
+	}
+
+	// Each low resolution texel averages the opaque texels it covers, or is
+	// transparent if most of them are
+	header.lowResOffset = ftell(f);
+	int shift = header.sizeLog2 - header.lowResLog2;
+	int lowResSize = 1 << header.lowResLog2;
+	uint8_t* row = malloc(lowResSize * 3);
+	for (int y = 0; y < lowResSize; y++) {
+		for (int x = 0; x < lowResSize; x++) {
+			int sum[3] = {0};
+			int opaque = 0;
+			for (int i = 0; i < 1 << shift; i++) {
+				for (int j = 0; j < 1 << shift; j++) {
+					const uint8_t* p = (const uint8_t*)image->pixels + (size_t)((y << shift) + i) * image->pitch + ((x << shift) + j) * 3;
+					if (p[0] == 255 && p[1] == 0 && p[2] == 255) {
+						continue;
+					}
+					for (int c = 0; c < 3; c++) {
+						sum[c] += p[c];
+					}
+					opaque++;
+				}
+			}
+
+			uint8_t* out = row + x * 3;
+			if (opaque * 2 < 1 << (shift * 2)) {
+				out[0] = 255;
+				out[1] = 0;
+				out[2] = 255;
+			}
+			else {
+				for (int c = 0; c < 3; c++) {
+					out[c] = sum[c] / opaque;
 				}
 			}
 		}
+		PageFile_Write(f, row, lowResSize * 3);
 	}
+	free(row);
+	SDL_FreeSurface(image);
 
-	//memset(buf, 0, sizeof(buf));
-	sprintf(buf, "%s/paths/player.txt", path);
+	sprintf(buf, "%s/attributes.png", trackPath);
+	SDL_Surface* attr_surf = IMG_Load(buf);
+	if (attr_surf == NULL) {
+		fprintf(stderr, "Unable to load track attributes: %s\n", IMG_GetError());
+		exit(EXIT_FAILURE);
+	}
+	SDL_Surface* attr_surf2 = SDL_ConvertSurfaceFormat(attr_surf, SDL_PIXELFORMAT_RGB24, 0);
+	SDL_FreeSurface(attr_surf);
 
-	InitPlayerState(&mainPlayerState, buf);
+	Arena arena = {.name = "Page file"};
+	TerrainMap terrain;
+	TerrainMap_Init(&terrain, &arena, attr_surf2);
+	SDL_FreeSurface(attr_surf2);
 
-	//memset(buf, 0, sizeof(buf));
-	sprintf(buf, "%s/paths/1.txt", path);
-	InitEnemyAI(&enemies[0], buf);
+	header.terrainW = terrain.w;
+	header.terrainH = terrain.h;
+	header.terrainBlocks = terrain.numBlocks;
+	header.terrainOffset = ftell(f);
+	PageFile_Write(f, terrain.tiles, (size_t)terrain.tilesX * terrain.tilesY * sizeof(uint32_t));
+	PageFile_Write(f, terrain.blocks, (size_t)terrain.numBlocks * TERRAIN_BLOCK_BYTES);
+	Arena_Free(&arena);
 
-	//memset(buf, 0, sizeof(buf));
-	sprintf(buf, "%s/paths/2.txt", path);
-	InitEnemyAI(&enemies[1], buf);
+	fseek(f, 0, SEEK_SET);
+	PageFile_Write(f, &header, sizeof(header));
+	fclose(f);
 
-	sprintf(buf, "%s/info.txt", path);
-	FILE* f = fopen(buf, "r");
+	printf("Wrote %s: %dx%d tiles, %d of %d terrain tiles mixed\n", pagesPath, tiles, tiles, terrain.numBlocks, terrain.tilesX * terrain.tilesY);
+}
 
-	char trackName[1024];
-	fgets(trackName, sizeof(trackName), f);
-	trackName[strlen(trackName) - 1] = 0;
-	strcpy(tr->trackName, trackName);
+typedef struct PlayerState {
+	RaceProgress progress;
+	float bump; // How hard the kart was hit in the last tick
+} PlayerState;
 
-	float startX, startY;
-	fscanf(f, "%f,%f", &startX, &startY);
+typedef struct LocalPlayer {
+	Camera* camera;
+	vec2* velocity;
+	PlayerState* state;
+	int place;
+} LocalPlayer;
+
+#define COLLISION_CELL_SIZE 64
+#define TREE_RADIUS 16
+#define KART_RADIUS 12
+#define KART_RESTITUTION 0.5f
+
+// Karts are bucketed at the start of a tick and can move a little before
+// they are tested, so queries are padded by this much
+#define COLLISION_MARGIN 8
+#define COLLISION_QUERY_RADIUS (KART_RADIUS + TREE_RADIUS + COLLISION_MARGIN)
+
+// Uniform grid over the track for the collision broad phase. A cell is
+// bigger than the largest contact distance, so a query only ever looks at
+// the 2x2 or 3x3 block of cells its bounding box overlaps.
+typedef struct CollisionGrid {
+	int cellsX;
+	int cellsY;
+
+	// Trees never move, so they are bucketed once at load time and stored in
+	// cell order. The trees in cell c are trees[treeStart[c]] up to
+	// trees[treeStart[c + 1]].
+	int* treeStart;
+	vec2* trees;
+	int numTrees;
+
+	// Karts are re-bucketed every tick the same way. Kart 0 is the player and
+	// kart i + 1 is enemy i.
+	int* kartStart;
+	int* kartFill;
+	int* karts;
+	int* kartCell;
+	int maxKarts;
+
+	int tests; // Narrow phase tests in the last tick
+} CollisionGrid;
+
+int CollisionGrid_CellCoord(int cells, float x) {
+	int c = x / COLLISION_CELL_SIZE;
+	if (x < 0 || c < 0) {
+		return 0;
+	}
+	if (c >= cells) {
+		return cells - 1;
+	}
+	return c;
+}
 
-	mainCamera.position = (vec3){
-		startX,
-		startY,
-		20
-	};
+int CollisionGrid_Cell(const CollisionGrid* g, vec2 p) {
+	return CollisionGrid_CellCoord(g->cellsY, p.y) * g->cellsX + CollisionGrid_CellCoord(g->cellsX, p.x);
+}
+
+void CollisionGrid_Init(CollisionGrid* g, Arena* arena, int w, int h, const vec2* trees, int numTrees, int maxKarts) {
+	g->cellsX = (w + COLLISION_CELL_SIZE - 1) / COLLISION_CELL_SIZE;
+	g->cellsY = (h + COLLISION_CELL_SIZE - 1) / COLLISION_CELL_SIZE;
+	int numCells = g->cellsX * g->cellsY;
 
-	Camera_SetFovX(&mainCamera, deg2rad(90));
-	Camera_SetYawPitch(&mainCamera, deg2rad(-90), deg2rad(-20));
-	mainCamera.mode = FirstPerson;
+	// Counting sort the trees into cell order
+	g->treeStart = Arena_Calloc(arena, numCells + 1, sizeof(int));
+	for (int i = 0; i < numTrees; i++) {
+		g->treeStart[CollisionGrid_Cell(g, trees[i]) + 1]++;
+	}
+	for (int c = 0; c < numCells; c++) {
+		g->treeStart[c + 1] += g->treeStart[c];
+	}
+
+	int* fill = malloc(numCells * sizeof(int));
+	memcpy(fill, g->treeStart, numCells * sizeof(int));
+	g->trees = Arena_Alloc(arena, numTrees * sizeof(vec2));
+	for (int i = 0; i < numTrees; i++) {
+		g->trees[fill[CollisionGrid_Cell(g, trees[i])]++] = trees[i];
+	}
+	free(fill);
+	g->numTrees = numTrees;
+
+	g->kartStart = Arena_Calloc(arena, numCells + 1, sizeof(int));
+	g->kartFill = Arena_Alloc(arena, numCells * sizeof(int));
+	g->karts = Arena_Alloc(arena, maxKarts * sizeof(int));
+	g->kartCell = Arena_Alloc(arena, maxKarts * sizeof(int));
+	g->maxKarts = maxKarts;
 }
 
-void Track_Unload(Track* tr) {
-	SDL_FreeSurface(tr->trackImage);
+////////////////////
+// Track distance field
+
+// Signed distance from the edge of the road, negative on the road and
+// positive off it. Karts look it up to find how far they are from the edge
+// and which way the road is, so neither needs to search the terrain map.
+// It's kept on a grid of cells at most SDF_MAX_CELLS a side, each holding a
+// distance in 1/SDF_UNITS texels.
+#define SDF_MAX_CELLS 1024
+#define SDF_MIN_CELL_LOG2 2
+#define SDF_UNITS 4
+#define SDF_MAX_THREADS 8
+
+// Karts can drive this far off the road before they hit the wall
+#define TRACK_WALL_DISTANCE 48
+
+typedef struct TrackSDF {
+	int16_t* dist;
+	int cells;
+	int cellLog2;
+	int size;
+} TrackSDF;
+
+// The squared distance transform is separable, so it's done a column at a
+// time and then a row at a time, each using the lower envelope of parabolas
+// from Felzenszwalb and Huttenlocher. Both passes are linear in the number
+// of cells, and every column (then row) is independent, so they're split
+// between threads.
+typedef struct SDFJob {
+	SDL_Thread* thread;
+	const uint8_t* road;
+	float* inside; // Squared distance to the nearest off-road cell
+	float* outside; // Squared distance to the nearest road cell
+	int cells;
+	int first;
+	int last;
+	bool rows;
+} SDFJob;
+
+// Where the parabolas rooted at q and p cross
+float SDF_Intersect(const float* f, int q, int p) {
+	return ((f[q] + q * q) - (f[p] + p * p)) / (2 * (q - p));
 }
 
-Track track;
+// d[q] = min over p of (q - p)^2 + f[p], with stride apart elements
+void SDF_Transform1D(float* d, int stride, int n, float* f, int* v, float* z) {
+	for (int q = 0; q < n; q++) {
+		f[q] = d[q * stride];
+	}
 
-void VisualizeRayDirections() {
-	for (int i = 0; i < GAME_HEIGHT; i++) {
-		for (int j = 0; j < GAME_WIDTH; j++) {
-			float x = mapf(j, 0, GAME_WIDTH, -1, 1);
-			float y = mapf(i, 0, GAME_HEIGHT, 1, -1);
+	int k = 0;
+	v[0] = 0;
+	z[0] = -INFINITY;
+	z[1] = INFINITY;
+	for (int q = 1; q < n; q++) {
+		float s = SDF_Intersect(f, q, v[k]);
+		while (s <= z[k]) {
+			k--;
+			s = SDF_Intersect(f, q, v[k]);
+		}
+		k++;
+		v[k] = q;
+		z[k] = s;
+		z[k + 1] = INFINITY;
+	}
 
-			vec3 dir = vec3_scale(vec3_normalize(vec3_add(
-				vec3_scale(mainCamera.forward, mainCamera.cam_dist), 
-				vec3_add(vec3_scale(mainCamera.right, x * GAME_WIDTH / 2), vec3_scale(mainCamera.up, y * GAME_HEIGHT / 2)))), 255);
+	k = 0;
+	for (int q = 0; q < n; q++) {
+		while (z[k + 1] < q) {
+			k++;
+		}
+		int p = v[k];
+		d[q * stride] = (q - p) * (q - p) + f[p];
+	}
+}
 
-			// SetPixel(j, i, (rgb){(uint8_t)(j ^ i), 0, 0});
-			SetPixel(j, i, (rgb){fabsf(dir.x), fabsf(dir.y), fabsf(dir.z)});
+int SDF_Thread(void* data) {
+	SDFJob* job = data;
+	int n = job->cells;
+	float* f = malloc(n * sizeof(float));
+	int* v = malloc(n * sizeof(int));
+	float* z = malloc((n + 1) * sizeof(float));
+
+	// Cells with nothing of the other kind anywhere in their column stay at
+	// this until the row pass
+	float far = 2.0f * n * n;
+
+	for (int i = job->first; i < job->last; i++) {
+		if (job->rows) {
+			SDF_Transform1D(&job->inside[i * n], 1, n, f, v, z);
+			SDF_Transform1D(&job->outside[i * n], 1, n, f, v, z);
+		}
+		else {
+			for (int y = 0; y < n; y++) {
+				bool road = job->road[y * n + i];
+				job->inside[y * n + i] = road ? far : 0;
+				job->outside[y * n + i] = road ? 0 : far;
+			}
+			SDF_Transform1D(&job->inside[i], n, n, f, v, z);
+			SDF_Transform1D(&job->outside[i], n, n, f, v, z);
 		}
 	}
+
+	free(f);
+	free(v);
+	free(z);
+	return 0;
 }
 
-// https://en.wikipedia.org/wiki/Cube_mapping
-void convert_xyz_to_cube_uv(float x, float y, float z, int *index, float *u, float *v)
-{
-  float absX = fabs(x);
-  float absY = fabs(y);
-  float absZ = fabs(z);
-  
-  int isXPositive = x > 0 ? 1 : 0;
+void SDF_RunPass(SDFJob* jobs, int numJobs, bool rows) {
+	for (int j = 0; j < numJobs; j++) {
+		jobs[j].rows = rows;
+		jobs[j].thread = SDL_CreateThread(SDF_Thread, "TrackSDF", &jobs[j]);
+		if (jobs[j].thread == NULL) {
+			fprintf(stderr, "Unable to create distance field thread: %s\n", SDL_GetError());
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (int j = 0; j < numJobs; j++) {
+		SDL_WaitThread(jobs[j].thread, NULL);
+	}
+}
+
+void TrackSDF_Init(TrackSDF* sdf, Arena* arena, const TerrainMap* tm, int size_log2) {
+	sdf->cellLog2 = size_log2 > 10 + SDF_MIN_CELL_LOG2 ? size_log2 - 10 : SDF_MIN_CELL_LOG2;
+	if (sdf->cellLog2 > size_log2) {
+		sdf->cellLog2 = size_log2;
+	}
+	sdf->size = 1 << size_log2;
+	int n = sdf->cells = 1 << (size_log2 - sdf->cellLog2);
+	int cellSize = 1 << sdf->cellLog2;
+
+	uint8_t* road = malloc((size_t)n * n);
+	for (int y = 0; y < n; y++) {
+		for (int x = 0; x < n; x++) {
+			road[y * n + x] = TerrainMap_Get(tm, x * cellSize + cellSize / 2, y * cellSize + cellSize / 2) == TERRAIN_ROAD;
+		}
+	}
+
+	float* inside = malloc((size_t)n * n * sizeof(float));
+	float* outside = malloc((size_t)n * n * sizeof(float));
+
+	SDFJob jobs[SDF_MAX_THREADS];
+	int numJobs = SDL_GetCPUCount();
+	if (numJobs > SDF_MAX_THREADS) {
+		numJobs = SDF_MAX_THREADS;
+	}
+	if (numJobs > n) {
+		numJobs = n;
+	}
+	for (int j = 0; j < numJobs; j++) {
+		jobs[j] = (SDFJob){
+			.road = road,
+			.inside = inside,
+			.outside = outside,
+			.cells = n,
+			.first = n * j / numJobs,
+			.last = n * (j + 1) / numJobs,
+		};
+	}
+	SDF_RunPass(jobs, numJobs, false);
+	SDF_RunPass(jobs, numJobs, true);
+
+	// The edge runs between cell centres, so it's half a cell closer than the
+	// nearest cell of the other kind
+	sdf->dist = Arena_Alloc(arena, (size_t)n * n * sizeof(int16_t));
+	float scale = cellSize * SDF_UNITS;
+	for (int i = 0; i < n * n; i++) {
+		float d = road[i] ? -(sqrtf(inside[i]) - 0.5f) : sqrtf(outside[i]) - 0.5f;
+		d *= scale;
+		sdf->dist[i] = d > INT16_MAX ? INT16_MAX : d < -INT16_MAX ? -INT16_MAX : (int16_t)lrintf(d);
+	}
+
+	free(road);
+	free(inside);
+	free(outside);
+}
+
+int16_t TrackSDF_Cell(const TrackSDF* sdf, int x, int y) {
+	x = x < 0 ? 0 : x >= sdf->cells ? sdf->cells - 1 : x;
+	y = y < 0 ? 0 : y >= sdf->cells ? sdf->cells - 1 : y;
+	return sdf->dist[y * sdf->cells + x];
+}
+
+// Distance in texels from (x, y) to the edge of the road, and if gradient
+// isn't NULL, the direction away from the road
+float TrackSDF_Get(const TrackSDF* sdf, float x, float y, vec2* gradient) {
+	float cellSize = 1 << sdf->cellLog2;
+	float u = x / cellSize - 0.5f;
+	float v = y / cellSize - 0.5f;
+	int cx = floorf(u);
+	int cy = floorf(v);
+	float fx = u - cx;
+	float fy = v - cy;
+
+	float d00 = TrackSDF_Cell(sdf, cx, cy);
+	float d10 = TrackSDF_Cell(sdf, cx + 1, cy);
+	float d01 = TrackSDF_Cell(sdf, cx, cy + 1);
+	float d11 = TrackSDF_Cell(sdf, cx + 1, cy + 1);
+
+	float top = d00 + (d10 - d00) * fx;
+	float bottom = d01 + (d11 - d01) * fx;
+
+	if (gradient != NULL) {
+		vec2 g = {
+			(d10 - d00) + ((d11 - d01) - (d10 - d00)) * fy,
+			bottom - top,
+		};
+		float len = hypotf(g.x, g.y);
+		*gradient = len > 0 ? vec2_scale(g, 1 / len) : (vec2){0, 0};
+	}
+
+	return (top + (bottom - top) * fy) / SDF_UNITS;
+}
+
+typedef struct Track {
+	// Everything below that the track allocates comes from here, so it can
+	// all be dropped in one go when the next track is published
+	Arena* arena;
+
+	SDL_Surface* trackImage; // NULL if the track is streamed
+	VirtualTexture* pages;
+	TerrainMap terrain;
+	int size_log2;
+	char trackName[1024];
+
+	CollisionGrid collision;
+	TrackSDF sdf;
+
+	// The whole track shrunk down for the minimap. The renderer uploads it
+	// once when the track goes live.
+	SDL_Surface* minimap;
+
+	// Every sprite sheet the track uses, loaded once each
+	SpriteImage* spriteImages[MAX_SPRITE_IMAGES];
+	int numSpriteImages;
+
+	// Sprites from here on are the other players' karts, in split-screen or a
+	// networked race
+	int firstPlayerSprite;
+} Track;
+
+// Everything Track_Load produces. This is filled in on the loader thread and
+// only handed over to the game (TrackLoad_Publish) once done is set.
+struct TrackLoad {
+	Track track;
+	PlayerState playerState;
+	Enemies enemies;
+	vec2 startPosition;
+
+	SpritePositions sprites;
+	SpriteLooks spriteLooks;
+
+	const char* path;
+	int numEnemies;
+	SDL_Thread* thread;
+	SDL_atomic_t done;
+};
+
+////////////////////
+// World
+//
+// Everything one race needs. The game runs one World, and --batch runs one
+// per thread, so the simulation and renderer are handed the World to use
+// rather than reaching for globals.
+struct World {
+	Track track;
+
+	// The next track loads while the current one is still live, so each of
+	// them needs its own arena
+	Arena trackArenas[2];
+
+	SpritePositions sprites;
+	SpriteLooks spriteLooks;
+	Enemies enemies;
+
+	Camera mainCamera;
+	vec2 velocity;
+	PlayerState mainPlayerState;
+
+	// Player 1 is always mainCamera, velocity and mainPlayerState. The other
+	// split-screen players use these.
+	Camera splitScreenCameras[MAX_LOCAL_PLAYERS];
+	vec2 splitScreenVelocities[MAX_LOCAL_PLAYERS];
+	PlayerState splitScreenStates[MAX_LOCAL_PLAYERS];
+	LocalPlayer localPlayers[MAX_LOCAL_PLAYERS];
+
+	// Every kart's progress, ordered from first to last place
+	RaceProgress* standings[MAX_ENEMIES + MAX_CLIENTS];
+	int numRacers;
+	int numFinishedKarts;
+
+	int trackNumber;
+	int positions[3];
+};
+
+World* World_Create() {
+	World* w = calloc(1, sizeof(World));
+	if (w == NULL) {
+		fprintf(stderr, "Out of memory creating a world\n");
+		exit(EXIT_FAILURE);
+	}
+	w->trackArenas[0].name = "Track";
+	w->trackArenas[1].name = "Track";
+	return w;
+}
+
+void InitPlayerState(TrackLoad* tl, PlayerState* ps, const char* path, vec2 start) {
+	FILE* f = fopen(path, "r");
+
+	int numPoints;
+	fscanf(f, "%d", &numPoints);
+	vec2* points = Arena_Alloc(tl->track.arena, numPoints * sizeof(vec2));
+	for (int i = 0; i < numPoints; i++) {
+		fscanf(f, "%f,%f", &points[i].x, &points[i].y);
+
+		if (SHOW_PATH_MARKERS) {
+			vec2 point = points[i];
+			int s = AddSprite(tl, "player_path_marker.png");
+			Sprite_Place(&tl->sprites, s, point.x, point.y);
+		}
+	}
+	fclose(f);
+
+	// The player starts just behind the first marker, and the last marker is
+	// on the finish line
+	RacePath* route = Arena_Alloc(tl->track.arena, sizeof(RacePath));
+	RacePath_Init(route, tl->track.arena, points, numPoints, numPoints - 1);
+	RaceProgress_Init(&ps->progress, route, start, 0, 1);
+}
+
+////////////////////
+// Enemy path splines
+
+vec2 CatmullRom(vec2 p0, vec2 p1, vec2 p2, vec2 p3, float t) {
+	float t2 = t * t;
+	float t3 = t2 * t;
+	return (vec2){
+		0.5f * (2 * p1.x + (p2.x - p0.x) * t + (2 * p0.x - 5 * p1.x + 4 * p2.x - p3.x) * t2 + (3 * p1.x - p0.x - 3 * p2.x + p3.x) * t3),
+		0.5f * (2 * p1.y + (p2.y - p0.y) * t + (2 * p0.y - 5 * p1.y + 4 * p2.y - p3.y) * t2 + (3 * p1.y - p0.y - 3 * p2.y + p3.y) * t3),
+	};
+}
+
+float PathSpline_Wrap(const PathSpline* ps, float dist) {
+	if (dist >= 0 && dist < ps->length) {
+		return dist;
+	}
+	dist = fmodf(dist, ps->length);
+	if (dist < 0) {
+		dist += ps->length;
+	}
+	return dist < ps->length ? dist : 0;
+}
+
+// The sample at or before dist, and how far it is towards the next one
+int PathSpline_Locate(const PathSpline* ps, float dist, float* frac) {
+	float x = dist * ps->invStep;
+	int k = x;
+	if (k >= ps->numSamples) {
+		k = ps->numSamples - 1;
+	}
+	*frac = clampf(x - k, 0, 1);
+	return k;
+}
+
+vec2 PathSpline_Point(const PathSpline* ps, float dist) {
+	float f;
+	int k = PathSpline_Locate(ps, dist, &f);
+	vec2 a = ps->points[k];
+	vec2 b = ps->points[k + 1];
+	return (vec2){a.x + (b.x - a.x) * f, a.y + (b.y - a.y) * f};
+}
+
+void PathSpline_Init(PathSpline* ps, Arena* arena, const vec2* markers, int numMarkers, const TerrainMap* terrain) {
+	// Trace the spline finely, then resample it at equal distances
+	int numDense = numMarkers * SPLINE_SUBDIVISIONS;
+	vec2* dense = malloc((numDense + 1) * sizeof(vec2));
+	float* denseDist = malloc((numDense + 1) * sizeof(float));
+
+	ps->markerDist = Arena_Alloc(arena, numMarkers * sizeof(float));
+	float dist = 0;
+	for (int k = 0; k < numMarkers; k++) {
+		vec2 p0 = markers[(k + numMarkers - 1) % numMarkers];
+		vec2 p1 = markers[k];
+		vec2 p2 = markers[(k + 1) % numMarkers];
+		vec2 p3 = markers[(k + 2) % numMarkers];
+
+		for (int j = 0; j < SPLINE_SUBDIVISIONS; j++) {
+			int d = k * SPLINE_SUBDIVISIONS + j;
+			dense[d] = CatmullRom(p0, p1, p2, p3, (float)j / SPLINE_SUBDIVISIONS);
+			if (d > 0) {
+				vec2 step = vec2_sub(dense[d], dense[d - 1]);
+				dist += sqrtf(vec2_dot(step, step));
+			}
+			denseDist[d] = dist;
+		}
+		ps->markerDist[k] = denseDist[k * SPLINE_SUBDIVISIONS];
+	}
+	vec2 last = vec2_sub(markers[0], dense[numDense - 1]);
+	dense[numDense] = markers[0];
+	denseDist[numDense] = dist + sqrtf(vec2_dot(last, last));
+
+	ps->length = denseDist[numDense];
+	ps->numSamples = ceilf(ps->length / ENEMY_PATH_STEP);
+	ps->step = ps->length / ps->numSamples;
+	ps->invStep = 1 / ps->step;
+
+	int n = ps->numSamples;
+	ps->points = Arena_Alloc(arena, (n + 1) * sizeof(vec2));
+	ps->dirs = Arena_Alloc(arena, (n + 1) * sizeof(vec2));
+	ps->speed = Arena_Alloc(arena, (n + 1) * sizeof(float));
+
+	int d = 0;
+	for (int i = 0; i < n; i++) {
+		float s = i * ps->step;
+		while (d + 1 < numDense && denseDist[d + 1] <= s) {
+			d++;
+		}
+		float segLength = denseDist[d + 1] - denseDist[d];
+		float f = segLength > 0 ? clampf((s - denseDist[d]) / segLength, 0, 1) : 0;
+		ps->points[i] = (vec2){
+			dense[d].x + (dense[d + 1].x - dense[d].x) * f,
+			dense[d].y + (dense[d + 1].y - dense[d].y) * f,
+		};
+	}
+	ps->points[n] = ps->points[0];
+	free(dense);
+	free(denseDist);
+
+	for (int i = 0; i < n; i++) {
+		vec2 dir = vec2_sub(ps->points[i + 1], ps->points[i]);
+		float m = sqrtf(vec2_dot(dir, dir));
+		ps->dirs[i] = m > 0 ? vec2_scale(dir, 1 / m) : (vec2){1, 0};
+
+		// Karts slow down off the road as much as the player does
+		TerrainClass under = TerrainMap_Get(terrain, ps->points[i].x, ps->points[i].y);
+		ps->speed[i] = ENEMY_TOP_SPEED * terrainInfo[TERRAIN_ROAD].drag / terrainInfo[under].drag;
+	}
+	ps->dirs[n] = ps->dirs[0];
+
+	// Brake in time for slow parts. Going round twice carries them back past
+	// the start of the lap.
+	for (int pass = 0; pass < 2; pass++) {
+		for (int i = n - 1; i >= 0; i--) {
+			float next = i + 1 < n ? ps->speed[i + 1] : ps->speed[0];
+			ps->speed[i] = fminf(ps->speed[i], sqrtf(next * next + 2 * ENEMY_BRAKING * ps->step));
+		}
+	}
+	ps->speed[n] = ps->speed[0];
+}
+
+bool LoadEnemyPath(TrackLoad* tl, EnemyPath* ep, const char* path) {
+	FILE* f = fopen(path, "r");
+	if (f == NULL) {
+		return false;
+	}
+	
+	char spritePath[1024];
+	fscanf(f, "%s", spritePath);
+	ep->image = LoadSpriteImage(tl, spritePath, true);
+	
+	int numPoints;
+	fscanf(f, "%d", &numPoints);
+	if (numPoints < 2) {
+		fprintf(stderr, "Enemy path %s needs at least 2 markers\n", path);
+		exit(EXIT_FAILURE);
+	}
+	vec2* points = Arena_Alloc(tl->track.arena, numPoints * sizeof(vec2));
+	for (int i = 0; i < numPoints; i++) {
+		fscanf(f, "%f,%f", &points[i].x, &points[i].y);
+
+		if (SHOW_PATH_MARKERS) {
+			vec2 point = points[i];
+			int s = AddSprite(tl, "path_marker.png");
+			Sprite_Place(&tl->sprites, s, point.x, point.y);
+		}
+	}
+	fclose(f);
+
+	RacePath_Init(&ep->route, tl->track.arena, points, numPoints, 0);
+	PathSpline_Init(&ep->spline, tl->track.arena, points, numPoints, &tl->track.terrain);
+	return true;
+}
+
+// Puts a kart where its distance along the path and offset from it say
+void Enemies_Place(Enemies* e, int i) {
+	const PathSpline* ps = &e->paths[e->path[i]].spline;
+	float f;
+	int k = PathSpline_Locate(ps, e->dist[i], &f);
+	vec2 a = ps->points[k];
+	vec2 b = ps->points[k + 1];
+	vec2 dir = ps->dirs[k];
+
+	e->posX[i] = a.x + (b.x - a.x) * f - dir.y * e->offset[i];
+	e->posY[i] = a.y + (b.y - a.y) * f + dir.x * e->offset[i];
+	e->dirX[i] = dir.x;
+	e->dirY[i] = dir.y;
+}
+
+// Collisions move karts in the world, so their distance along the path and
+// offset from it are worked out again from where they ended up
+void Enemies_Reproject(Enemies* e, int i) {
+	const PathSpline* ps = &e->paths[e->path[i]].spline;
+	vec2 d = vec2_sub((vec2){e->posX[i], e->posY[i]}, PathSpline_Point(ps, e->dist[i]));
+	vec2 dir = {e->dirX[i], e->dirY[i]};
+
+	e->dist[i] = PathSpline_Wrap(ps, e->dist[i] + vec2_dot(d, dir));
+	e->offset[i] = clampf(d.y * dir.x - d.x * dir.y, -ENEMY_MAX_OFFSET, ENEMY_MAX_OFFSET);
+}
+
+// Start a kart `back` units behind the first marker of its path, measured
+// back along the path, so that big fields queue up along the racing line.
+void Enemies_Add(Enemies* e, TrackLoad* tl, int pathNumber, float back) {
+	int i = e->count++;
+	const RacePath* route = &e->paths[pathNumber].route;
+	const PathSpline* ps = &e->paths[pathNumber].spline;
+
+	e->path[i] = pathNumber;
+	e->pathLength[i] = ps->length;
+	e->dist[i] = PathSpline_Wrap(ps, -back);
+	e->offset[i] = 0;
+	e->speed[i] = ENEMY_TOP_SPEED;
+	Enemies_Place(e, i);
+	vec2 pos = {e->posX[i], e->posY[i]};
+
+	int target = 1 % route->length;
+	int lap = 1;
+	if (back > 0) {
+		// Karts behind the line still have to cross it to start lap 1
+		lap = -(int)(back / ps->length);
+		target = 1;
+		while (target < route->length && ps->markerDist[target] <= e->dist[i]) {
+			target++;
+		}
+		target %= route->length;
+	}
+
+	RaceProgress_Init(&e->progress[i], route, pos, target, lap);
+
+	e->sprite[i] = AddSpriteImage(tl, e->paths[pathNumber].image);
+	Sprite_Place(&tl->sprites, e->sprite[i], pos.x, pos.y);
+}
+
+void Enemies_Init(TrackLoad* tl, const char* trackPath, int count) {
+	Enemies* e = &tl->enemies;
+	char buf[1024];
+
+	// Karts are spread over however many paths/N.txt files the track has
+	// Karts' RaceProgress points into this, so it has to stay put when the
+	// Enemies are copied out of the TrackLoad
+	e->paths = Arena_Alloc(tl->track.arena, MAX_ENEMY_PATHS * sizeof(EnemyPath));
+	e->numPaths = 0;
+	while (e->numPaths < MAX_ENEMY_PATHS) {
+		sprintf(buf, "%s/paths/%d.txt", trackPath, e->numPaths + 1);
+
+		if (!LoadEnemyPath(tl, &e->paths[e->numPaths], buf)) {
+			break;
+		}
+		e->numPaths++;
+	}
+
+	if (count > 0 && e->numPaths == 0) {
+		fprintf(stderr, "Track %s has no enemy paths\n", trackPath);
+		exit(EXIT_FAILURE);
+	}
+
+	e->count = 0;
+	for (int i = 0; i < count; i++) {
+		int pathNumber = i % e->numPaths;
+		int slot = i / e->numPaths;
+		Enemies_Add(e, tl, pathNumber, slot * ENEMY_SPACING);
+	}
+}
+
+#define MINIMAP_SIZE 96
+
+bool IsTransparentTexel(const uint8_t* p) {
+	return p[0] == 255 && p[1] == 0 && p[2] == 255;
+}
+
+// Averages each block of the track into a pixel of the minimap, from the
+// track image or the low resolution copy of a streamed one. Texels the floor
+// doesn't draw are left out, and a block of nothing but them is transparent.
+SDL_Surface* Minimap_Build(Track* tr) {
+	const uint8_t* pixels;
+	int pitch;
+	int size;
+	if (tr->pages != NULL) {
+		pixels = tr->pages->lowRes;
+		size = 1 << tr->pages->lowResLog2;
+		pitch = size * 3;
+	}
+	else {
+		pixels = tr->trackImage->pixels;
+		pitch = tr->trackImage->pitch;
+		size = tr->trackImage->w;
+	}
+
+	SDL_Surface* map = Arena_CreateSurface(tr->arena, MINIMAP_SIZE, MINIMAP_SIZE, SDL_PIXELFORMAT_RGBA32);
+	for (int my = 0; my < MINIMAP_SIZE; my++) {
+		int y0 = my * size / MINIMAP_SIZE;
+		int y1 = (my + 1) * size / MINIMAP_SIZE;
+		uint8_t* out = (uint8_t*)map->pixels + my * map->pitch;
+
+		for (int mx = 0; mx < MINIMAP_SIZE; mx++, out += 4) {
+			int x0 = mx * size / MINIMAP_SIZE;
+			int x1 = (mx + 1) * size / MINIMAP_SIZE;
+
+			int sum[3] = {0};
+			int count = 0;
+			int total = 0;
+			for (int y = y0; y < y1 || y == y0; y++) {
+				for (int x = x0; x < x1 || x == x0; x++) {
+					const uint8_t* p = pixels + y * pitch + x * 3;
+					total++;
+					if (IsTransparentTexel(p)) {
+						continue;
+					}
+					sum[0] += p[0];
+					sum[1] += p[1];
+					sum[2] += p[2];
+					count++;
+				}
+			}
+
+			for (int c = 0; c < 3; c++) {
+				out[c] = count > 0 ? sum[c] / count : 0;
+			}
+			out[3] = count * 255 / total;
+		}
+	}
+	return map;
+}
+
+void Track_Load(TrackLoad* tl, const char* path) {
+	Track* tr = &tl->track;
+
+	char buf[1024];
+
+	// Big tracks are streamed from a page file, if they have one
+	sprintf(buf, "%s/track.pages", path);
+	if (access(buf, R_OK) == 0) {
+		tr->pages = VirtualTexture_Open(tr->arena, buf, &tr->terrain);
+		tr->size_log2 = tr->pages->sizeLog2;
+	}
+	else {
+		//memset(buf, 0, sizeof(buf));
+		sprintf(buf, "%s/track.png", path);
+
+		SDL_Surface* surf = IMG_Load(buf);
+		if (surf == NULL) {
+			fprintf(stderr, "Unable to load track: %s\n", IMG_GetError());
+			exit(EXIT_FAILURE);
+		}
+
+		if (surf->w != surf->h || !IsPowerOfTwo(surf->w)) {
+			fprintf(stderr, "Invalid track size: %dx%d. Track width and height must be the same and a power of 2.\n", surf->w, surf->h);
+		}
+
+		int size_log2 = log2f(surf->w);
+		if (size_log2 > MAX_TRACK_LOG2) {
+			fprintf(stderr, "Track is %d pixels across, at most %d are supported\n", surf->w, 1 << MAX_TRACK_LOG2);
+			exit(EXIT_FAILURE);
+		}
+
+		tr->trackImage = Arena_ConvertSurface(tr->arena, surf, SDL_PIXELFORMAT_RGB24);
+		tr->size_log2 = size_log2;
+
+		//memset(buf, 0, sizeof(buf));
+		sprintf(buf, "%s/attributes.png", path);
+
+		SDL_Surface* attr_surf = IMG_Load(buf);
+		if (attr_surf == NULL) {
+			fprintf(stderr, "Unable to load track attributes: %s\n", IMG_GetError());
+			exit(EXIT_FAILURE);
+		}
+		SDL_Surface* attr_surf2 = SDL_ConvertSurfaceFormat(attr_surf, SDL_PIXELFORMAT_RGB24, 0);
+		TerrainMap_Init(&tr->terrain, tr->arena, attr_surf2);
+
+		SDL_FreeSurface(surf);
+		SDL_FreeSurface(attr_surf);
+		SDL_FreeSurface(attr_surf2);
+	}
+
+	vec2* trees = NULL;
+	int numTrees = 0;
+	if (ENABLE_TREES) {
+		for (int i = 0; i < tr->terrain.h; i++) {
+			for (int j = 0; j < tr->terrain.w; j++) {
+				// Skip the rest of tiles with no trees in
+				uint32_t tile = TerrainMap_Tile(&tr->terrain, j, i);
+				if (tile != TERRAIN_TREE && !(tile & TERRAIN_TILE_MIXED)) {
+					j |= TERRAIN_TILE_SIZE - 1;
+					continue;
+				}
+
+				if (TerrainMap_Get(&tr->terrain, j, i) == TERRAIN_TREE) {
+					int s = AddSprite(tl, "tree.png");
+					Sprite_Place(&tl->sprites, s, j, i);
+
+					trees = realloc(trees, (numTrees + 1) * sizeof(vec2));
+					trees[numTrees++] = (vec2){j, i};
+				}
+			}
+		}
+	}
+
+	sprintf(buf, "%s/info.txt", path);
+	FILE* f = fopen(buf, "r");
+
+	char trackName[1024];
+	fgets(trackName, sizeof(trackName), f);
+	trackName[strlen(trackName) - 1] = 0;
+	strcpy(tr->trackName, trackName);
+
+	float startX, startY;
+	fscanf(f, "%f,%f", &startX, &startY);
+	fclose(f);
+
+	tl->startPosition = (vec2){startX, startY};
+
+	if (tr->pages != NULL) {
+		VirtualTexture_Prefetch(tr->pages, tl->startPosition);
+		VirtualTexture_Start(tr->pages);
+	}
+
+	//memset(buf, 0, sizeof(buf));
+	sprintf(buf, "%s/paths/player.txt", path);
+
+	InitPlayerState(tl, &tl->playerState, buf, tl->startPosition);
+
+	Enemies_Init(tl, path, tl->numEnemies);
+
+	tr->firstPlayerSprite = tl->sprites.count;
+	int numPlayerSprites = netMode == Net_Client ? MAX_CLIENTS : numLocalPlayers > 1 ? numLocalPlayers : 0;
+	if (numPlayerSprites > 0) {
+		SpriteImage* image = LoadSpriteImage(tl, "yoshi.png", true);
+		for (int i = 0; i < numPlayerSprites; i++) {
+			AddSpriteImage(tl, image);
+		}
+	}
+
+	CollisionGrid_Init(&tr->collision, tr->arena, tr->terrain.w, tr->terrain.h, trees, numTrees, tl->enemies.count + 1);
+	TrackSDF_Init(&tr->sdf, tr->arena, &tr->terrain, tr->size_log2);
+	tr->minimap = Minimap_Build(tr);
+	free(trees);
+}
+
+void Track_Unload(Track* tr) {
+	if (tr->pages != NULL) {
+		VirtualTexture_Close(tr->pages);
+	}
+	Arena_Reset(tr->arena);
+	tr->arena = NULL;
+}
+
+void World_Destroy(World* w) {
+	if (w->track.arena != NULL) {
+		Track_Unload(&w->track);
+	}
+	Arena_Free(&w->trackArenas[0]);
+	Arena_Free(&w->trackArenas[1]);
+	free(w);
+}
+
+int TrackLoad_Thread(void* data) {
+	TrackLoad* tl = data;
+	Track_Load(tl, tl->path);
+
+	// SDL_AtomicSet is a full barrier, so everything written above is visible
+	// to whoever sees done == 1.
+	SDL_AtomicSet(&tl->done, 1);
+	return 0;
+}
+
+TrackLoad* TrackLoad_Begin(World* w, const char* path, int numEnemies) {
+	TrackLoad* tl = calloc(1, sizeof(TrackLoad));
+	tl->path = path;
+	tl->numEnemies = numEnemies;
+	tl->track.arena = w->track.arena == &w->trackArenas[0] ? &w->trackArenas[1] : &w->trackArenas[0];
+	SDL_AtomicSet(&tl->done, 0);
+
+	tl->thread = SDL_CreateThread(TrackLoad_Thread, "TrackLoad", tl);
+	if (tl->thread == NULL) {
+		fprintf(stderr, "Unable to create track loader thread: %s\n", SDL_GetError());
+		exit(EXIT_FAILURE);
+	}
+	return tl;
+}
+
+bool TrackLoad_IsDone(TrackLoad* tl) {
+	return SDL_AtomicGet(&tl->done) == 1;
+}
+
+// Counts the tracks that have gone live, so the renderer can tell when the
+// textures it made from the last one are stale. Pointers into a new track's
+// arena can be the same as the old one's.
+SDL_atomic_t tracksPublished;
+
+// Swap the finished load into the world. Must be called from the thread that
+// runs the world, and only once TrackLoad_IsDone returns true.
+void TrackLoad_Publish(World* w, TrackLoad* tl) {
+	SDL_WaitThread(tl->thread, NULL);
+
+	if (w->track.arena != NULL) {
+		Track_Unload(&w->track);
+	}
+	w->track = tl->track;
+	SDL_AtomicAdd(&tracksPublished, 1);
+
+	SpritePositions_Copy(&w->sprites, &tl->sprites);
+	w->spriteLooks = tl->spriteLooks;
+
+	w->mainPlayerState = tl->playerState;
+	w->enemies = tl->enemies;
+
+	Camera* cam = &w->mainCamera;
+	cam->position = (vec3){
+		tl->startPosition.x,
+		tl->startPosition.y,
+		20
+	};
+
+	Camera_SetFovX(cam, deg2rad(90));
+	Camera_SetYawPitch(cam, deg2rad(-90), deg2rad(-20));
+	cam->mode = FirstPerson;
+	w->velocity = (vec2){0};
+
+	free(tl);
+}
+
+////////////////////
+// Overdraw heatmap
+
+// With --heatmap the passes also count what they did to every pixel of the
+// frame, and the frame is replaced by a false colour picture of the counts.
+// Counting is done a row or span at a time, after it's drawn, so the inner
+// loops are the same with it on or off.
+typedef enum HeatmapMode {
+	Heatmap_Off,
+	Heatmap_Writes, // How many times each pixel was written
+	Heatmap_Texels, // Texels fetched per 8x8 tile
+	Heatmap_DrawTime, // Time spent drawing each 8x8 tile
+	NUM_HEATMAP_MODES
+} HeatmapMode;
+
+const char* heatmapModeNames[NUM_HEATMAP_MODES] = {"off", "writes", "texels", "time"};
+
+// Can be set with --heatmap, and F3 steps through the modes
+HeatmapMode heatmapMode = Heatmap_Off;
+
+typedef enum RenderPass {
+	Pass_Sky,
+	Pass_Floor,
+	Pass_Sprites,
+	NUM_RENDER_PASSES
+} RenderPass;
+
+const char* renderPassNames[NUM_RENDER_PASSES] = {"Sky", "Floor", "Sprites"};
+
+#define HEAT_TILE_LOG2 3
+#define HEAT_TILE_SIZE (1 << HEAT_TILE_LOG2)
+#define HEAT_MAX_WRITES 6 // Drawn as the hottest colour
+#define HEAT_MAX_TEXELS 8 // Per pixel, averaged over a tile
+
+// Split-screen views are drawn on their own threads and each writes only its
+// own pixels, so the per pixel counts are shared but the totals aren't
+typedef struct HeatTotals {
+	uint64_t writes[NUM_RENDER_PASSES];
+	uint64_t texels[NUM_RENDER_PASSES];
+	Uint64 ticks[NUM_RENDER_PASSES];
+} HeatTotals;
+
+typedef struct Heatmap {
+	uint16_t writes[GAME_HEIGHT][GAME_WIDTH];
+	float texels[GAME_HEIGHT][GAME_WIDTH];
+	float ticks[GAME_HEIGHT][GAME_WIDTH];
+	HeatTotals views[MAX_LOCAL_PLAYERS];
+} Heatmap;
+
+Heatmap heatmap;
+
+void Heatmap_Write(HeatTotals* ht, RenderPass pass, int x, int y) {
+	heatmap.writes[y][x]++;
+	ht->writes[pass]++;
+}
+
+void Heatmap_WriteSpan(HeatTotals* ht, RenderPass pass, int x, int y, int n) {
+	for (int i = 0; i < n; i++) {
+		heatmap.writes[y][x + i]++;
+	}
+	ht->writes[pass] += n;
+}
+
+// Spreads texels fetched for a span of n pixels evenly over them
+void Heatmap_Fetch(HeatTotals* ht, RenderPass pass, int x, int y, int n, int texels) {
+	float each = (float)texels / n;
+	for (int i = 0; i < n; i++) {
+		heatmap.texels[y][x + i] += each;
+	}
+	ht->texels[pass] += texels;
+}
+
+// Same for the time it took to draw them
+void Heatmap_Time(HeatTotals* ht, RenderPass pass, int x, int y, int n, Uint64 ticks) {
+	float each = (float)ticks / n;
+	for (int i = 0; i < n; i++) {
+		heatmap.ticks[y][x + i] += each;
+	}
+	ht->ticks[pass] += ticks;
+}
+
+// Black through blue, green, yellow and red to white as t goes from 0 to 1
+const rgb heatRamp[] = {
+	{0, 0, 0},
+	{0, 0, 255},
+	{0, 255, 0},
+	{255, 255, 0},
+	{255, 0, 0},
+	{255, 255, 255},
+};
+
+rgb Heatmap_Colour(float t) {
+	const rgb* ramp = heatRamp;
+	const int last = sizeof(heatRamp) / sizeof(heatRamp[0]) - 1;
+
+	t = clampf(t, 0, 1) * last;
+	int i = t;
+	if (i >= last) {
+		return ramp[last];
+	}
+	float f = t - i;
+	return (rgb){
+		ramp[i].r + (ramp[i + 1].r - ramp[i].r) * f,
+		ramp[i].g + (ramp[i + 1].g - ramp[i].g) * f,
+		ramp[i].b + (ramp[i + 1].b - ramp[i].b) * f,
+	};
+}
+
+// Replaces the frame with the counts, then clears them for the next one
+void Heatmap_Draw() {
+	if (heatmapMode == Heatmap_Writes) {
+		for (int y = 0; y < GAME_HEIGHT; y++) {
+			uint8_t* out = (uint8_t*)textureData + y * rowPitch;
+			for (int x = 0; x < GAME_WIDTH; x++, out += 3) {
+				rgb c = Heatmap_Colour((float)heatmap.writes[y][x] / HEAT_MAX_WRITES);
+				out[0] = c.r;
+				out[1] = c.g;
+				out[2] = c.b;
+			}
+		}
+	}
+	else {
+		// Texels are scaled to a fixed number per pixel, time to the slowest
+		// tile of the frame
+		float (*counts)[GAME_WIDTH] = heatmapMode == Heatmap_Texels ? heatmap.texels : heatmap.ticks;
+		float tiles[GAME_HEIGHT >> HEAT_TILE_LOG2][GAME_WIDTH >> HEAT_TILE_LOG2] = {0};
+		float hottest = 0;
+		for (int y = 0; y < GAME_HEIGHT; y++) {
+			for (int x = 0; x < GAME_WIDTH; x++) {
+				tiles[y >> HEAT_TILE_LOG2][x >> HEAT_TILE_LOG2] += counts[y][x];
+			}
+		}
+		for (int ty = 0; ty < GAME_HEIGHT >> HEAT_TILE_LOG2; ty++) {
+			for (int tx = 0; tx < GAME_WIDTH >> HEAT_TILE_LOG2; tx++) {
+				hottest = fmaxf(hottest, tiles[ty][tx]);
+			}
+		}
+		float scale = heatmapMode == Heatmap_Texels ? HEAT_MAX_TEXELS * HEAT_TILE_SIZE * HEAT_TILE_SIZE : hottest;
+
+		for (int y = 0; y < GAME_HEIGHT; y++) {
+			uint8_t* out = (uint8_t*)textureData + y * rowPitch;
+			for (int x = 0; x < GAME_WIDTH; x++, out += 3) {
+				float t = scale > 0 ? tiles[y >> HEAT_TILE_LOG2][x >> HEAT_TILE_LOG2] / scale : 0;
+				rgb c = Heatmap_Colour(t);
+				out[0] = c.r;
+				out[1] = c.g;
+				out[2] = c.b;
+			}
+		}
+	}
+
+	memset(heatmap.writes, 0, sizeof(heatmap.writes));
+	memset(heatmap.texels, 0, sizeof(heatmap.texels));
+	memset(heatmap.ticks, 0, sizeof(heatmap.ticks));
+}
+
+// Per pass totals for the frame over every view, under the stats
+void Heatmap_DrawTotals(DrawStringInfo* dsi) {
+	drawStringf(dsi, "Heatmap: %s (F3 for the next one)", heatmapModeNames[heatmapMode]);
+	for (int pass = 0; pass < NUM_RENDER_PASSES; pass++) {
+		HeatTotals sum = {0};
+		for (int p = 0; p < numLocalPlayers; p++) {
+			sum.writes[pass] += heatmap.views[p].writes[pass];
+			sum.texels[pass] += heatmap.views[p].texels[pass];
+			sum.ticks[pass] += heatmap.views[p].ticks[pass];
+		}
+		float ms = sum.ticks[pass] * 1000.0 / SDL_GetPerformanceFrequency();
+		float pixels = GAME_WIDTH * GAME_HEIGHT;
+
+		dsi->y += 20;
+		drawStringf(dsi, "%s: %.2f writes, %.2f texels per pixel, %.3f ms", renderPassNames[pass], sum.writes[pass] / pixels, sum.texels[pass] / pixels, ms);
+	}
+	memset(heatmap.views, 0, sizeof(heatmap.views));
+}
+
+// A rectangle of the frame, in pixels
+typedef struct Viewport {
+	int x;
+	int y;
+	int w;
+	int h;
+} Viewport;
+
+// A camera drawing into a viewport. Every viewport keeps the camera's
+// horizontal field of view, so a wide, short viewport sees less vertically.
+typedef struct RenderView {
+	const Camera* cam;
+	Viewport vp;
+	float halfW; // Half the size of the view plane at cam_dist
+	float halfH;
+	mat3 project; // Camera relative point to view plane coordinates
+	int hideSprite; // The viewer's own kart, or -1
+
+	const World* world;
+
+	// The world's sprites, or a snapshot's with --sim-thread
+	const SpritePositions* sprites;
+	const SpriteLooks* looks;
+
+	HeatTotals* heat; // NULL unless the heatmap is on
+
+	// The sky and floor draw every rowStep'th row from firstRow. With
+	// --interlace the rest are filled from the last frame, which was drawn
+	// from lastCam.
+	int firstRow;
+	int rowStep;
+	const Camera* lastCam;
+} RenderView;
+
+void RenderView_Init(RenderView* rv, const World* w, const Camera* cam, Viewport vp) {
+	rv->cam = cam;
+	rv->vp = vp;
+	rv->halfW = GAME_WIDTH / 2.0f;
+	rv->halfH = rv->halfW * vp.h / vp.w;
+	rv->hideSprite = -1;
+	rv->world = w;
+	rv->sprites = &w->sprites;
+	rv->looks = &w->spriteLooks;
+	rv->heat = NULL;
+	rv->firstRow = 0;
+	rv->rowStep = 1;
+	rv->lastCam = NULL;
+
+	rv->project = (mat3){
+		cam->forward.x * cam->cam_dist, cam->right.x * rv->halfW, cam->up.x * rv->halfH,
+		cam->forward.y * cam->cam_dist, cam->right.y * rv->halfW, cam->up.y * rv->halfH,
+		cam->forward.z * cam->cam_dist, cam->right.z * rv->halfW, cam->up.z * rv->halfH,
+	};
+	mat3_invert(&rv->project);
+}
+
+// Direction of the ray through pixel (j, i) of the viewport
+vec3 RenderView_Ray(const RenderView* rv, int j, int i) {
+	const Camera* cam = rv->cam;
+
+	float x = mapf(j, 0, rv->vp.w, -1, 1);
+	float y = mapf(i, 0, rv->vp.h, 1, -1);
+
+	return vec3_add(
+		vec3_scale(cam->forward, cam->cam_dist), 
+		vec3_add(vec3_scale(cam->right, x * rv->halfW), vec3_scale(cam->up, y * rv->halfH)));
+}
+
+// Where the floor reads the track image from. The floor copies this into a
+// local before drawing, so the compiler can keep it in registers rather
+// than reloading it after every pixel it writes.
+typedef struct TrackTexels {
+	const uint8_t* pixels; // NULL if the track is streamed
+	int pitch;
+	const VirtualTexture* vt;
+} TrackTexels;
+
+TrackTexels Track_Texels(const Track* tr) {
+	if (tr->pages != NULL) {
+		return (TrackTexels){NULL, 0, tr->pages};
+	}
+	return (TrackTexels){tr->trackImage->pixels, tr->trackImage->pitch, NULL};
+}
+
+// Texel x, y of the track image, both already wrapped to the track size
+const uint8_t* TrackTexels_Get(const TrackTexels* t, int x, int y) {
+	if (t->pixels != NULL) {
+		return t->pixels + y * t->pitch + x * 3;
+	}
+
+	const VirtualTexture* vt = t->vt;
+
+	int slot = vt->pageTable[((y >> VT_TILE_LOG2) << vt->tilesLog2) + (x >> VT_TILE_LOG2)];
+	if (slot >= 0) {
+		return vt->cache + (size_t)slot * VT_TILE_BYTES + (((y & VT_TILE_MASK) << VT_TILE_LOG2) + (x & VT_TILE_MASK)) * 3;
+	}
+	return vt->lowRes + (((y >> vt->lowResShift) << vt->lowResLog2) + (x >> vt->lowResShift)) * 3;
+}
+
+// Marks the tiles in a view's wedge of the floor as used this frame, and
+// adds the ones that aren't in the cache to wanted
+void VirtualTexture_FindVisible(VirtualTexture* vt, const RenderView* rv, TileDistance* wanted, int* numWanted, int maxWanted) {
+	const Camera* cam = rv->cam;
+	vec2 pos = {cam->position.x, cam->position.y};
+	vec2 forward = vec2_normalize(cam->forward_2d);
+
+	// The angles either side of forward that the view covers on the floor
+	float minAngle = 0;
+	float maxAngle = 0;
+	for (int c = 0; c < 4; c++) {
+		vec3 dir = RenderView_Ray(rv, (c & 1) * rv->vp.w, (c >> 1) * rv->vp.h);
+		float angle = atan2f(forward.x * dir.y - forward.y * dir.x, forward.x * dir.x + forward.y * dir.y);
+		minAngle = fminf(minAngle, angle);
+		maxAngle = fmaxf(maxAngle, angle);
+	}
+
+	int tiles = 1 << vt->tilesLog2;
+	float halfDiagonal = VT_TILE_SIZE * 0.7072f;
+	int x0 = clampf((pos.x - VT_STREAM_DISTANCE) / VT_TILE_SIZE, 0, tiles - 1);
+	int x1 = clampf((pos.x + VT_STREAM_DISTANCE) / VT_TILE_SIZE, 0, tiles - 1);
+	int y0 = clampf((pos.y - VT_STREAM_DISTANCE) / VT_TILE_SIZE, 0, tiles - 1);
+	int y1 = clampf((pos.y + VT_STREAM_DISTANCE) / VT_TILE_SIZE, 0, tiles - 1);
+	for (int ty = y0; ty <= y1; ty++) {
+		for (int tx = x0; tx <= x1; tx++) {
+			vec2 d = vec2_sub((vec2){(tx + 0.5f) * VT_TILE_SIZE, (ty + 0.5f) * VT_TILE_SIZE}, pos);
+			float dist = sqrtf(vec2_dot(d, d));
+			if (dist > VT_STREAM_DISTANCE + halfDiagonal) {
+				continue;
+			}
+
+			// Tiles near the camera are always wanted. Further out, widen the
+			// wedge by however much of the angle the tile covers.
+			if (dist > halfDiagonal) {
+				float angle = atan2f(forward.x * d.y - forward.y * d.x, forward.x * d.x + forward.y * d.y);
+				float margin = asinf(halfDiagonal / dist);
+				if (angle + margin < minAngle || angle - margin > maxAngle) {
+					continue;
+				}
+			}
+
+			int tile = (ty << vt->tilesLog2) + tx;
+			int slot = vt->pageTable[tile];
+			if (slot >= 0) {
+				vt->slotUsed[slot] = vt->frame;
+			}
+			else if (slot == VT_MISSING && *numWanted < maxWanted) {
+				wanted[(*numWanted)++] = (TileDistance){tile, dist};
+			}
+		}
+	}
+}
+
+// The least recently used slot that isn't loading or in view, or -1 if the
+// cache is full of tiles that are
+int VirtualTexture_FindSlot(VirtualTexture* vt) {
+	int best = -1;
+	for (int s = 0; s < vt->numSlots; s++) {
+		int tile = vt->slotTile[s];
+		if (tile < 0) {
+			return s;
+		}
+		if (vt->pageTable[tile] == VT_LOADING || vt->slotUsed[s] == vt->frame) {
+			continue;
+		}
+		if (best < 0 || vt->slotUsed[s] < vt->slotUsed[best]) {
+			best = s;
+		}
+	}
+	return best;
+}
+
+#define VT_MAX_WANTED 4096
+
+// Called on the main thread before each frame is drawn. Tiles that finished
+// loading are put in the page table, and the nearest missing tiles in view
+// are requested.
+void VirtualTexture_Stream(VirtualTexture* vt, const RenderView* views, int numViews) {
+	int slot;
+	while (SlotQueue_Pop(&vt->loaded, &slot)) {
+		vt->pageTable[vt->slotTile[slot]] = slot;
+		vt->inFlight--;
+	}
+	vt->frame++;
+
+	TileDistance wanted[VT_MAX_WANTED];
+	int numWanted = 0;
+	for (int v = 0; v < numViews; v++) {
+		VirtualTexture_FindVisible(vt, &views[v], wanted, &numWanted, VT_MAX_WANTED);
+	}
+	qsort(wanted, numWanted, sizeof(TileDistance), cmp_tiles);
+
+	for (int i = 0; i < numWanted && vt->inFlight < VT_QUEUE_SIZE; i++) {
+		int tile = wanted[i].tile;
+		if (vt->pageTable[tile] != VT_MISSING) {
+			// Wanted by more than one view
+			continue;
+		}
+
+		slot = VirtualTexture_FindSlot(vt);
+		if (slot < 0) {
+			break;
+		}
+		if (vt->slotTile[slot] >= 0) {
+			vt->pageTable[vt->slotTile[slot]] = VT_MISSING;
+			vt->numEvictions++;
+		}
+
+		vt->slotTile[slot] = tile;
+		vt->slotUsed[slot] = vt->frame;
+		vt->pageTable[tile] = VT_LOADING;
+		SlotQueue_Push(&vt->requests, slot);
+		SDL_SemPost(vt->wake);
+		vt->inFlight++;
+		vt->numLoads++;
+	}
+}
+
+void VisualizeRayDirections(const RenderView* rv) {
+	for (int i = 0; i < rv->vp.h; i++) {
+		for (int j = 0; j < rv->vp.w; j++) {
+			vec3 dir = vec3_scale(vec3_normalize(RenderView_Ray(rv, j, i)), 255);
+
+			// SetPixel(j, i, (rgb){(uint8_t)(j ^ i), 0, 0});
+			SetPixel(rv->vp.x + j, rv->vp.y + i, (rgb){fabsf(dir.x), fabsf(dir.y), fabsf(dir.z)});
+		}
+	}
+}
+
+// https://en.wikipedia.org/wiki/Cube_mapping
+void convert_xyz_to_cube_uv(float x, float y, float z, int *index, float *u, float *v)
+{
+  float absX = fabs(x);
+  float absY = fabs(y);
+  float absZ = fabs(z);
+  
+  int isXPositive = x > 0 ? 1 : 0;
   int isYPositive = y > 0 ? 1 : 0;
   int isZPositive = z > 0 ? 1 : 0;
   
@@ -648,623 +2750,4350 @@ void convert_xyz_to_cube_uv(float x, float y, float z, int *index, float *u, flo
     *index = 5;
   }
 
-  // Convert range from -1 to 1 to 0 to 1
-  *u = 0.5f * (uc / maxAxis + 1.0f);
-  *v = 0.5f * (vc / maxAxis + 1.0f);
+  // Convert range from -1 to 1 to 0 to 1
+  *u = 0.5f * (uc / maxAxis + 1.0f);
+  *v = 0.5f * (vc / maxAxis + 1.0f);
+}
+
+typedef struct Skybox {
+	SDL_Surface* imgs[6];
+} Skybox;
+
+Skybox mainSkybox;
+
+void LoadSkybox(Skybox* sb, const char** paths) {
+	for (int i = 0; i < 6; i++) {
+		SDL_Surface* surf = IMG_Load(paths[i]);
+		sb->imgs[i] = surf;
+	}
+}
+
+void DrawSky(Skybox* sb, const RenderView* rv) {
+	for (int i = rv->firstRow; i < rv->vp.h; i += rv->rowStep) {
+		Uint64 rowStart = rv->heat != NULL ? SDL_GetPerformanceCounter() : 0;
+
+		for (int j = 0; j < rv->vp.w; j++) {
+			vec3 dir = vec3_scale(vec3_normalize(RenderView_Ray(rv, j, i)), 255);
+
+			int index;
+			float u;
+			float v;
+			convert_xyz_to_cube_uv(dir.x, dir.y, dir.z, &index, &u, &v);
+
+			int tx = mapf(u, 0, 1, 0, sb->imgs[0]->w);
+			int ty = mapf(v, 0, 1, 0, sb->imgs[0]->h);
+
+			rgb colour = SampleSurface(sb->imgs[index], tx, ty);
+
+			// SetPixel(j, i, (rgb){(uint8_t)(j ^ i), 0, 0});
+			SetPixel(rv->vp.x + j, rv->vp.y + i, colour);
+		}
+
+		if (rv->heat != NULL) {
+			Heatmap_Time(rv->heat, Pass_Sky, rv->vp.x, rv->vp.y + i, rv->vp.w, SDL_GetPerformanceCounter() - rowStart);
+			Heatmap_Fetch(rv->heat, Pass_Sky, rv->vp.x, rv->vp.y + i, rv->vp.w, rv->vp.w);
+			Heatmap_WriteSpan(rv->heat, Pass_Sky, rv->vp.x, rv->vp.y + i, rv->vp.w);
+		}
+	}
+}
+
+typedef enum FloorMode {
+	Floor_Float,
+	Floor_Fixed,
+	Floor_Bilinear,
+	NUM_FLOOR_MODES
+} FloorMode;
+
+const char* floorModeNames[NUM_FLOOR_MODES] = {"float", "fixed", "bilinear"};
+
+// Can be changed with --floor
+FloorMode floorMode = Floor_Fixed;
+
+// Casts a ray for every pixel
+void DrawFloorFloat(const RenderView* rv) {
+	vec3 pos = rv->cam->position;
+	TrackTexels texels = Track_Texels(&rv->world->track);
+
+	for (int i = rv->firstRow; i < rv->vp.h; i += rv->rowStep) {
+		Uint64 rowStart = rv->heat != NULL ? SDL_GetPerformanceCounter() : 0;
+
+		for (int j = 0; j < rv->vp.w; j++) {
+			vec3 dir = RenderView_Ray(rv, j, i);
+
+			float t = -pos.z / dir.z;
+
+			if (t < 0) {
+				continue;
+			}
+
+			float fx = pos.x + t * dir.x;
+			float fy = pos.y + t * dir.y;
+
+			int size = 1 << rv->world->track.size_log2;
+
+			if (fx < 0 || fx > size || fy < 0 || fy > size) {
+				// SetPixel(j, i, (rgb){0, 0, 0});
+				continue;
+			}
+
+			int mask = size - 1;
+			int tx = (int)fx & mask;
+			int ty = (int)fy & mask;
+
+			const uint8_t* p = TrackTexels_Get(&texels, tx, ty);
+			uint8_t r = p[0];
+			uint8_t g = p[1];
+			uint8_t b = p[2];
+
+			// This is the slow reference floor anyway, so it counts as it goes
+			if (rv->heat != NULL) {
+				Heatmap_Fetch(rv->heat, Pass_Floor, rv->vp.x + j, rv->vp.y + i, 1, 1);
+			}
+
+			if (r == 255 && g == 0 && b == 255) {
+				continue;
+			}
+
+			SetPixel(rv->vp.x + j, rv->vp.y + i, (rgb){r, g, b});
+			if (rv->heat != NULL) {
+				Heatmap_Write(rv->heat, Pass_Floor, rv->vp.x + j, rv->vp.y + i);
+			}
+		}
+
+		if (rv->heat != NULL) {
+			Heatmap_Time(rv->heat, Pass_Floor, rv->vp.x, rv->vp.y + i, rv->vp.w, SDL_GetPerformanceCounter() - rowStart);
+		}
+	}
+}
+
+// Narrows [j0, j1) to the pixels where a + b * j is on the track
+void Floor_ClipSpan(float a, float b, int size, int* j0, int* j1) {
+	if (b == 0) {
+		if (a < 0 || a >= size) {
+			*j1 = *j0;
+		}
+		return;
+	}
+
+	float lo = -a / b;
+	float hi = (size - a) / b;
+	if (b < 0) {
+		float tmp = lo;
+		lo = hi;
+		hi = tmp;
+	}
+
+	int start = ceilf(clampf(lo, *j0, *j1));
+	int end = ceilf(clampf(hi, *j0, *j1));
+	if (start > *j0) {
+		*j0 = start;
+	}
+	if (end < *j1) {
+		*j1 = end;
+	}
+}
+
+// Counts a row of DrawFloorFixed for the heatmap by stepping along it again,
+// fetching the same texels but not drawing them
+void Floor_CountRow(const RenderView* rv, const TrackTexels* texels, int i, int j0, int j1, Uint64 rowStart, int64_t fx, int64_t fy, int32_t stepx, int32_t stepy, int mask, bool bilinear) {
+	HeatTotals* heat = rv->heat;
+	int y = rv->vp.y + i;
+	Heatmap_Time(heat, Pass_Floor, rv->vp.x + j0, y, j1 - j0, SDL_GetPerformanceCounter() - rowStart);
+
+	if (bilinear) {
+		fx -= 1 << 15;
+		fy -= 1 << 15;
+	}
+	for (int j = j0; j < j1; j++, fx += stepx, fy += stepy) {
+		int x = rv->vp.x + j;
+		if (!bilinear) {
+			Heatmap_Fetch(heat, Pass_Floor, x, y, 1, 1);
+			if (!IsTransparentTexel(TrackTexels_Get(texels, (fx >> 16) & mask, (fy >> 16) & mask))) {
+				Heatmap_Write(heat, Pass_Floor, x, y);
+			}
+			continue;
+		}
+
+		int tx0 = (fx >> 16) & mask;
+		int ty0 = (fy >> 16) & mask;
+		int tx1 = (tx0 + 1) & mask;
+		int ty1 = (ty0 + 1) & mask;
+		Heatmap_Fetch(heat, Pass_Floor, x, y, 1, 4);
+		if (IsTransparentTexel(TrackTexels_Get(texels, tx0, ty0)) || IsTransparentTexel(TrackTexels_Get(texels, tx1, ty0)) || IsTransparentTexel(TrackTexels_Get(texels, tx0, ty1)) || IsTransparentTexel(TrackTexels_Get(texels, tx1, ty1))) {
+			Heatmap_Fetch(heat, Pass_Floor, x, y, 1, 1);
+			if (IsTransparentTexel(TrackTexels_Get(texels, ((fx + (1 << 15)) >> 16) & mask, ((fy + (1 << 15)) >> 16) & mask))) {
+				continue;
+			}
+		}
+		Heatmap_Write(heat, Pass_Floor, x, y);
+	}
+}
+
+// The floor is flat and the camera never rolls, so every ray in a row hits
+// the floor at the same distance and the hits are evenly spaced. Only the
+// start of each row needs float maths. The rest steps in 16.16 fixed point,
+// skipping the parts of the row that miss the track. With bilinear set the
+// four nearest texels are blended using the fractional bits.
+void DrawFloorFixed(const RenderView* rv, bool bilinear) {
+	vec3 pos = rv->cam->position;
+
+	TrackTexels texels = Track_Texels(&rv->world->track);
+	int size = 1 << rv->world->track.size_log2;
+	int mask = size - 1;
+
+	for (int i = rv->firstRow; i < rv->vp.h; i += rv->rowStep) {
+		Uint64 rowStart = rv->heat != NULL ? SDL_GetPerformanceCounter() : 0;
+
+		vec3 dir0 = RenderView_Ray(rv, 0, i);
+		vec3 dir1 = RenderView_Ray(rv, rv->vp.w, i);
+
+		float t = -pos.z / dir0.z;
+		if (!(t >= 0) || isinf(t)) {
+			continue;
+		}
+
+		float fx0 = pos.x + t * dir0.x;
+		float fy0 = pos.y + t * dir0.y;
+		float dfx = t * (dir1.x - dir0.x) / rv->vp.w;
+		float dfy = t * (dir1.y - dir0.y) / rv->vp.w;
+
+		int j0 = 0;
+		int j1 = rv->vp.w;
+		Floor_ClipSpan(fx0, dfx, size, &j0, &j1);
+		Floor_ClipSpan(fy0, dfy, size, &j0, &j1);
+		if (j0 >= j1) {
+			continue;
+		}
+
+		// Positions are 64 bit so stepping past the far edge of a
+		// MAX_TRACK_LOG2 track after the last pixel can't overflow
+		int64_t fx = (fx0 + j0 * dfx) * 65536;
+		int64_t fy = (fy0 + j0 * dfy) * 65536;
+		// A row that steps nearly the whole track has at most two pixels
+		// on it. Clamping keeps the step in range on the biggest track.
+		int32_t stepx = clampf(dfx, 1 - size, size - 1) * 65536;
+		int32_t stepy = clampf(dfy, 1 - size, size - 1) * 65536;
+		int64_t rowX = fx;
+		int64_t rowY = fy;
+
+		uint8_t* out = (uint8_t*)textureData + (rv->vp.y + i) * rowPitch + (rv->vp.x + j0) * 3;
+
+		if (!bilinear) {
+			for (int j = j0; j < j1; j++, fx += stepx, fy += stepy, out += 3) {
+				const uint8_t* p = TrackTexels_Get(&texels, (fx >> 16) & mask, (fy >> 16) & mask);
+				if (IsTransparentTexel(p)) {
+					continue;
+				}
+				out[0] = p[0];
+				out[1] = p[1];
+				out[2] = p[2];
+			}
+			if (rv->heat != NULL) {
+				Floor_CountRow(rv, &texels, i, j0, j1, rowStart, rowX, rowY, stepx, stepy, mask, false);
+			}
+			continue;
+		}
+
+		// Texel centres are at +0.5
+		fx -= 1 << 15;
+		fy -= 1 << 15;
+		for (int j = j0; j < j1; j++, fx += stepx, fy += stepy, out += 3) {
+			int tx0 = (fx >> 16) & mask;
+			int ty0 = (fy >> 16) & mask;
+			int tx1 = (tx0 + 1) & mask;
+			int ty1 = (ty0 + 1) & mask;
+			int ax = (fx >> 8) & 0xFF;
+			int ay = (fy >> 8) & 0xFF;
+
+			const uint8_t* p00 = TrackTexels_Get(&texels, tx0, ty0);
+			const uint8_t* p10 = TrackTexels_Get(&texels, tx1, ty0);
+			const uint8_t* p01 = TrackTexels_Get(&texels, tx0, ty1);
+			const uint8_t* p11 = TrackTexels_Get(&texels, tx1, ty1);
+
+			// Blending into a transparent texel would tint the edge, so
+			// edges fall back to the nearest texel
+			if (IsTransparentTexel(p00) || IsTransparentTexel(p10) || IsTransparentTexel(p01) || IsTransparentTexel(p11)) {
+				const uint8_t* p = TrackTexels_Get(&texels, ((fx + (1 << 15)) >> 16) & mask, ((fy + (1 << 15)) >> 16) & mask);
+				if (!IsTransparentTexel(p)) {
+					out[0] = p[0];
+					out[1] = p[1];
+					out[2] = p[2];
+				}
+				continue;
+			}
+
+			for (int c = 0; c < 3; c++) {
+				int top = p00[c] * (256 - ax) + p10[c] * ax;
+				int bottom = p01[c] * (256 - ax) + p11[c] * ax;
+				out[c] = (top * (256 - ay) + bottom * ay) >> 16;
+			}
+		}
+		if (rv->heat != NULL) {
+			Floor_CountRow(rv, &texels, i, j0, j1, rowStart, rowX, rowY, stepx, stepy, mask, true);
+		}
+	}
+}
+
+void DrawFloor(const RenderView* rv) {
+	switch (floorMode) {
+	case Floor_Float:
+		DrawFloorFloat(rv);
+		break;
+	case Floor_Fixed:
+		DrawFloorFixed(rv, false);
+		break;
+	case Floor_Bilinear:
+		DrawFloorFixed(rv, true);
+		break;
+	default:
+		fprintf(stderr, "Invalid floor mode %d\n", floorMode);
+		exit(EXIT_FAILURE);
+	}
+}
+
+////////////////////
+// Sprite compositing
+//
+// Sprite levels are premultiplied, so drawing a texel over the frame is
+// dst = src + dst * (255 - a) / 255 on every channel. Each row of a sprite is
+// gathered into the frame's RGB24 layout first, with 255 - a repeated for
+// each channel, so the blend is the same on every byte and runs 16 or 32
+// bytes at a time.
+
+// x / 255, rounded, for x up to 255 * 255
+int Div255(int x) {
+	x += 128;
+	return (x + (x >> 8)) >> 8;
+}
+
+void PremultiplySurface(SDL_Surface* surf) {
+	for (int y = 0; y < surf->h; y++) {
+		uint8_t* p = (uint8_t*)surf->pixels + y * surf->pitch;
+		for (int x = 0; x < surf->w; x++, p += 4) {
+			for (int c = 0; c < 3; c++) {
+				p[c] = Div255(p[c] * p[3]);
+			}
+		}
+	}
+}
+
+void BlendSpan_Scalar(uint8_t* dst, const uint8_t* src, const uint8_t* inv, int n) {
+	for (int i = 0; i < n; i++) {
+		dst[i] = src[i] + Div255(dst[i] * inv[i]);
+	}
+}
+
+#ifdef __SSE2__
+#include <immintrin.h>
+
+// Every product fits in 16 bits, so the bytes are widened, multiplied and
+// divided by 255 in two halves
+__m128i Blend_SSE2(__m128i d, __m128i s, __m128i inv) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i round = _mm_set1_epi16(128);
+	__m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(inv, zero));
+	__m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(inv, zero));
+	lo = _mm_add_epi16(lo, round);
+	hi = _mm_add_epi16(hi, round);
+	lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+	hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+	return _mm_adds_epu8(s, _mm_packus_epi16(lo, hi));
+}
+
+void BlendSpan_SSE2(uint8_t* dst, const uint8_t* src, const uint8_t* inv, int n) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i full = _mm_set1_epi8(-1);
+	int i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(inv + i));
+		__m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, full)) == 0xffff) {
+			continue;
+		}
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, zero)) == 0xffff) {
+			_mm_storeu_si128((__m128i*)(dst + i), s);
+			continue;
+		}
+		__m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+		_mm_storeu_si128((__m128i*)(dst + i), Blend_SSE2(d, s, a));
+	}
+	BlendSpan_Scalar(dst + i, src + i, inv + i, n - i);
+}
+
+// Unpacking and packing both work within each 128 bit lane, so the bytes come
+// back out in the order they went in
+__attribute__((target("avx2")))
+void BlendSpan_AVX2(uint8_t* dst, const uint8_t* src, const uint8_t* inv, int n) {
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i full = _mm256_set1_epi8(-1);
+	const __m256i round = _mm256_set1_epi16(128);
+	int i = 0;
+	for (; i + 32 <= n; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)(inv + i));
+		__m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, full)) == -1) {
+			continue;
+		}
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, zero)) == -1) {
+			_mm256_storeu_si256((__m256i*)(dst + i), s);
+			continue;
+		}
+		__m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+		__m256i lo = _mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi8(a, zero));
+		__m256i hi = _mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi8(a, zero));
+		lo = _mm256_add_epi16(lo, round);
+		hi = _mm256_add_epi16(hi, round);
+		lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+		hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm256_adds_epu8(s, _mm256_packus_epi16(lo, hi)));
+	}
+	BlendSpan_SSE2(dst + i, src + i, inv + i, n - i);
+}
+
+void (*BlendSpan)(uint8_t* dst, const uint8_t* src, const uint8_t* inv, int n) = BlendSpan_SSE2;
+
+void BlendSpan_Init() {
+	if (SDL_HasAVX2()) {
+		BlendSpan = BlendSpan_AVX2;
+	}
+}
+#else
+void (*BlendSpan)(uint8_t* dst, const uint8_t* src, const uint8_t* inv, int n) = BlendSpan_Scalar;
+
+void BlendSpan_Init() {
+}
+#endif
+
+// Halves every frame of a sprite sheet. Colours are premultiplied, so
+// averaging them weights each by its alpha and transparent texels don't
+// darken the edges.
+SDL_Surface* DownscaleSpriteSheet(Arena* arena, SDL_Surface* src, int numAngles, int srcW, int srcH, int dstW, int dstH) {
+	SDL_Surface* dst = Arena_CreateSurface(arena, dstW * numAngles, dstH, SDL_PIXELFORMAT_RGBA32);
+
+	for (int f = 0; f < numAngles; f++) {
+		for (int y = 0; y < dstH; y++) {
+			for (int x = 0; x < dstW; x++) {
+				int sum[4] = {0};
+				for (int dy = 0; dy < 2; dy++) {
+					for (int dx = 0; dx < 2; dx++) {
+						int sx = x * 2 + dx < srcW ? x * 2 + dx : srcW - 1;
+						int sy = y * 2 + dy < srcH ? y * 2 + dy : srcH - 1;
+						rgba c = SampleSurface_rgba(src, f * srcW + sx, sy);
+						sum[0] += c.r;
+						sum[1] += c.g;
+						sum[2] += c.b;
+						sum[3] += c.a;
+					}
+				}
+
+				uint8_t* p = (uint8_t*)dst->pixels + y * dst->pitch + (f * dstW + x) * 4;
+				for (int c = 0; c < 4; c++) {
+					p[c] = (sum[c] + 2) / 4;
+				}
+			}
+		}
+	}
+
+	return dst;
+}
+
+// Loads a sprite sheet and builds its mip chain, or finds it if this track
+// already loaded it. A sheet with rotations has square frames side by side.
+SpriteImage* LoadSpriteImage(TrackLoad* tl, const char* path, bool rotations) {
+	Track* tr = &tl->track;
+	for (int i = 0; i < tr->numSpriteImages; i++) {
+		if (strcmp(tr->spriteImages[i]->path, path) == 0) {
+			return tr->spriteImages[i];
+		}
+	}
+
+	if (tr->numSpriteImages == MAX_SPRITE_IMAGES) {
+		fprintf(stderr, "Ran out of sprite images\n");
+		exit(EXIT_FAILURE);
+	}
+
+	SDL_Surface* surf = IMG_Load(path);
+	if (surf == NULL) {
+		fprintf(stderr, "Unable to load sprite: %s\n", IMG_GetError());
+		exit(EXIT_FAILURE);
+	}
+
+	SpriteImage* image = Arena_Calloc(tr->arena, 1, sizeof(SpriteImage));
+	snprintf(image->path, sizeof(image->path), "%s", path);
+	image->numAngles = rotations ? surf->w / surf->h : 1;
+	image->frameW = rotations ? surf->h : surf->w;
+	image->frameH = surf->h;
+
+	image->levels[0] = Arena_ConvertSurface(tr->arena, surf, SDL_PIXELFORMAT_RGBA32);
+	SDL_FreeSurface(surf);
+	PremultiplySurface(image->levels[0]);
+	image->numLevels = 1;
+	int w = image->frameW;
+	int h = image->frameH;
+	while (image->numLevels < MAX_SPRITE_LEVELS && (w > 1 || h > 1)) {
+		int nw = w > 1 ? w / 2 : 1;
+		int nh = h > 1 ? h / 2 : 1;
+		image->levels[image->numLevels] = DownscaleSpriteSheet(tr->arena, image->levels[image->numLevels - 1], image->numAngles, w, h, nw, nh);
+		image->numLevels++;
+		w = nw;
+		h = nh;
+	}
+
+	tr->spriteImages[tr->numSpriteImages++] = image;
+	return image;
+}
+
+// Several sprites can share one sprite sheet, e.g. karts on the same path
+int AddSpriteImage(TrackLoad* tl, SpriteImage* image) {
+	int i = tl->sprites.count;
+	if (i == MAX_SPRITES) {
+		fprintf(stderr, "Ran out of sprites\n");
+		exit(EXIT_FAILURE);
+	}
+
+	Sprite_Place(&tl->sprites, i, 0, 0);
+	tl->sprites.angle[i] = 0;
+	tl->spriteLooks.w[i] = image->frameW;
+	tl->spriteLooks.h[i] = image->frameH;
+	tl->spriteLooks.image[i] = image;
+	return tl->sprites.count++;
+}
+
+int AddSprite(TrackLoad* tl, const char* path) {
+	return AddSpriteImage(tl, LoadSpriteImage(tl, path, false));
+}
+
+int AddSpriteRotations(TrackLoad* tl, const char* path) {
+	return AddSpriteImage(tl, LoadSpriteImage(tl, path, true));
+}
+
+// Where a point lands in the viewport, in pixels from its top left corner
+vec2 ProjectPoint(const RenderView* rv, vec3 p) {
+	p = vec3_sub(p, rv->cam->position);
+	vec3 v = mat3_mul(rv->project, p);
+	v.y /= v.x;
+	v.z /= v.x;
+
+	return (vec2){
+		mapf(v.y, -1, 1, 0, rv->vp.w),
+		mapf(v.z, 1, -1, 0, rv->vp.h)
+	};
+}
+
+typedef struct SpriteDepth {
+	int index;
+	float depth;
+} SpriteDepth;
+
+int cmp_sprites(const void* a, const void* b) {
+	float da = ((const SpriteDepth*)a)->depth;
+	float db = ((const SpriteDepth*)b)->depth;
+
+	if (da < db) {
+		return 1;
+	}
+	else {
+		return -1;
+	}
+}
+
+void DrawSprites(const RenderView* rv) {
+	// TODO: Fix sprite rotations
+
+	const Camera* cam = rv->cam;
+	const SpritePositions* sp = rv->sprites;
+	const SpriteLooks* looks = rv->looks;
+	vec3 eye = cam->position;
+
+	// Depth of every sprite, in one pass over the positions
+	float depth[MAX_SPRITES];
+	for (int i = 0; i < sp->count; i++) {
+		depth[i] = cam->forward.x * (sp->x[i] - eye.x) + cam->forward.y * (sp->y[i] - eye.y) + cam->forward.z * (sp->z[i] - eye.z);
+	}
+
+	// Sprites behind the camera can't be seen, so they're dropped before
+	// sorting rather than projected
+	SpriteDepth drawOrder[MAX_SPRITES];
+	int numVisible = 0;
+	for (int i = 0; i < sp->count; i++) {
+		if (depth[i] > 1 && i != rv->hideSprite) {
+			drawOrder[numVisible++] = (SpriteDepth){i, depth[i]};
+		}
+	}
+	qsort(drawOrder, numVisible, sizeof(SpriteDepth), cmp_sprites);
+
+	// The ones left are gathered in drawing order, so projecting their
+	// corners is another pass over arrays
+	float posX[MAX_SPRITES];
+	float posY[MAX_SPRITES];
+	float posZ[MAX_SPRITES];
+	float halfW[MAX_SPRITES];
+	float height[MAX_SPRITES];
+	for (int k = 0; k < numVisible; k++) {
+		int i = drawOrder[k].index;
+		posX[k] = sp->x[i];
+		posY[k] = sp->y[i];
+		posZ[k] = sp->z[i];
+		halfW[k] = looks->w[i] / 2.0f;
+		height[k] = looks->h[i];
+	}
+
+	// Same as ProjectPoint on the bottom left, bottom right and top middle
+	// of each sprite, keeping only the coordinates that get used
+	float leftX[MAX_SPRITES];
+	float bottomY[MAX_SPRITES];
+	float rightX[MAX_SPRITES];
+	float topY[MAX_SPRITES];
+	mat3 m = rv->project;
+	vec3 r = cam->right;
+	vec3 u = cam->up;
+	float w = rv->vp.w;
+	float h = rv->vp.h;
+	for (int k = 0; k < numVisible; k++) {
+		float lx = (posX[k] - r.x * halfW[k]) - eye.x;
+		float ly = (posY[k] - r.y * halfW[k]) - eye.y;
+		float lz = (posZ[k] - r.z * halfW[k]) - eye.z;
+		float ld = m.a * lx + m.b * ly + m.c * lz;
+		leftX[k] = mapf((m.d * lx + m.e * ly + m.f * lz) / ld, -1, 1, 0, w);
+		bottomY[k] = mapf((m.g * lx + m.h * ly + m.i * lz) / ld, 1, -1, 0, h);
+
+		float rx = (posX[k] + r.x * halfW[k]) - eye.x;
+		float ry = (posY[k] + r.y * halfW[k]) - eye.y;
+		float rz = (posZ[k] + r.z * halfW[k]) - eye.z;
+		float rd = m.a * rx + m.b * ry + m.c * rz;
+		rightX[k] = mapf((m.d * rx + m.e * ry + m.f * rz) / rd, -1, 1, 0, w);
+
+		float tx = (posX[k] + u.x * height[k]) - eye.x;
+		float ty = (posY[k] + u.y * height[k]) - eye.y;
+		float tz = (posZ[k] + u.z * height[k]) - eye.z;
+		float td = m.a * tx + m.b * ty + m.c * tz;
+		topY[k] = mapf((m.g * tx + m.h * ty + m.i * tz) / td, 1, -1, 0, h);
+	}
+
+	for (int k = 0; k < numVisible; k++) {
+		int s = drawOrder[k].index;
+		const SpriteImage* image = looks->image[s];
+		int numAngles = image->numAngles;
+		Uint64 spanStart = rv->heat != NULL ? SDL_GetPerformanceCounter() : 0;
+
+		int rotationIndex = 0;
+		bool flipX = false;
+		if (numAngles > 1) {
+			// Select which sprite
+			//rotationIndex = (frame / 10) % numAngles;
+
+			vec2 diff = (vec2){sp->x[s] - cam->position.x, sp->y[s] - cam->position.y};
+			vec2 right = (vec2){cam->right.x, cam->right.y};
+
+			float theta = sp->angle[s] - cam->yaw - atanf(rv->halfW / cam->cam_dist * vec2_dot(diff, right) / vec2_dot(diff, cam->forward_2d));
+			// printf("%f\n", theta);
+			if (theta < 0) {
+				flipX = true;
+				theta = -theta;
+			}
+			rotationIndex = mapf(theta, 0, M_PI, 0, numAngles);
+			rotationIndex %= numAngles * 2;
+			if (rotationIndex >= numAngles) {
+				rotationIndex = rotationIndex - numAngles;
+				flipX = true;
+			}
+		}
+
+		vec2 left = {leftX[k], bottomY[k]};
+		vec2 right = {rightX[k], bottomY[k]};
+		vec2 top = {0, topY[k]};
+
+		// Use the smallest level that still has a texel for every pixel
+		float screenW = right.x - left.x;
+		int level = 0;
+		while (level + 1 < image->numLevels && (image->frameW >> (level + 1)) >= screenW) {
+			level++;
+		}
+		SDL_Surface* img = image->levels[level];
+		int levelW = image->frameW >> level > 0 ? image->frameW >> level : 1;
+		int levelH = image->frameH >> level > 0 ? image->frameH >> level : 1;
+
+		// Only pixels whose left/top edge is inside the sprite, so the texel
+		// lookups below never go before the start of the frame
+		int leftx = ceilf(clampf(left.x, 0, rv->vp.w));
+		int rightx = clampf(right.x, 0, rv->vp.w);
+
+		int topy = ceilf(clampf(top.y, 0, rv->vp.h));
+		int bottomy = clampf(left.y, 0, rv->vp.h);
+
+		// Every row reads the same texel columns
+		int n = rightx - leftx;
+		int cols[GAME_WIDTH];
+		for (int i = 0; i < n; i++) {
+			int x = leftx + i;
+			if (flipX) {
+				cols[i] = levelW - 1 - (int)mapf(x, left.x, right.x, 0, levelW) + levelW * rotationIndex;
+			}
+			else {
+				cols[i] = mapf(x, left.x, right.x, 0, levelW) + levelW * rotationIndex;
+			}
+		}
+
+		// Each texel is written as 4 bytes and the next one overwrites the
+		// extra byte, so there's one byte of slack at the end
+		uint8_t src[GAME_WIDTH * 3 + 1];
+		uint8_t inv[GAME_WIDTH * 3 + 1];
+		int gathered = -1;
+		for (int y = topy; y < bottomy; y++) {
+			// A sprite drawn bigger than its level repeats rows
+			int ty = mapf(y, top.y, left.y, 0, levelH);
+			bool fetched = ty != gathered;
+			if (fetched) {
+				const uint8_t* row = (const uint8_t*)img->pixels + ty * img->pitch;
+				for (int i = 0; i < n; i++) {
+					const uint8_t* c = row + cols[i] * 4;
+					uint32_t a = (255 - c[3]) * 0x01010101u;
+					memcpy(src + i * 3, c, 4);
+					memcpy(inv + i * 3, &a, 4);
+				}
+				gathered = ty;
+			}
+
+			uint8_t* dst = (uint8_t*)textureData + (rv->vp.y + y) * rowPitch + (rv->vp.x + leftx) * 3;
+			BlendSpan(dst, src, inv, n * 3);
+
+			if (rv->heat != NULL && n > 0) {
+				Uint64 now = SDL_GetPerformanceCounter();
+				Heatmap_Time(rv->heat, Pass_Sprites, rv->vp.x + leftx, rv->vp.y + y, n, now - spanStart);
+				Heatmap_Fetch(rv->heat, Pass_Sprites, rv->vp.x + leftx, rv->vp.y + y, n, fetched ? n : 0);
+				Heatmap_WriteSpan(rv->heat, Pass_Sprites, rv->vp.x + leftx, rv->vp.y + y, n);
+				spanStart = now;
+			}
+		}
+	}
+}
+
+void UpdateFreeFlyCamera(World* w) {
+	const float flySpeed = 200;
+
+	Camera* cam = &w->mainCamera;
+
+	float newYaw = cam->yaw + mousexrel * MOUSE_SENSITIVITY * global_dt;
+	float newPitch = cam->pitch - mouseyrel * MOUSE_SENSITIVITY * global_dt;
+
+	newPitch = clampf(newPitch, -M_PI_2, M_PI_2);
+
+	Camera_SetYawPitch(cam, newYaw, newPitch);
+
+	if (keyboardState[SDL_SCANCODE_W]) {
+		cam->position.x += cam->forward_2d.x * flySpeed * global_dt;
+		cam->position.y += cam->forward_2d.y * flySpeed * global_dt;
+	}
+	if (keyboardState[SDL_SCANCODE_S]) {
+		cam->position.x -= cam->forward_2d.x * flySpeed * global_dt;
+		cam->position.y -= cam->forward_2d.y * flySpeed * global_dt;
+	}
+	if (keyboardState[SDL_SCANCODE_D]) {
+		cam->position.x += cam->right.x * flySpeed * global_dt;
+		cam->position.y += cam->right.y * flySpeed * global_dt;
+	}
+	if (keyboardState[SDL_SCANCODE_A]) {
+		cam->position.x -= cam->right.x * flySpeed * global_dt;
+		cam->position.y -= cam->right.y * flySpeed * global_dt;
+	}
+
+	if (keyboardState[SDL_SCANCODE_SPACE]) {
+		cam->position.z += flySpeed * global_dt;
+	}
+	if (keyboardState[SDL_SCANCODE_LSHIFT]) {
+		cam->position.z -= flySpeed * global_dt;
+	}
+
+	if (keyboardState[SDL_SCANCODE_I]) {
+		Camera_SetFovX(cam, cam->fov_x + deg2rad(10) * global_dt);
+	}
+	if (keyboardState[SDL_SCANCODE_K]) {
+		Camera_SetFovX(cam, cam->fov_x - deg2rad(10) * global_dt);
+	}
+}
+
+// Called once player 1 is on the start line
+void LocalPlayers_Init(World* w) {
+	w->localPlayers[0] = (LocalPlayer){&w->mainCamera, &w->velocity, &w->mainPlayerState, 0};
+
+	// The others line up beside and behind player 1
+	vec2 start = {w->mainCamera.position.x, w->mainCamera.position.y};
+	vec2 forward = w->mainCamera.forward_2d;
+	vec2 right = {-forward.y, forward.x};
+
+	for (int p = 1; p < numLocalPlayers; p++) {
+		LocalPlayer* lp = &w->localPlayers[p];
+		*lp = (LocalPlayer){&w->splitScreenCameras[p], &w->splitScreenVelocities[p], &w->splitScreenStates[p], 0};
+
+		vec2 pos = vec2_add(start, vec2_add(
+			vec2_scale(right, (p % 2) * 3 * KART_RADIUS),
+			vec2_scale(forward, -(p / 2) * ENEMY_SPACING)
+		));
+
+		*lp->camera = w->mainCamera;
+		lp->camera->position.x = pos.x;
+		lp->camera->position.y = pos.y;
+		*lp->velocity = (vec2){0};
+		RaceProgress_Init(&lp->state->progress, w->mainPlayerState.progress.route, pos, 0, 1);
+	}
+}
+
+bool LocalPlayers_Finished(const World* w) {
+	for (int p = 0; p < numLocalPlayers; p++) {
+		if (w->localPlayers[p].state->progress.finishPlace == 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void Standings_Init(World* w) {
+	w->numFinishedKarts = 0;
+
+	w->numRacers = 0;
+	for (int p = 0; p < numLocalPlayers; p++) {
+		w->standings[w->numRacers++] = &w->localPlayers[p].state->progress;
+	}
+	for (int i = 0; i < w->enemies.count; i++) {
+		w->standings[w->numRacers++] = &w->enemies.progress[i];
+	}
+}
+
+void Standings_Sort(World* w) {
+	RaceProgress** standings = w->standings;
+
+	// The order barely changes between frames, so insertion sort is close to
+	// linear here
+	for (int i = 1; i < w->numRacers; i++) {
+		RaceProgress* rp = standings[i];
+		int j = i - 1;
+		while (j >= 0 && RaceProgress_Ahead(rp, standings[j])) {
+			standings[j + 1] = standings[j];
+			j--;
+		}
+		standings[j + 1] = rp;
+	}
+}
+
+int Standings_Place(const World* w, const RaceProgress* rp) {
+	for (int i = 0; i < w->numRacers; i++) {
+		if (w->standings[i] == rp) {
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+void Standings_Update(World* w) {
+	Standings_Sort(w);
+	for (int p = 0; p < numLocalPlayers; p++) {
+		w->localPlayers[p].place = Standings_Place(w, &w->localPlayers[p].state->progress);
+	}
+}
+
+// Moves a kart on along its racing line, and gives it its place if that
+// finished the race
+void Standings_Advance(World* w, RaceProgress* rp, vec2 pos) {
+	if (RaceProgress_Update(rp, pos)) {
+		rp->finishPlace = ++w->numFinishedKarts;
+	}
+}
+
+vec2 Kart_GetPos(const World* w, int kart) {
+	if (kart == 0) {
+		return (vec2){w->mainCamera.position.x, w->mainCamera.position.y};
+	}
+	return (vec2){w->enemies.posX[kart - 1], w->enemies.posY[kart - 1]};
+}
+
+void Collision_InsertKarts(World* w) {
+	CollisionGrid* g = &w->track.collision;
+	int numCells = g->cellsX * g->cellsY;
+	int n = w->enemies.count + 1;
+
+	memset(g->kartStart, 0, (numCells + 1) * sizeof(int));
+	for (int k = 0; k < n; k++) {
+		int cell = CollisionGrid_Cell(g, Kart_GetPos(w, k));
+		g->kartCell[k] = cell;
+		g->kartStart[cell + 1]++;
+	}
+	for (int c = 0; c < numCells; c++) {
+		g->kartStart[c + 1] += g->kartStart[c];
+	}
+
+	memcpy(g->kartFill, g->kartStart, numCells * sizeof(int));
+	for (int k = 0; k < n; k++) {
+		g->karts[g->kartFill[g->kartCell[k]]++] = k;
+	}
+
+	g->tests = 0;
+}
+
+// Circle vs circle. On overlap gives the normal pointing from q towards p,
+// and how far p has to move along it to separate them.
+bool Collision_Circles(CollisionGrid* g, vec2 p, vec2 q, float r, vec2* normal, float* depth) {
+	g->tests++;
+
+	vec2 d = vec2_sub(p, q);
+	float d2 = vec2_dot(d, d);
+	if (d2 >= r * r) {
+		return false;
+	}
+
+	float dist = sqrtf(d2);
+	*normal = dist > 1e-4f ? vec2_scale(d, 1 / dist) : (vec2){1, 0};
+	*depth = r - dist;
+	return true;
+}
+
+// Per-frame velocity of an enemy, in the same units as the player's velocity
+vec2 Enemies_GetVelocity(Enemies* e, int i) {
+	return (vec2){
+		e->dirX[i] * e->speed[i] * global_dt,
+		e->dirY[i] * e->speed[i] * global_dt
+	};
+}
+
+// Enemies can only change speed along their path, so only the part of the
+// impulse along their heading is kept.
+void Enemies_ApplyImpulse(Enemies* e, int i, vec2 impulse) {
+	float dv = vec2_dot(impulse, (vec2){e->dirX[i], e->dirY[i]}) / global_dt;
+	e->speed[i] = clampf(e->speed[i] + dv, 0, ENEMY_TOP_SPEED * 1.5f);
+}
+
+// Equal mass impulse between two karts, returns the change in a's velocity
+vec2 Collision_KartImpulse(vec2 va, vec2 vb, vec2 n) {
+	float vn = vec2_dot(vec2_sub(va, vb), n);
+	if (vn >= 0) {
+		return (vec2){0, 0};
+	}
+	return vec2_scale(n, -(1 + KART_RESTITUTION) * vn / 2);
+}
+
+// Bounce off something that doesn't move
+vec2 Collision_StaticImpulse(vec2 v, vec2 n) {
+	float vn = vec2_dot(v, n);
+	if (vn >= 0) {
+		return (vec2){0, 0};
+	}
+	return vec2_scale(n, -(1 + KART_RESTITUTION) * vn);
+}
+
+void Enemies_Reproject(Enemies* e, int i);
+
+// Keep a kart inside the wall around the road and on the map, returning the
+// normal of whatever it was pushed back off
+bool Collision_Wall(const TrackSDF* sdf, vec2* p, vec2* n) {
+	bool hit = false;
+
+	vec2 g;
+	float d = TrackSDF_Get(sdf, p->x, p->y, &g);
+	if (d > TRACK_WALL_DISTANCE && (g.x != 0 || g.y != 0)) {
+		*p = vec2_sub(*p, vec2_scale(g, d - TRACK_WALL_DISTANCE));
+		*n = vec2_scale(g, -1);
+		hit = true;
+	}
+
+	float lo = KART_RADIUS;
+	float hi = sdf->size - KART_RADIUS;
+	if (p->x < lo || p->x > hi) {
+		*n = (vec2){p->x < lo ? 1 : -1, 0};
+		p->x = p->x < lo ? lo : hi;
+		hit = true;
+	}
+	if (p->y < lo || p->y > hi) {
+		*n = (vec2){0, p->y < lo ? 1 : -1};
+		p->y = p->y < lo ? lo : hi;
+		hit = true;
+	}
+	return hit;
+}
+
+// Returns the size of the biggest impulse, or 0 if nothing was hit. Without
+// pushEnemies the enemies are left where they are, for a client predicting a
+// kart whose enemies belong to the server.
+float Collision_ResolvePlayer(World* w, Camera* cam, vec2* vel, bool pushEnemies) {
+	CollisionGrid* g = &w->track.collision;
+	Enemies* e = &w->enemies;
+	vec2 p = {cam->position.x, cam->position.y};
+	float hardest = 0;
+
+	int x0 = CollisionGrid_CellCoord(g->cellsX, p.x - COLLISION_QUERY_RADIUS);
+	int x1 = CollisionGrid_CellCoord(g->cellsX, p.x + COLLISION_QUERY_RADIUS);
+	int y0 = CollisionGrid_CellCoord(g->cellsY, p.y - COLLISION_QUERY_RADIUS);
+	int y1 = CollisionGrid_CellCoord(g->cellsY, p.y + COLLISION_QUERY_RADIUS);
+
+	for (int y = y0; y <= y1; y++) {
+		for (int x = x0; x <= x1; x++) {
+			int cell = y * g->cellsX + x;
+
+			vec2 n;
+			float depth;
+			for (int t = g->treeStart[cell]; t < g->treeStart[cell + 1]; t++) {
+				if (Collision_Circles(g, p, g->trees[t], KART_RADIUS + TREE_RADIUS, &n, &depth)) {
+					p = vec2_add(p, vec2_scale(n, depth));
+					vec2 impulse = Collision_StaticImpulse(*vel, n);
+					*vel = vec2_add(*vel, impulse);
+					hardest = fmaxf(hardest, sqrtf(vec2_dot(impulse, impulse)));
+				}
+			}
+
+			for (int k = g->kartStart[cell]; k < g->kartStart[cell + 1]; k++) {
+				int kart = g->karts[k];
+				if (kart == 0) {
+					continue;
+				}
+
+				int i = kart - 1;
+				vec2 q = {e->posX[i], e->posY[i]};
+				if (Collision_Circles(g, p, q, 2 * KART_RADIUS, &n, &depth)) {
+					p = vec2_add(p, vec2_scale(n, depth / 2));
+					vec2 impulse = Collision_KartImpulse(*vel, Enemies_GetVelocity(e, i), n);
+					*vel = vec2_add(*vel, impulse);
+					if (pushEnemies) {
+						e->posX[i] -= n.x * depth / 2;
+						e->posY[i] -= n.y * depth / 2;
+						Enemies_ApplyImpulse(e, i, vec2_scale(impulse, -1));
+						Enemies_Reproject(e, i);
+					}
+					hardest = fmaxf(hardest, sqrtf(vec2_dot(impulse, impulse)));
+				}
+			}
+		}
+	}
+
+	vec2 n;
+	if (Collision_Wall(&w->track.sdf, &p, &n)) {
+		vec2 impulse = Collision_StaticImpulse(*vel, n);
+		*vel = vec2_add(*vel, impulse);
+		hardest = fmaxf(hardest, sqrtf(vec2_dot(impulse, impulse)));
+	}
+
+	cam->position.x = p.x;
+	cam->position.y = p.y;
+	return hardest;
+}
+
+void Collision_ResolveEnemy(World* w, int i) {
+	CollisionGrid* g = &w->track.collision;
+	Enemies* e = &w->enemies;
+	vec2 p = {e->posX[i], e->posY[i]};
+	bool hit = false;
+
+	int x0 = CollisionGrid_CellCoord(g->cellsX, p.x - COLLISION_QUERY_RADIUS);
+	int x1 = CollisionGrid_CellCoord(g->cellsX, p.x + COLLISION_QUERY_RADIUS);
+	int y0 = CollisionGrid_CellCoord(g->cellsY, p.y - COLLISION_QUERY_RADIUS);
+	int y1 = CollisionGrid_CellCoord(g->cellsY, p.y + COLLISION_QUERY_RADIUS);
+
+	for (int y = y0; y <= y1; y++) {
+		for (int x = x0; x <= x1; x++) {
+			int cell = y * g->cellsX + x;
+
+			vec2 n;
+			float depth;
+			for (int t = g->treeStart[cell]; t < g->treeStart[cell + 1]; t++) {
+				if (Collision_Circles(g, p, g->trees[t], KART_RADIUS + TREE_RADIUS, &n, &depth)) {
+					p = vec2_add(p, vec2_scale(n, depth));
+					Enemies_ApplyImpulse(e, i, Collision_StaticImpulse(Enemies_GetVelocity(e, i), n));
+					hit = true;
+				}
+			}
+
+			// Each pair of enemies is handled once, by the lower index. The
+			// player was already handled in Collision_ResolvePlayer.
+			for (int k = g->kartStart[cell]; k < g->kartStart[cell + 1]; k++) {
+				int j = g->karts[k] - 1;
+				if (j <= i) {
+					continue;
+				}
+
+				vec2 q = {e->posX[j], e->posY[j]};
+				if (Collision_Circles(g, p, q, 2 * KART_RADIUS, &n, &depth)) {
+					p = vec2_add(p, vec2_scale(n, depth / 2));
+					e->posX[j] -= n.x * depth / 2;
+					e->posY[j] -= n.y * depth / 2;
+
+					vec2 impulse = Collision_KartImpulse(Enemies_GetVelocity(e, i), Enemies_GetVelocity(e, j), n);
+					Enemies_ApplyImpulse(e, i, impulse);
+					Enemies_ApplyImpulse(e, j, vec2_scale(impulse, -1));
+					Enemies_Reproject(e, j);
+					hit = true;
+				}
+			}
+		}
+	}
+
+	vec2 n;
+	if (Collision_Wall(&w->track.sdf, &p, &n)) {
+		Enemies_ApplyImpulse(e, i, Collision_StaticImpulse(Enemies_GetVelocity(e, i), n));
+		hit = true;
+	}
+
+	if (hit) {
+		e->posX[i] = p.x;
+		e->posY[i] = p.y;
+		Enemies_Reproject(e, i);
+	}
+}
+
+void Player_Move(World* w, Camera* cam, vec2* vel, uint16_t keys) {
+	const float acceleration = 20;
+
+	TerrainClass terrain = TerrainMap_Get(&w->track.terrain, cam->position.x, cam->position.y);
+	float drag = terrainInfo[terrain].drag;
+
+	if (keys & INPUT_BIT(INPUT_W)) {
+		vel->x += cam->forward_2d.x * acceleration * global_dt;
+		vel->y += cam->forward_2d.y * acceleration * global_dt;
+	}
+	if (keys & INPUT_BIT(INPUT_S)) {
+		vel->x -= cam->forward_2d.x * acceleration * global_dt;
+		vel->y -= cam->forward_2d.y * acceleration * global_dt;
+	}
+
+	if (keys & INPUT_BIT(INPUT_A)) {
+		Camera_SetYawPitch(cam, cam->yaw - PLAYER_TURN_SPEED * global_dt, cam->pitch);
+	}
+	if (keys & INPUT_BIT(INPUT_D)) {
+		Camera_SetYawPitch(cam, cam->yaw + PLAYER_TURN_SPEED * global_dt, cam->pitch);
+	}
+
+	vel->x -= drag * vel->x * global_dt;
+	vel->y -= drag * vel->y * global_dt;
+
+	// printf("Player velocity: %f\n", hypotf(vel->x, vel->y));
+
+	cam->position.x += vel->x;
+	cam->position.y += vel->y;
+}
+
+// One tick of kart physics for a player. Used for the local player, and by
+// the server for every connected client.
+void Player_Drive(World* w, Camera* cam, vec2* vel, PlayerState* ps, uint16_t keys) {
+	Player_Move(w, cam, vel, keys);
+	ps->bump = Collision_ResolvePlayer(w, cam, vel, true);
+	Standings_Advance(w, &ps->progress, (vec2){cam->position.x, cam->position.y});
+}
+
+// The same tick on a client, which only predicts its own kart. The enemies
+// and the standings are the server's, so neither is touched, and finishing
+// is left for a snapshot to say.
+void Player_Predict(World* w, Camera* cam, vec2* vel, PlayerState* ps, uint16_t keys) {
+	Player_Move(w, cam, vel, keys);
+	ps->bump = Collision_ResolvePlayer(w, cam, vel, false);
+	RaceProgress_Update(&ps->progress, (vec2){cam->position.x, cam->position.y});
+}
+
+void UpdateFirstPersonCamera(World* w) {
+	PlayerState* ps = &w->mainPlayerState;
+
+	Player_Drive(w, &w->mainCamera, &w->velocity, ps, Input_GetKeyBits(keyboardState));
+}
+
+void UpdateCamera(World* w) {
+	switch (w->mainCamera.mode) {
+	case FreeFlyCamera:
+		UpdateFreeFlyCamera(w);
+		break;
+	case FirstPerson:
+		UpdateFirstPersonCamera(w);
+		break;
+	default:
+		fprintf(stderr, "Invalid camera mode %d\n", w->mainCamera.mode);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void updateKeyboard() {
+	int numKeys;
+	const uint8_t* kb = SDL_GetKeyboardState(&numKeys);
+
+	if (keyboardState == NULL) {
+		keyboardState = malloc(numKeys);
+		lastKeyboardState = malloc(numKeys);
+		numKeyboardKeys = numKeys;
+	}
+
+	memcpy(lastKeyboardState, keyboardState, numKeys);
+	memcpy(keyboardState, kb, numKeys);
+}
+
+// Karts move by distance along their path's spline, so a long tick can't
+// carry them past a corner. This only touches the flat arrays, so it
+// vectorizes. GCC only turns the selects into blends when comparisons can't
+// trap, and nothing here reads the FP exception flags. A tick moves a kart
+// much less than a lap, so one add or subtract wraps it the same as
+// PathSpline_Wrap.
+__attribute__((optimize("no-trapping-math")))
+void Enemies_Move(Enemies* e, float dt) {
+	float offsetReturn = fminf(ENEMY_OFFSET_RETURN * dt, 1);
+	for (int i = 0; i < e->count; i++) {
+		float speed = e->speed[i];
+		float top = e->topSpeed[i];
+		float braked = speed - ENEMY_BRAKING * dt;
+		braked = braked > top ? braked : top;
+		// Get back up to speed after being bumped
+		float accelerated = speed + (top - speed) * ENEMY_ACCELERATION * dt;
+		speed = speed > top ? braked : accelerated;
+		e->speed[i] = speed;
+
+		float length = e->pathLength[i];
+		float dist = e->dist[i] + speed * dt;
+		dist = dist >= length ? dist - length : dist;
+		dist = dist < 0 ? dist + length : dist;
+		e->dist[i] = dist < length ? dist : 0;
+
+		e->offset[i] -= e->offset[i] * offsetReturn;
+	}
+}
+
+void Enemies_Update(World* w) {
+	Enemies* e = &w->enemies;
+	int n = e->count;
+	float dt = global_dt;
+
+	// Look up each kart's top speed where it is on its path. Every kart can
+	// be on a different path, so this is the only pass that has to gather.
+	for (int i = 0; i < n; i++) {
+		const PathSpline* ps = &e->paths[e->path[i]].spline;
+		float f;
+		e->topSpeed[i] = ps->speed[PathSpline_Locate(ps, e->dist[i], &f)];
+	}
+
+	Enemies_Move(e, dt);
+
+	for (int i = 0; i < n; i++) {
+		// Steer away from the edge of the road when it gets within a kart's
+		// width, which also pulls karts in where the spline cuts a corner
+		vec2 g;
+		float edge = TrackSDF_Get(&w->track.sdf, e->posX[i], e->posY[i], &g) + ENEMY_EDGE_MARGIN;
+		if (edge > 0) {
+			float side = g.y * e->dirX[i] - g.x * e->dirY[i];
+			e->offset[i] -= side * fminf(edge, ENEMY_EDGE_STEER * dt);
+		}
+		Enemies_Place(e, i);
+	}
+
+	for (int i = 0; i < n; i++) {
+		Collision_ResolveEnemy(w, i);
+	}
+
+	for (int i = 0; i < n; i++) {
+		vec2 pos = {e->posX[i], e->posY[i]};
+		Standings_Advance(w, &e->progress[i], pos);
+		Sprite_Place(&w->sprites, e->sprite[i], pos.x, pos.y);
+	}
+}
+
+typedef enum GameState {
+	State_Menu,
+	State_Transition,
+	State_Game,
+	State_Over,
+} GameState;
+
+GameState gameState;
+
+SDL_Texture* logo;
+SDL_Texture* logo_notext;
+
+void Menu_init() {
+	gameState = State_Menu;
+
+	logo = IMG_LoadTexture(renderer, "logo.png");
+	logo_notext = IMG_LoadTexture(renderer, "brummie.png");
+}
+
+void Menu_update(World* w) {
+	if (keyboardState[SDL_SCANCODE_RETURN]) {
+		Transition_init(w);
+	}
+}
+
+void Menu_draw() {
+	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+	SDL_RenderClear(renderer);
+
+	SDL_RenderCopy(renderer, logo, NULL, NULL);
+
+	SDL_RenderPresent(renderer);
+}
+
+int transition_timer;
+bool tickStalled;
+TrackLoad* pendingTrack;
+
+const char* trackNames[] = {
+	"tracks/mario_circuit",
+	"tracks/ghost",
+	"tracks/rainbow"
+};
+
+void Transition_init(World* w) {
+	if (w->trackNumber == 3) {
+		Over_init();
+		return;
+	}
+
+	gameState = State_Transition;
+
+	// The track loads in the background while the transition screen plays
+	pendingTrack = TrackLoad_Begin(w, trackNames[w->trackNumber], numEnemies);
+	w->trackNumber++;
+
+	transition_timer = 60;
+}
+
+void Transition_update(World* w) {
+	if (transition_timer > 0) {
+		transition_timer--;
+	}
+
+	if (transition_timer == 0) {
+		if (TrackLoad_IsDone(pendingTrack)) {
+			TrackLoad_Publish(w, pendingTrack);
+			Arena_Report(w->track.arena);
+			pendingTrack = NULL;
+			Game_init(w);
+		}
+		else {
+			// How long the load takes isn't deterministic, so ticks spent
+			// waiting for it don't count as simulation ticks
+			tickStalled = true;
+		}
+	}
+}
+
+void Transition_draw() {
+	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+	SDL_RenderClear(renderer);
+	
+	SDL_RenderCopy(renderer, logo_notext, NULL, NULL);
+	
+	DrawStringInfo dsi = {
+		.font = font,
+		.colour = {0xff, 0xff, 0xff, 0xff},
+		.x = GAME_WIDTH / 2,
+		.y = GAME_HEIGHT / 2,
+		.alignX = TEXT_ALIGN_CENTRE,
+		.alignY = TEXT_ALIGN_CENTRE,
+	};
+
+	if (TrackLoad_IsDone(pendingTrack)) {
+		drawString(&dsi, pendingTrack->track.trackName);
+	}
+	else {
+		static const char* loading[] = {"Loading", "Loading.", "Loading..", "Loading..."};
+		drawString(&dsi, loading[(frame / 15) % 4]);
+	}
+
+	SDL_RenderPresent(renderer);
+}
+
+// Lines everyone up for the start of a race on the world's track
+void World_StartRace(World* w) {
+	LocalPlayers_Init(w);
+	Standings_Init(w);
+	Standings_Update(w);
+}
+
+void Game_init(World* w) {
+	gameState = State_Game;
+
+	World_StartRace(w);
+
+	// Other players only show up once a snapshot says where they are
+	if (netMode == Net_Client) {
+		w->sprites.count = w->track.firstPlayerSprite;
+	}
+}
+
+// Smoothed time spent in Enemies_Update, in milliseconds
+float enemyUpdateTime;
+
+void Game_update(World* w) {
+	Collision_InsertKarts(w);
+
+	if (netMode == Net_Client) {
+		// The server runs the race, only the local kart is simulated here
+		Net_ClientTick(w, Input_GetKeyBits(keyboardState));
+		return;
+	}
+
+	UpdateCamera(w);
+
+	for (int p = 1; p < numLocalPlayers; p++) {
+		LocalPlayer* lp = &w->localPlayers[p];
+		Player_Drive(w, lp->camera, lp->velocity, lp->state, Input_GetPlayerKeyBits(keyboardState, p));
+	}
+
+	if (numLocalPlayers > 1) {
+		int first = w->track.firstPlayerSprite;
+		for (int p = 0; p < numLocalPlayers; p++) {
+			Camera* cam = w->localPlayers[p].camera;
+			Sprite_Place(&w->sprites, first + p, cam->position.x, cam->position.y);
+			w->sprites.angle[first + p] = cam->yaw;
+		}
+	}
+
+	// In split-screen the race goes on until everyone has finished
+	if (LocalPlayers_Finished(w)) {
+		int place = w->mainPlayerState.progress.finishPlace;
+		printf("Came %d\n", place);
+		w->positions[w->trackNumber - 1] = place;
+		Transition_init(w);
+	}
+
+	Uint64 start = SDL_GetPerformanceCounter();
+	Enemies_Update(w);
+	float ms = (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+	enemyUpdateTime = lerpf(enemyUpdateTime, ms, 0.05f);
+
+	Standings_Update(w);
+}
+
+const char* OrdinalSuffix(int n) {
+	if (n % 100 >= 11 && n % 100 <= 13) {
+		return "th";
+	}
+	switch (n % 10) {
+	case 1:
+		return "st";
+	case 2:
+		return "nd";
+	case 3:
+		return "rd";
+	default:
+		return "th";
+	}
+}
+
+// Split-screen players get a half or a quarter of the screen each
+Viewport SplitScreen_Viewport(int player) {
+	if (numLocalPlayers == 1) {
+		return (Viewport){0, 0, GAME_WIDTH, GAME_HEIGHT};
+	}
+	if (numLocalPlayers == 2) {
+		return (Viewport){0, player * GAME_HEIGHT / 2, GAME_WIDTH, GAME_HEIGHT / 2};
+	}
+	return (Viewport){(player % 2) * GAME_WIDTH / 2, (player / 2) * GAME_HEIGHT / 2, GAME_WIDTH / 2, GAME_HEIGHT / 2};
+}
+
+////////////////////
+// Interlacing
+//
+// With --interlace the sky and floor only draw every other row, swapping
+// between the odd and even rows every frame. The rows that weren't drawn
+// are filled from the last frame's sky and floor, reprojected by how the
+// camera moved since then. Every row of the last frame was drawn fresh
+// if this frame's missing rows were, so those are the ones that get read.
+// Sprites go on top afterwards at the full rate.
+
+// How far the camera can jump before the last frame is no use
+#define INTERLACE_MAX_MOVE 64
+// Rows that don't hit the floor are reprojected as if they hit something
+// this far away, which only leaves the rotation
+#define INTERLACE_SKY_DISTANCE 100000
+// Pixels between reprojected points along a row. The floor would only need
+// the two ends of the row, but the sky curves when the camera turns.
+#define INTERLACE_SPAN 32
+
+bool interlace = false;
+int interlaceField;
+
+// Each frame's sky and floor, the last frame's and this one's
+uint8_t* interlaceHistory[2];
+
+// The cameras the last frame was drawn from, and the track they were on
+Camera interlaceCameras[MAX_LOCAL_PLAYERS];
+const Arena* interlaceTrack;
+
+void Interlace_Init() {
+	for (int i = 0; i < 2; i++) {
+		interlaceHistory[i] = malloc(GAME_WIDTH * GAME_HEIGHT * 3);
+	}
+}
+
+// Where the point seen through the left edge of pixel (j, i) of rv was in
+// the last frame's view, or false if it was behind the camera
+bool Interlace_Reproject(const RenderView* last, const RenderView* rv, int j, int i, vec2* out) {
+	vec3 pos = rv->cam->position;
+	vec3 dir = RenderView_Ray(rv, j, i);
+	float t = dir.z < 0 ? -pos.z / dir.z : INTERLACE_SKY_DISTANCE;
+	vec3 p = vec3_add(pos, vec3_scale(dir, fminf(t, INTERLACE_SKY_DISTANCE)));
+
+	if (vec3_dot(last->cam->forward, vec3_sub(p, last->cam->position)) <= 0) {
+		return false;
+	}
+	*out = ProjectPoint(last, p);
+	return true;
+}
+
+// Fills the rows the sky and floor skipped, then keeps the whole sky and
+// floor of the view for the next frame
+void Interlace_Fill(const RenderView* rv) {
+	Viewport vp = rv->vp;
+	uint8_t* frame = textureData;
+	uint8_t* history = interlaceHistory[interlaceField];
+
+	if (rv->lastCam != NULL) {
+		RenderView last;
+		RenderView_Init(&last, rv->world, rv->lastCam, vp);
+		const uint8_t* lastHistory = interlaceHistory[interlaceField ^ 1];
+		int parity = rv->firstRow ^ 1;
+
+		for (int i = parity; i < vp.h; i += 2) {
+			uint8_t* out = frame + (vp.y + i) * rowPitch + vp.x * 3;
+
+			// Anything that was off screen is doubled from a row drawn
+			// this frame instead
+			const uint8_t* fresh = frame + (vp.y + (i > 0 ? i - 1 : i + 1)) * rowPitch + vp.x * 3;
+
+			vec2 a;
+			bool aSeen = Interlace_Reproject(&last, rv, 0, i, &a);
+			for (int j0 = 0; j0 < vp.w; j0 += INTERLACE_SPAN) {
+				int j1 = j0 + INTERLACE_SPAN < vp.w ? j0 + INTERLACE_SPAN : vp.w;
+				vec2 b;
+				bool bSeen = Interlace_Reproject(&last, rv, j1, i, &b);
+				if (!aSeen || !bSeen) {
+					memcpy(out + j0 * 3, fresh + j0 * 3, (j1 - j0) * 3);
+					a = b;
+					aSeen = bSeen;
+					continue;
+				}
+
+				// Rounded to the nearest row with the same parity
+				float dx = (b.x - a.x) / (j1 - j0);
+				float dy = (b.y - a.y) / (j1 - j0) / 2;
+				float sx = a.x + 0.5f;
+				float sy = (a.y - parity) / 2 + 0.5f;
+				for (int j = j0; j < j1; j++, sx += dx, sy += dy) {
+					int x = floorf(sx);
+					int y = (int)floorf(sy) * 2 + parity;
+					const uint8_t* in = x >= 0 && x < vp.w && y >= 0 && y < vp.h ? lastHistory + ((vp.y + y) * GAME_WIDTH + vp.x + x) * 3 : fresh + j * 3;
+					out[j * 3 + 0] = in[0];
+					out[j * 3 + 1] = in[1];
+					out[j * 3 + 2] = in[2];
+				}
+				a = b;
+			}
+		}
+	}
+
+	for (int i = 0; i < vp.h; i++) {
+		memcpy(history + ((vp.y + i) * GAME_WIDTH + vp.x) * 3, frame + (vp.y + i) * rowPitch + vp.x * 3, vp.w * 3);
+	}
+}
+
+void DrawView(const RenderView* rv) {
+	DrawSky(&mainSkybox, rv);
+	DrawFloor(rv);
+	if (interlace) {
+		Interlace_Fill(rv);
+	}
+	DrawSprites(rv);
+}
+
+// Split-screen views after the first are drawn on their own threads. The
+// passes only read the track, sprites and skybox, and each view writes its
+// own part of the frame, so the threads share everything without locking.
+typedef struct RenderWorker {
+	SDL_Thread* thread;
+	SDL_sem* start;
+	SDL_sem* done;
+	RenderView view;
+} RenderWorker;
+
+RenderWorker renderWorkers[MAX_LOCAL_PLAYERS];
+
+int RenderWorker_Thread(void* data) {
+	RenderWorker* w = data;
+	while (true) {
+		SDL_SemWait(w->start);
+		DrawView(&w->view);
+		SDL_SemPost(w->done);
+	}
+	return 0;
+}
+
+void RenderWorkers_Init() {
+	for (int p = 1; p < numLocalPlayers; p++) {
+		RenderWorker* w = &renderWorkers[p];
+		w->start = SDL_CreateSemaphore(0);
+		w->done = SDL_CreateSemaphore(0);
+		w->thread = SDL_CreateThread(RenderWorker_Thread, "Render", w);
+		if (w->thread == NULL) {
+			fprintf(stderr, "Unable to create render thread: %s\n", SDL_GetError());
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+// Smoothed time spent drawing the views, in milliseconds
+float renderTime;
+
+////////////////////
+// Frame capture
+//
+// With --capture the finished frame is copied into a ring of buffers, and a
+// writer thread streams them to disk so the main thread never waits on it.
+// A file ending in .y4m is YUV 4:2:0 video with the frame index and time in
+// each frame header. Frames are taken as they're presented, so its frame
+// rate is measured and written into the header once the capture ends.
+// Anything else is raw RGB, a CaptureHeader and then each
+// frame's index and time followed by its pixels. When the writer falls
+// behind and the ring is full the frame is dropped, which leaves a gap in
+// the indices.
+
+#define CAPTURE_MAGIC "SBKC"
+#define CAPTURE_VERSION 1
+#define CAPTURE_RING 8
+#define CAPTURE_FRAME_BYTES (GAME_WIDTH * GAME_HEIGHT * 3)
+
+typedef struct CaptureHeader {
+	char magic[4];
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+} CaptureHeader;
+
+typedef struct CaptureFrame {
+	uint32_t index;
+	uint64_t time; // Microseconds since the capture started
+	uint8_t* pixels;
+} CaptureFrame;
+
+typedef struct Capture {
+	FILE* file;
+	bool y4m;
+	uint8_t* yuv; // Conversion buffer for the writer
+
+	// The main thread fills frames[tail] and the writer empties
+	// frames[head], the same as a SlotQueue
+	CaptureFrame frames[CAPTURE_RING];
+	SDL_atomic_t head;
+	SDL_atomic_t tail;
+	SDL_sem* wake;
+	SDL_atomic_t stop;
+	SDL_Thread* thread;
+
+	Uint64 start;
+	uint64_t firstTime; // Of the first and last frames queued, for the frame rate
+	uint64_t lastTime;
+	uint32_t numFrames;
+	uint32_t numDropped;
+	bool failed;
+} Capture;
+
+Capture capture;
+
+void Capture_Write(const void* data, size_t size) {
+	if (!capture.failed && fwrite(data, 1, size, capture.file) != size) {
+		// Keep taking frames so the race carries on, just stop writing them
+		fprintf(stderr, "Unable to write capture: %s\n", strerror(errno));
+		capture.failed = true;
+	}
+}
+
+// Full range BT.601, with each chroma sample the average of a 2x2 block
+void Capture_ToYUV(const uint8_t* rgb, uint8_t* yuv) {
+	uint8_t* yPlane = yuv;
+	uint8_t* uPlane = yPlane + GAME_WIDTH * GAME_HEIGHT;
+	uint8_t* vPlane = uPlane + GAME_WIDTH * GAME_HEIGHT / 4;
+
+	for (int i = 0; i < GAME_WIDTH * GAME_HEIGHT; i++) {
+		const uint8_t* p = rgb + i * 3;
+		yPlane[i] = (77 * p[0] + 150 * p[1] + 29 * p[2] + 128) >> 8;
+	}
+
+	for (int y = 0; y < GAME_HEIGHT; y += 2) {
+		for (int x = 0; x < GAME_WIDTH; x += 2) {
+			int r = 0;
+			int g = 0;
+			int b = 0;
+			for (int k = 0; k < 4; k++) {
+				const uint8_t* p = rgb + ((y + k / 2) * GAME_WIDTH + x + k % 2) * 3;
+				r += p[0];
+				g += p[1];
+				b += p[2];
+			}
+			int i = (y / 2) * (GAME_WIDTH / 2) + x / 2;
+			uPlane[i] = (-43 * r - 85 * g + 128 * b + (128 << 10) + 512) >> 10;
+			vPlane[i] = (128 * r - 107 * g - 21 * b + (128 << 10) + 512) >> 10;
+		}
+	}
+}
+
+int Capture_Thread(void* data) {
+	(void)data;
+	while (true) {
+		SDL_SemWait(capture.wake);
+
+		unsigned head = SDL_AtomicGet(&capture.head);
+		if (head == (unsigned)SDL_AtomicGet(&capture.tail)) {
+			// Woken with nothing to write means stop
+			if (SDL_AtomicGet(&capture.stop)) {
+				return 0;
+			}
+			continue;
+		}
+
+		const CaptureFrame* cf = &capture.frames[head % CAPTURE_RING];
+		if (capture.y4m) {
+			char header[64];
+			int len = snprintf(header, sizeof(header), "FRAME Xindex=%u Xtime=%llu\n", cf->index, (unsigned long long)cf->time);
+			Capture_Write(header, len);
+			Capture_ToYUV(cf->pixels, capture.yuv);
+			Capture_Write(capture.yuv, GAME_WIDTH * GAME_HEIGHT * 3 / 2);
+		}
+		else {
+			Capture_Write(&cf->index, sizeof(cf->index));
+			Capture_Write(&cf->time, sizeof(cf->time));
+			Capture_Write(cf->pixels, CAPTURE_FRAME_BYTES);
+		}
+		SDL_AtomicSet(&capture.head, head + 1);
+	}
+}
+
+// Fixed width, so Capture_Close can write the measured rate over the guess
+void Capture_WriteY4MHeader(uint32_t millihertz) {
+	fprintf(capture.file, "YUV4MPEG2 W%d H%d F%09u:1000 Ip A1:1 C420jpeg XCOLORRANGE=FULL\n", GAME_WIDTH, GAME_HEIGHT, millihertz);
+}
+
+void Capture_Open(const char* path) {
+	capture.file = fopen(path, "wb");
+	if (capture.file == NULL) {
+		fprintf(stderr, "Unable to open capture %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	size_t len = strlen(path);
+	capture.y4m = len >= 4 && strcmp(path + len - 4, ".y4m") == 0;
+	if (capture.y4m) {
+		Capture_WriteY4MHeader(lrintf(1000 / global_dt));
+		capture.yuv = malloc(GAME_WIDTH * GAME_HEIGHT * 3 / 2);
+	}
+	else {
+		CaptureHeader header = {
+			.version = CAPTURE_VERSION,
+			.width = GAME_WIDTH,
+			.height = GAME_HEIGHT,
+		};
+		memcpy(header.magic, CAPTURE_MAGIC, 4);
+		fwrite(&header, sizeof(header), 1, capture.file);
+	}
+
+	// Allocated up front so capturing a frame never has to
+	for (int i = 0; i < CAPTURE_RING; i++) {
+		capture.frames[i].pixels = malloc(CAPTURE_FRAME_BYTES);
+	}
+
+	capture.wake = SDL_CreateSemaphore(0);
+	capture.thread = SDL_CreateThread(Capture_Thread, "Capture", NULL);
+	if (capture.thread == NULL) {
+		fprintf(stderr, "Unable to create capture thread: %s\n", SDL_GetError());
+		exit(EXIT_FAILURE);
+	}
+	capture.start = SDL_GetPerformanceCounter();
+}
+
+// Called with the frame still locked, once it's finished
+void Capture_Frame(const void* pixels, int pitch) {
+	if (capture.file == NULL) {
+		return;
+	}
+
+	uint32_t index = capture.numFrames++;
+	unsigned tail = SDL_AtomicGet(&capture.tail);
+	if (tail - (unsigned)SDL_AtomicGet(&capture.head) == CAPTURE_RING) {
+		capture.numDropped++;
+		return;
+	}
+
+	CaptureFrame* cf = &capture.frames[tail % CAPTURE_RING];
+	cf->index = index;
+	cf->time = (SDL_GetPerformanceCounter() - capture.start) * 1000000 / SDL_GetPerformanceFrequency();
+	if (index == capture.numDropped) {
+		capture.firstTime = cf->time;
+	}
+	capture.lastTime = cf->time;
+	if (pitch == GAME_WIDTH * 3) {
+		memcpy(cf->pixels, pixels, CAPTURE_FRAME_BYTES);
+	}
+	else {
+		for (int y = 0; y < GAME_HEIGHT; y++) {
+			memcpy(cf->pixels + y * GAME_WIDTH * 3, (const uint8_t*)pixels + y * pitch, GAME_WIDTH * 3);
+		}
+	}
+	SDL_AtomicSet(&capture.tail, tail + 1);
+	SDL_SemPost(capture.wake);
+}
+
+// Waits for the writer to finish the frames it already has
+void Capture_Close() {
+	if (capture.file == NULL) {
+		return;
+	}
+
+	SDL_AtomicSet(&capture.stop, 1);
+	SDL_SemPost(capture.wake);
+	SDL_WaitThread(capture.thread, NULL);
+	SDL_DestroySemaphore(capture.wake);
+
+	// Played back at this rate the video lasts as long as the race did
+	uint32_t written = capture.numFrames - capture.numDropped;
+	if (capture.y4m && !capture.failed && written >= 2 && capture.lastTime > capture.firstTime) {
+		uint64_t millihertz = (uint64_t)(written - 1) * 1000000000 / (capture.lastTime - capture.firstTime);
+		fseek(capture.file, 0, SEEK_SET);
+		Capture_WriteY4MHeader(millihertz < 999999999 ? millihertz : 999999999);
+	}
+	fclose(capture.file);
+	capture.file = NULL;
+
+	printf("Captured %u frames, dropped %u\n", written, capture.numDropped);
+	for (int i = 0; i < CAPTURE_RING; i++) {
+		free(capture.frames[i].pixels);
+	}
+	free(capture.yuv);
+}
+
+////////////////////
+// World snapshots
+//
+// With --sim-thread the race is simulated on its own thread, and the main
+// thread only draws. After every tick the simulation copies what drawing
+// needs into a snapshot, and the snapshots go through a triple buffer, so
+// neither thread ever waits for the other: the simulation always has a
+// snapshot to write and the renderer always has the newest finished one.
+
+#define SNAPSHOT_FRESH 4 // Set in snapshotMiddle when the renderer hasn't seen it
+
+typedef struct WorldSnapshot {
+	Camera cameras[MAX_LOCAL_PLAYERS];
+	int laps[MAX_LOCAL_PLAYERS];
+	int places[MAX_LOCAL_PLAYERS];
+	int numEnemies;
+	int enemySprites[MAX_ENEMIES];
+	float enemyUpdateTime;
+	int collisionTests;
+	float tickJitter;
+	float tickJitterMax;
+	Uint64 inputTime; // When the input the tick used was read
+
+	SpritePositions sprites;
+} WorldSnapshot;
+
+WorldSnapshot snapshots[3];
+SDL_atomic_t snapshotMiddle;
+int snapshotBack; // Only used by the simulation thread
+int snapshotFront; // Only used by the main thread
+
+SDL_Thread* simThread;
+
+// Smoothed and worst time between when a tick was due and when it ran, in ms
+float simTickJitter;
+float simTickJitterMax;
+
+void WorldSnapshot_Capture(WorldSnapshot* s, const World* w, Uint64 inputTime) {
+	for (int p = 0; p < numLocalPlayers; p++) {
+		s->cameras[p] = *w->localPlayers[p].camera;
+		s->laps[p] = w->localPlayers[p].state->progress.lap;
+		s->places[p] = w->localPlayers[p].place;
+	}
+	s->numEnemies = w->enemies.count;
+	memcpy(s->enemySprites, w->enemies.sprite, w->enemies.count * sizeof(int));
+	s->enemyUpdateTime = enemyUpdateTime;
+	s->collisionTests = w->track.collision.tests;
+	s->tickJitter = simTickJitter;
+	s->tickJitterMax = simTickJitterMax;
+	s->inputTime = inputTime;
+
+	SpritePositions_Copy(&s->sprites, &w->sprites);
+}
+
+// Called by the simulation once the back snapshot is written
+void WorldSnapshot_Publish() {
+	int old = SDL_AtomicSet(&snapshotMiddle, snapshotBack | SNAPSHOT_FRESH);
+	snapshotBack = old & ~SNAPSHOT_FRESH;
+}
+
+// The newest snapshot the simulation has finished
+const WorldSnapshot* WorldSnapshot_Latest() {
+	if (SDL_AtomicGet(&snapshotMiddle) & SNAPSHOT_FRESH) {
+		snapshotFront = SDL_AtomicSet(&snapshotMiddle, snapshotFront) & ~SNAPSHOT_FRESH;
+	}
+	return &snapshots[snapshotFront];
+}
+
+////////////////////
+// Late latching
+//
+// Input is normally read at the top of the frame, and then a tick and a
+// render both run before anyone sees it. With --late-latch the frame waits
+// until it only just has time to draw before the next vsync, reads the input
+// again and turns each camera by what the next tick is going to do with it.
+// The next tick still reads the same input as it would have, so only what's
+// drawn changes.
+
+#define LATE_LATCH_MARGIN_MS 2.0f
+
+// Can be turned on with --late-latch
+bool lateLatch = false;
+
+// When the input shown in the frame being drawn was read
+Uint64 inputLatchTime;
+
+// From reading input to presenting the frame it was shown in, in ms
+float inputLatency;
+double inputLatencyTotal;
+int inputLatencyFrames;
+
+Uint64 lastPresentTime;
+float framePeriod; // ms between presents
+float latchToPresent; // ms from late latching to calling SDL_RenderPresent
+
+void LateLatch_Wait() {
+	if (lastPresentTime == 0) {
+		return;
+	}
+
+	float elapsed = (SDL_GetPerformanceCounter() - lastPresentTime) * 1000.0 / SDL_GetPerformanceFrequency();
+	float wait = framePeriod - latchToPresent - LATE_LATCH_MARGIN_MS - elapsed;
+	if (wait >= 1) {
+		SDL_Delay(wait);
+	}
+}
+
+// Turns copies of the local players' cameras by the input that has come in
+// since the tick read it
+void LateLatch_Cameras(Camera* cameras) {
+	SDL_PumpEvents();
+	const uint8_t* keys = SDL_GetKeyboardState(NULL);
+
+	// Peeking leaves the motion events queued for the next tick
+	SDL_Event events[64];
+	int numEvents = SDL_PeepEvents(events, 64, SDL_PEEKEVENT, SDL_MOUSEMOTION, SDL_MOUSEMOTION);
+	int dx = 0;
+	int dy = 0;
+	for (int i = 0; i < numEvents; i++) {
+		dx += events[i].motion.xrel;
+		dy += events[i].motion.yrel;
+	}
+
+	for (int p = 0; p < numLocalPlayers; p++) {
+		Camera* cam = &cameras[p];
+
+		if (cam->mode == FreeFlyCamera) {
+			float pitch = clampf(cam->pitch - dy * MOUSE_SENSITIVITY * global_dt, -M_PI_2, M_PI_2);
+			Camera_SetYawPitch(cam, cam->yaw + dx * MOUSE_SENSITIVITY * global_dt, pitch);
+			continue;
+		}
+
+		uint16_t bits = p == 0 ? Input_GetKeyBits(keys) : Input_GetPlayerKeyBits(keys, p);
+		float yaw = cam->yaw;
+		if (bits & INPUT_BIT(INPUT_A)) {
+			yaw -= PLAYER_TURN_SPEED * global_dt;
+		}
+		if (bits & INPUT_BIT(INPUT_D)) {
+			yaw += PLAYER_TURN_SPEED * global_dt;
+		}
+		Camera_SetYawPitch(cam, yaw, cam->pitch);
+	}
+
+	inputLatchTime = SDL_GetPerformanceCounter();
+}
+
+// Called once each frame has been presented
+void InputLatency_Update() {
+	Uint64 now = SDL_GetPerformanceCounter();
+	double freq = SDL_GetPerformanceFrequency();
+
+	if (lastPresentTime != 0) {
+		// A missed vsync only nudges the estimate. Otherwise the late latch
+		// would wait longer and miss the next one too.
+		float period = (now - lastPresentTime) * 1000.0 / freq;
+		if (framePeriod == 0) {
+			framePeriod = period;
+		}
+		framePeriod = lerpf(framePeriod, period, period < framePeriod * 1.5f ? 0.05f : 0.005f);
+	}
+	lastPresentTime = now;
+
+	if (simThread != NULL || gameState == State_Game) {
+		float ms = (now - inputLatchTime) * 1000.0 / freq;
+		inputLatency = lerpf(inputLatency, ms, 0.05f);
+		inputLatencyTotal += ms;
+		inputLatencyFrames++;
+	}
+}
+
+////////////////////
+// Minimap
+
+#define MINIMAP_MARGIN 8
+#define MINIMAP_DOT 3 // Size of a kart on the minimap, in pixels
+#define MINIMAP_ARROW 6 // Length of a player's arrow, in pixels
+
+// Textures can only be made on the main thread. Tracks are published there
+// too, but a new one can share the old one's pointers, so tracksPublished is
+// what says the texture is stale.
+SDL_Texture* minimapTexture;
+int minimapTrack;
+
+SDL_FPoint Minimap_Point(const World* w, float x, float y) {
+	float scale = (float)MINIMAP_SIZE / (1 << w->track.size_log2);
+	return (SDL_FPoint){
+		GAME_WIDTH - MINIMAP_MARGIN - MINIMAP_SIZE + x * scale,
+		MINIMAP_MARGIN + y * scale,
+	};
+}
+
+SDL_Rect Minimap_Dot(const World* w, const SpritePositions* sp, int i) {
+	SDL_FPoint p = Minimap_Point(w, sp->x[i], sp->y[i]);
+	return (SDL_Rect){(int)p.x - MINIMAP_DOT / 2, (int)p.y - MINIMAP_DOT / 2, MINIMAP_DOT, MINIMAP_DOT};
+}
+
+// The track is a texture made once, so each frame only costs a copy and a
+// few small quads for the karts
+// The karts come from the snapshot, as with --sim-thread the simulation is
+// writing the enemies while this draws
+void Minimap_Draw(const World* w, const WorldSnapshot* snap, const SpritePositions* sp, const Camera* cams) {
+	int published = SDL_AtomicGet(&tracksPublished);
+	if (minimapTrack != published) {
+		if (minimapTexture != NULL) {
+			SDL_DestroyTexture(minimapTexture);
+		}
+		minimapTexture = SDL_CreateTextureFromSurface(renderer, w->track.minimap);
+		SDL_SetTextureBlendMode(minimapTexture, SDL_BLENDMODE_BLEND);
+		minimapTrack = published;
+	}
+
+	SDL_Rect dst = {GAME_WIDTH - MINIMAP_MARGIN - MINIMAP_SIZE, MINIMAP_MARGIN, MINIMAP_SIZE, MINIMAP_SIZE};
+	SDL_RenderCopy(renderer, minimapTexture, NULL, &dst);
+
+	SDL_Rect dots[MAX_ENEMIES + MAX_CLIENTS];
+	int n = 0;
+	for (int i = 0; i < snap->numEnemies; i++) {
+		dots[n++] = Minimap_Dot(w, sp, snap->enemySprites[i]);
+	}
+	SDL_SetRenderDrawColor(renderer, 0xff, 0x40, 0x40, 0xff);
+	SDL_RenderFillRects(renderer, dots, n);
+
+	// Other players. Local ones get an arrow drawn over them below.
+	n = 0;
+	for (int i = w->track.firstPlayerSprite; i < sp->count && n < MAX_CLIENTS; i++) {
+		dots[n++] = Minimap_Dot(w, sp, i);
+	}
+	SDL_SetRenderDrawColor(renderer, 0x40, 0x80, 0xff, 0xff);
+	SDL_RenderFillRects(renderer, dots, n);
+
+	SDL_Vertex arrows[MAX_LOCAL_PLAYERS * 3];
+	for (int p = 0; p < numLocalPlayers; p++) {
+		SDL_FPoint c = Minimap_Point(w, cams[p].position.x, cams[p].position.y);
+		vec2 f = cams[p].forward_2d;
+		SDL_FPoint tip = {c.x + f.x * MINIMAP_ARROW, c.y + f.y * MINIMAP_ARROW};
+		SDL_FPoint left = {c.x - (f.x + f.y) * MINIMAP_ARROW / 2, c.y - (f.y - f.x) * MINIMAP_ARROW / 2};
+		SDL_FPoint right = {c.x - (f.x - f.y) * MINIMAP_ARROW / 2, c.y - (f.y + f.x) * MINIMAP_ARROW / 2};
+
+		SDL_Color colour = {0xff, 0xff, 0x40, 0xff};
+		arrows[p * 3 + 0] = (SDL_Vertex){tip, colour, {0, 0}};
+		arrows[p * 3 + 1] = (SDL_Vertex){left, colour, {0, 0}};
+		arrows[p * 3 + 2] = (SDL_Vertex){right, colour, {0, 0}};
+	}
+	SDL_RenderGeometry(renderer, NULL, arrows, numLocalPlayers * 3, NULL, 0);
+}
+
+void Game_draw(World* w) {
+	////////////////////
+	// Prepare draw
+
+	// Clear screen
+	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+	SDL_RenderClear(renderer);
+
+	// Get pointer to pixel data for frame
+	SDL_LockTexture(frameTexture, NULL, &textureData, &rowPitch);
+	memset(textureData, 127, rowPitch * GAME_HEIGHT);
+
+	Uint64 start = SDL_GetPerformanceCounter();
+
+	// With --sim-thread the simulation is running on its own thread, so only
+	// its latest snapshot is safe to read
+	WorldSnapshot live;
+	const WorldSnapshot* snap = &live;
+	if (simThread != NULL) {
+		snap = WorldSnapshot_Latest();
+		inputLatchTime = snap->inputTime;
+	}
+	else {
+		for (int p = 0; p < numLocalPlayers; p++) {
+			live.cameras[p] = *w->localPlayers[p].camera;
+			live.laps[p] = w->localPlayers[p].state->progress.lap;
+			live.places[p] = w->localPlayers[p].place;
+		}
+		live.numEnemies = w->enemies.count;
+		memcpy(live.enemySprites, w->enemies.sprite, w->enemies.count * sizeof(int));
+		live.enemyUpdateTime = enemyUpdateTime;
+		live.collisionTests = w->track.collision.tests;
+	}
+
+	Camera cams[MAX_LOCAL_PLAYERS];
+	memcpy(cams, snap->cameras, numLocalPlayers * sizeof(Camera));
+	if (lateLatch) {
+		LateLatch_Wait();
+		LateLatch_Cameras(cams);
+	}
+
+	// The last frame can't be reused across a new track or a jump
+	bool reuse = interlace && interlaceTrack == w->track.arena;
+	for (int p = 0; p < numLocalPlayers && reuse; p++) {
+		vec3 d = vec3_sub(cams[p].position, interlaceCameras[p].position);
+		reuse = vec3_dot(d, d) < INTERLACE_MAX_MOVE * INTERLACE_MAX_MOVE;
+	}
+	interlaceField ^= 1;
+
+	RenderView views[MAX_LOCAL_PLAYERS];
+	for (int p = 0; p < numLocalPlayers; p++) {
+		RenderView_Init(&views[p], w, &cams[p], SplitScreen_Viewport(p));
+		if (simThread != NULL) {
+			views[p].sprites = &snap->sprites;
+		}
+		if (numLocalPlayers > 1) {
+			views[p].hideSprite = w->track.firstPlayerSprite + p;
+		}
+		if (heatmapMode != Heatmap_Off) {
+			views[p].heat = &heatmap.views[p];
+		}
+		if (reuse) {
+			views[p].firstRow = interlaceField;
+			views[p].rowStep = 2;
+			views[p].lastCam = &interlaceCameras[p];
+		}
+	}
+
+	if (w->track.pages != NULL) {
+		VirtualTexture_Stream(w->track.pages, views, numLocalPlayers);
+	}
+
+	for (int p = 1; p < numLocalPlayers; p++) {
+		renderWorkers[p].view = views[p];
+		SDL_SemPost(renderWorkers[p].start);
+	}
+	DrawView(&views[0]);
+	for (int p = 1; p < numLocalPlayers; p++) {
+		SDL_SemWait(renderWorkers[p].done);
+	}
+
+	if (interlace) {
+		memcpy(interlaceCameras, cams, numLocalPlayers * sizeof(Camera));
+		interlaceTrack = w->track.arena;
+	}
+
+	float ms = (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+	renderTime = lerpf(renderTime, ms, 0.05f);
+
+	if (heatmapMode != Heatmap_Off) {
+		Heatmap_Draw();
+	}
+	Capture_Frame(textureData, rowPitch);
+
+	// Present frame
+	SDL_UnlockTexture(frameTexture);
+	SDL_RenderCopy(renderer, frameTexture, NULL, NULL);
+
+	for (int p = 0; p < numLocalPlayers; p++) {
+		Viewport vp = views[p].vp;
+		int place = snap->places[p];
+
+		DrawStringInfo dsi = {
+			.font = numLocalPlayers == 1 ? font : font_small,
+			.colour = {0xff, 0xff, 0xff, 0xff},
+			.x = vp.x,
+			.y = vp.y + vp.h,
+			.alignX = TEXT_ALIGN_LEFT,
+			.alignY = TEXT_ALIGN_ABOVE,
+		};
+		drawStringf(&dsi, "Lap %d", snap->laps[p]);
+
+		dsi.x = vp.x + vp.w;
+		dsi.alignX = TEXT_ALIGN_RIGHT;
+		drawStringf(&dsi, "%d%s", place, OrdinalSuffix(place));
+	}
+
+	DrawStringInfo dsi = {
+		.font = font_small,
+		.colour = {0xff, 0xff, 0xff, 0xff},
+		.x = 0,
+		.y = 0,
+		.alignX = TEXT_ALIGN_LEFT,
+		.alignY = TEXT_ALIGN_BELOW,
+	};
+	if (showStats) {
+		drawStringf(&dsi, "AI: %d karts, %.3f ms, %d collision tests. Render: %d views, %s floor%s, %.3f ms", snap->numEnemies, snap->enemyUpdateTime, snap->collisionTests, numLocalPlayers, floorModeNames[floorMode], interlace ? ", interlaced" : "", renderTime);
+
+		dsi.y += 20;
+		drawStringf(&dsi, "Input to present: %.1f ms%s", inputLatency, lateLatch ? ", late latched" : "");
+		if (simThread != NULL) {
+			dsi.y += 20;
+			drawStringf(&dsi, "Sim thread: %.2f ms tick jitter, %.2f ms worst", snap->tickJitter, snap->tickJitterMax);
+		}
+
+		if (w->track.pages != NULL) {
+			VirtualTexture* vt = w->track.pages;
+			dsi.y += 20;
+			drawStringf(&dsi, "Tiles: %d cache slots, %d loading, %d streamed, %d evicted", vt->numSlots, vt->inFlight, vt->numLoads, vt->numEvictions);
+		}
+		if (capture.file != NULL) {
+			dsi.y += 20;
+			drawStringf(&dsi, "Capture: %u frames, %u dropped", capture.numFrames, capture.numDropped);
+		}
+		dsi.y += 20;
+	}
+
+	if (heatmapMode != Heatmap_Off) {
+		Heatmap_DrawTotals(&dsi);
+	}
+
+	Minimap_Draw(w, snap, simThread != NULL ? &snap->sprites : &w->sprites, cams);
+
+	if (lateLatch) {
+		// Jumps straight up to a slow frame but only drifts back down, so one
+		// fast frame doesn't make the next wait too long
+		float ms = (SDL_GetPerformanceCounter() - inputLatchTime) * 1000.0 / SDL_GetPerformanceFrequency();
+		latchToPresent = fmaxf(ms, lerpf(latchToPresent, ms, 0.05f));
+	}
+
+	SDL_RenderPresent(renderer);
+}
+
+void Over_init() {
+	gameState = State_Over;
+}
+
+void Over_update() {
+
+}
+
+void Over_draw(const World* w) {
+	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+	SDL_RenderClear(renderer);
+	
+	SDL_RenderCopy(renderer, logo_notext, NULL, NULL);
+	
+	DrawStringInfo dsi = {
+		.font = font_small,
+		.colour = {0xff, 0xff, 0xff, 0xff},
+		.x = 0,
+		.y = 0,
+		.alignX = TEXT_ALIGN_LEFT,
+		.alignY = TEXT_ALIGN_BELOW,
+	};
+	if (netMode == Net_Client) {
+		int place = w->positions[w->trackNumber - 1];
+		drawStringf(&dsi, "Thankyou for playing Super Brummie Kart. You came %d%s.", place, OrdinalSuffix(place));
+	}
+	else {
+		drawStringf(&dsi, "Thankyou for playing Super Brummie Kart. You came in places %d, %d, %d.", w->positions[0], w->positions[1], w->positions[2]);
+	}
+
+	SDL_RenderPresent(renderer);
+}
+
+////////////////////
+// Audio
+//
+// A software mixer runs in SDL's audio callback. The game only talks to it
+// through a ring of play, set and stop commands with one thread pushing and
+// the callback popping, the same as a SlotQueue. The sounds are made once
+// when audio is opened and the voices are a fixed array, so the callback
+// never allocates, locks or waits. Without sound hardware, run with
+// SDL_AUDIODRIVER=dummy, or =disk to have SDL write the mix to the file in
+// SDL_DISKAUDIOFILE.
+
+#define AUDIO_RATE 44100
+#define AUDIO_BUFFER 1024 // Samples per callback, about 23 ms
+#define AUDIO_VOICES 32
+#define AUDIO_ENGINES 8 // The first voices are the engines of the nearest karts
+#define AUDIO_QUEUE_SIZE 256 // Must be a power of 2
+#define AUDIO_MASTER 0.4f
+#define AUDIO_HEAR_DISTANCE 400 // Engines further away than this are silent
+#define AUDIO_ENGINE_HZ 40 // Engine note at a standstill
+#define AUDIO_ENGINE_RANGE 2 // Extra pitch at ENEMY_TOP_SPEED
+#define AUDIO_BUMP_MIN 0.5f // Slower hits than this, per tick, are silent
+
+typedef enum SoundId {
+	Sound_Engine,
+	Sound_Bump,
+	Sound_Lap,
+	Sound_Finish,
+	NUM_SOUNDS
+} SoundId;
+
+// Mono at AUDIO_RATE, with one more sample on the end so that interpolating
+// the last one never reads past it. That's the first sample again for a loop
+// and silence for anything else.
+typedef struct Sound {
+	float* samples;
+	int length;
+	bool loop;
+} Sound;
+
+typedef struct Voice {
+	const Sound* sound; // NULL when the voice is free
+	uint64_t pos; // 32.32 fixed point, in samples
+	uint64_t step;
+	float gainL;
+	float gainR;
+	float targetL; // Gains are ramped to these over a buffer, so they never click
+	float targetR;
+	bool stopping; // Free the voice once its gain is ramped down to 0
+} Voice;
+
+typedef enum AudioCommandType {
+	AudioCommand_Play,
+	AudioCommand_Set,
+	AudioCommand_Stop,
+} AudioCommandType;
+
+typedef struct AudioCommand {
+	AudioCommandType type;
+	int voice;
+	SoundId sound;
+	float pitch;
+	float gainL;
+	float gainR;
+} AudioCommand;
+
+typedef struct Audio {
+	SDL_AudioDeviceID device;
+	Sound sounds[NUM_SOUNDS];
+
+	AudioCommand commands[AUDIO_QUEUE_SIZE];
+	SDL_atomic_t head;
+	SDL_atomic_t tail;
+
+	// Only the callback touches these
+	Voice voices[AUDIO_VOICES];
+	float mixL[AUDIO_BUFFER];
+	float mixR[AUDIO_BUFFER];
+
+	// Written by the callback, read for --stats
+	SDL_atomic_t callbacks;
+	SDL_atomic_t mixMicroseconds;
+	SDL_atomic_t maxVoices;
+
+	// Only the thread running the simulation touches these
+	int engineSource[AUDIO_ENGINES]; // What each engine voice is playing, or -1
+	int nextEffect;
+	int lastLap;
+	int lastFinishPlace;
+	bool racing;
+	int numDropped;
+} Audio;
+
+Audio audio;
+
+////////////////////
+// Sounds
+
+Sound Sound_Create(float seconds, bool loop) {
+	Sound s = {.length = (int)(seconds * AUDIO_RATE), .loop = loop};
+	s.samples = calloc(s.length + 1, sizeof(float));
+	return s;
+}
+
+void Sound_Pad(Sound* s) {
+	s->samples[s->length] = s->loop ? s->samples[0] : 0;
+}
+
+// A few whole periods of a buzzy note, with every fourth one louder like a
+// cylinder firing. The voice's pitch takes it up from AUDIO_ENGINE_HZ.
+void Sound_MakeEngine(Sound* s) {
+	const int periods = 4;
+	*s = Sound_Create((float)periods / AUDIO_ENGINE_HZ, true);
+	for (int i = 0; i < s->length; i++) {
+		float phase = (float)i * periods / s->length;
+		float x = 0;
+		for (int h = 1; h <= 6; h++) {
+			x += sinf(2 * M_PI * h * phase) / h;
+		}
+		float firing = 0.75f + 0.25f * cosf(2 * M_PI * phase / periods);
+		s->samples[i] = 0.3f * x * firing;
+	}
+	Sound_Pad(s);
+}
+
+// Filtered noise that dies away quickly
+void Sound_MakeBump(Sound* s) {
+	*s = Sound_Create(0.15f, false);
+	uint32_t noise = 12345;
+	float y = 0;
+	for (int i = 0; i < s->length; i++) {
+		noise = noise * 1664525 + 1013904223;
+		float x = (float)(noise >> 8) / (1 << 24) * 2 - 1;
+		y += (x - y) * 0.2f;
+		s->samples[i] = 2 * y * expf(-30.0f * i / AUDIO_RATE);
+	}
+	Sound_Pad(s);
+}
+
+// Notes one after the other, each dying away
+void Sound_MakeChime(Sound* s, const float* notes, int numNotes, float noteSeconds) {
+	*s = Sound_Create(noteSeconds * (numNotes + 1), false);
+	int noteLength = noteSeconds * AUDIO_RATE;
+	for (int n = 0; n < numNotes; n++) {
+		for (int i = 0; i < s->length - n * noteLength; i++) {
+			float t = (float)i / AUDIO_RATE;
+			s->samples[n * noteLength + i] += 0.3f * sinf(2 * M_PI * notes[n] * t) * expf(-6 * t);
+		}
+	}
+	Sound_Pad(s);
+}
+
+void Audio_MakeSounds() {
+	const float lap[] = {880, 1320};
+	const float finish[] = {523, 659, 784, 1047};
+
+	Sound_MakeEngine(&audio.sounds[Sound_Engine]);
+	Sound_MakeBump(&audio.sounds[Sound_Bump]);
+	Sound_MakeChime(&audio.sounds[Sound_Lap], lap, 2, 0.12f);
+	Sound_MakeChime(&audio.sounds[Sound_Finish], finish, 4, 0.15f);
+}
+
+////////////////////
+// Mixer
+//
+// Everything here runs in the audio callback, on SDL's audio thread.
+
+// Resamples count samples of the voice's sound and adds them to the mix,
+// with the gain stepping by dl and dr every sample. The sound doesn't end or
+// loop within them.
+void Audio_MixSpan(Voice* v, float* left, float* right, int count, float dl, float dr) {
+	const float* samples = v->sound->samples;
+	const float fracScale = 1.0f / 4294967296.0f;
+	uint64_t pos = v->pos;
+	uint64_t step = v->step;
+	float gl = v->gainL;
+	float gr = v->gainR;
+	int i = 0;
+
+#ifdef __SSE2__
+	// The samples are fetched one at a time, and the interpolating, ramping
+	// and mixing done four at a time
+	const __m128 ramp = _mm_set_ps(4, 3, 2, 1);
+	for (; i + 4 <= count; i += 4) {
+		float a[4];
+		float b[4];
+		float f[4];
+		for (int k = 0; k < 4; k++) {
+			uint64_t p = pos + k * step;
+			uint32_t index = p >> 32;
+			a[k] = samples[index];
+			b[k] = samples[index + 1];
+			f[k] = (uint32_t)p * fracScale;
+		}
+		__m128 va = _mm_loadu_ps(a);
+		__m128 x = _mm_add_ps(va, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(b), va), _mm_loadu_ps(f)));
+
+		__m128 vl = _mm_add_ps(_mm_set1_ps(gl), _mm_mul_ps(_mm_set1_ps(dl), ramp));
+		__m128 vr = _mm_add_ps(_mm_set1_ps(gr), _mm_mul_ps(_mm_set1_ps(dr), ramp));
+		_mm_storeu_ps(left + i, _mm_add_ps(_mm_loadu_ps(left + i), _mm_mul_ps(x, vl)));
+		_mm_storeu_ps(right + i, _mm_add_ps(_mm_loadu_ps(right + i), _mm_mul_ps(x, vr)));
+
+		pos += 4 * step;
+		gl += 4 * dl;
+		gr += 4 * dr;
+	}
+#endif
+
+	for (; i < count; i++) {
+		uint32_t index = pos >> 32;
+		float a = samples[index];
+		float x = a + (samples[index + 1] - a) * ((uint32_t)pos * fracScale);
+		gl += dl;
+		gr += dr;
+		left[i] += x * gl;
+		right[i] += x * gr;
+		pos += step;
+	}
+
+	v->pos = pos;
+	v->gainL = gl;
+	v->gainR = gr;
+}
+
+void Audio_MixVoice(Voice* v, float* left, float* right, int n) {
+	float dl = (v->targetL - v->gainL) / n;
+	float dr = (v->targetR - v->gainR) / n;
+
+	int i = 0;
+	while (i < n) {
+		const Sound* s = v->sound;
+		uint64_t end = (uint64_t)s->length << 32;
+		if (v->pos >= end) {
+			if (!s->loop) {
+				v->sound = NULL;
+				return;
+			}
+			v->pos %= end;
+		}
+
+		// Up to where the sound ends or loops
+		uint64_t remaining = (end - v->pos + v->step - 1) / v->step;
+		int count = remaining < (uint64_t)(n - i) ? (int)remaining : n - i;
+		Audio_MixSpan(v, left + i, right + i, count, dl, dr);
+		i += count;
+	}
+
+	v->gainL = v->targetL;
+	v->gainR = v->targetR;
+	if (v->stopping) {
+		v->sound = NULL;
+	}
+}
+
+void Voice_Set(Voice* v, const AudioCommand* c) {
+	v->step = (uint64_t)(c->pitch * 4294967296.0);
+	v->targetL = c->gainL;
+	v->targetR = c->gainR;
+}
+
+void Audio_RunCommand(const AudioCommand* c) {
+	Voice* v = &audio.voices[c->voice];
+	switch (c->type) {
+	case AudioCommand_Play:
+		// A loop fades in from silence. A one shot starts with its own
+		// silence, so it can start at full volume.
+		*v = (Voice){.sound = &audio.sounds[c->sound]};
+		Voice_Set(v, c);
+		if (!v->sound->loop) {
+			v->gainL = c->gainL;
+			v->gainR = c->gainR;
+		}
+		break;
+	case AudioCommand_Set:
+		Voice_Set(v, c);
+		break;
+	case AudioCommand_Stop:
+		v->targetL = 0;
+		v->targetR = 0;
+		v->stopping = true;
+		break;
+	}
+}
+
+// Each side is added up as floats, then scaled, clamped and packed into the
+// interleaved 16 bit samples SDL wants
+void Audio_Output(int16_t* out, int n) {
+	int i = 0;
+#ifdef __SSE2__
+	const __m128 scale = _mm_set1_ps(AUDIO_MASTER * 32767);
+	const __m128 hi = _mm_set1_ps(32767);
+	const __m128 lo = _mm_set1_ps(-32768);
+	for (; i + 4 <= n; i += 4) {
+		__m128 l = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(audio.mixL + i), scale), lo), hi);
+		__m128 r = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(audio.mixR + i), scale), lo), hi);
+		__m128i l16 = _mm_packs_epi32(_mm_cvtps_epi32(l), _mm_setzero_si128());
+		__m128i r16 = _mm_packs_epi32(_mm_cvtps_epi32(r), _mm_setzero_si128());
+		_mm_storeu_si128((__m128i*)(out + i * 2), _mm_unpacklo_epi16(l16, r16));
+	}
+#endif
+	for (; i < n; i++) {
+		out[i * 2] = lrintf(clampf(audio.mixL[i] * AUDIO_MASTER * 32767, -32768, 32767));
+		out[i * 2 + 1] = lrintf(clampf(audio.mixR[i] * AUDIO_MASTER * 32767, -32768, 32767));
+	}
+}
+
+void Audio_Callback(void* data, Uint8* stream, int len) {
+	(void)data;
+	Uint64 start = SDL_GetPerformanceCounter();
+
+	unsigned head = SDL_AtomicGet(&audio.head);
+	unsigned tail = SDL_AtomicGet(&audio.tail);
+	for (; head != tail; head++) {
+		Audio_RunCommand(&audio.commands[head % AUDIO_QUEUE_SIZE]);
+	}
+	SDL_AtomicSet(&audio.head, head);
+
+	int16_t* out = (int16_t*)stream;
+	int n = len / (2 * sizeof(int16_t));
+	int numVoices = 0;
+	while (n > 0) {
+		int chunk = n < AUDIO_BUFFER ? n : AUDIO_BUFFER;
+		memset(audio.mixL, 0, chunk * sizeof(float));
+		memset(audio.mixR, 0, chunk * sizeof(float));
+
+		numVoices = 0;
+		for (int i = 0; i < AUDIO_VOICES; i++) {
+			if (audio.voices[i].sound != NULL) {
+				Audio_MixVoice(&audio.voices[i], audio.mixL, audio.mixR, chunk);
+				numVoices++;
+			}
+		}
+
+		Audio_Output(out, chunk);
+		out += chunk * 2;
+		n -= chunk;
+	}
+
+	SDL_AtomicAdd(&audio.callbacks, 1);
+	SDL_AtomicAdd(&audio.mixMicroseconds, (SDL_GetPerformanceCounter() - start) * 1000000 / SDL_GetPerformanceFrequency());
+	if (numVoices > SDL_AtomicGet(&audio.maxVoices)) {
+		SDL_AtomicSet(&audio.maxVoices, numVoices);
+	}
+}
+
+////////////////////
+// Engines and effects
+
+// Called on the one thread running the simulation. The engines only send
+// their latest pitch and volume, and a later tick will do that again, so
+// they're left out while the callback has plenty still to get through.
+// Returns false if the command was dropped, so callers only record a voice
+// change the mixer will actually see
+bool Audio_Push(AudioCommand c) {
+	unsigned tail = SDL_AtomicGet(&audio.tail);
+	unsigned used = tail - (unsigned)SDL_AtomicGet(&audio.head);
+	if (used == AUDIO_QUEUE_SIZE || (c.type == AudioCommand_Set && used >= AUDIO_QUEUE_SIZE / 2)) {
+		audio.numDropped++;
+		return false;
+	}
+	audio.commands[tail % AUDIO_QUEUE_SIZE] = c;
+	SDL_AtomicSet(&audio.tail, tail + 1);
+	return true;
+}
+
+void Audio_PlayEffect(SoundId sound, float gain) {
+	int voice = AUDIO_ENGINES + audio.nextEffect;
+	audio.nextEffect = (audio.nextEffect + 1) % (AUDIO_VOICES - AUDIO_ENGINES);
+	Audio_Push((AudioCommand){AudioCommand_Play, voice, sound, 1, gain, gain});
+}
+
+// Engine sources are local players, then enemy i as MAX_LOCAL_PLAYERS + i
+void Audio_SourceKart(const World* w, int source, vec2* pos, float* speed) {
+	if (source < MAX_LOCAL_PLAYERS) {
+		const LocalPlayer* lp = &w->localPlayers[source];
+		*pos = (vec2){lp->camera->position.x, lp->camera->position.y};
+		*speed = sqrtf(vec2_dot(*lp->velocity, *lp->velocity)) / global_dt;
+	}
+	else {
+		int i = source - MAX_LOCAL_PLAYERS;
+		*pos = (vec2){w->enemies.posX[i], w->enemies.posY[i]};
+		*speed = w->enemies.speed[i];
+	}
+}
+
+// Quieter further from player 1, and panned by which side of them it's on
+AudioCommand Audio_EngineCommand(const World* w, int voice, int source) {
+	vec2 pos;
+	float speed;
+	Audio_SourceKart(w, source, &pos, &speed);
+
+	const Camera* cam = &w->mainCamera;
+	vec2 d = vec2_sub(pos, (vec2){cam->position.x, cam->position.y});
+	float dist = sqrtf(vec2_dot(d, d));
+	float fade = clampf(1 - dist / AUDIO_HEAR_DISTANCE, 0, 1);
+	float gain = 0.6f * fade * fade;
+	float pan = dist > 1 ? (d.x * cam->right.x + d.y * cam->right.y) / dist : 0;
+
+	return (AudioCommand){
+		.type = AudioCommand_Set,
+		.voice = voice,
+		.sound = Sound_Engine,
+		.pitch = 1 + AUDIO_ENGINE_RANGE * clampf(speed / ENEMY_TOP_SPEED, 0, 1.5f),
+		.gainL = gain * sqrtf((1 - pan) / 2),
+		.gainR = gain * sqrtf((1 + pan) / 2),
+	};
+}
+
+// Player 1's engine always has the first voice, and the nearest other karts
+// the rest. A kart that stays among the nearest keeps its voice, so its
+// engine doesn't restart.
+void Audio_UpdateEngines(const World* w) {
+	const Camera* cam = &w->mainCamera;
+	int nearest[AUDIO_ENGINES] = {0};
+	float nearestDist[AUDIO_ENGINES] = {0};
+	int numNearest = 1;
+
+	int numSources = MAX_LOCAL_PLAYERS + w->enemies.count;
+	for (int source = 1; source < numSources; source++) {
+		if (source >= numLocalPlayers && source < MAX_LOCAL_PLAYERS) {
+			continue;
+		}
+		vec2 pos;
+		float speed;
+		Audio_SourceKart(w, source, &pos, &speed);
+		vec2 d = vec2_sub(pos, (vec2){cam->position.x, cam->position.y});
+		float dist = vec2_dot(d, d);
+		if (dist > AUDIO_HEAR_DISTANCE * AUDIO_HEAR_DISTANCE) {
+			continue;
+		}
+
+		// Insertion sort into the few nearest
+		if (numNearest == AUDIO_ENGINES && dist >= nearestDist[AUDIO_ENGINES - 1]) {
+			continue;
+		}
+		int j = numNearest < AUDIO_ENGINES ? numNearest++ : AUDIO_ENGINES - 1;
+		while (j > 1 && nearestDist[j - 1] > dist) {
+			nearest[j] = nearest[j - 1];
+			nearestDist[j] = nearestDist[j - 1];
+			j--;
+		}
+		nearest[j] = source;
+		nearestDist[j] = dist;
+	}
+
+	// Karts that dropped out of the nearest give up their voices
+	bool kept[AUDIO_ENGINES] = {false};
+	for (int v = 0; v < AUDIO_ENGINES; v++) {
+		int source = audio.engineSource[v];
+		if (source < 0) {
+			continue;
+		}
+		int k = 0;
+		while (k < numNearest && nearest[k] != source) {
+			k++;
+		}
+		if (k < numNearest) {
+			kept[k] = true;
+			Audio_Push(Audio_EngineCommand(w, v, source));
+		}
+		else if (Audio_Push((AudioCommand){.type = AudioCommand_Stop, .voice = v})) {
+			audio.engineSource[v] = -1;
+		}
+	}
+
+	// A voice whose Stop was dropped stays taken until a later tick gets it
+	// through, so there may be fewer free voices than new karts
+	int v = 0;
+	for (int k = 0; k < numNearest; k++) {
+		if (kept[k]) {
+			continue;
+		}
+		while (v < AUDIO_ENGINES && audio.engineSource[v] >= 0) {
+			v++;
+		}
+		if (v == AUDIO_ENGINES) {
+			break;
+		}
+		AudioCommand c = Audio_EngineCommand(w, v, nearest[k]);
+		c.type = AudioCommand_Play;
+		if (Audio_Push(c)) {
+			audio.engineSource[v] = nearest[k];
+		}
+	}
+}
+
+// After every tick, on whichever thread ran it
+void Audio_Update(const World* w) {
+	if (audio.device == 0) {
+		return;
+	}
+
+	if (gameState != State_Game) {
+		// A Stop that was dropped is retried on the next tick
+		for (int v = 0; v < AUDIO_ENGINES; v++) {
+			if (audio.engineSource[v] >= 0 && Audio_Push((AudioCommand){.type = AudioCommand_Stop, .voice = v})) {
+				audio.engineSource[v] = -1;
+			}
+		}
+		audio.racing = false;
+		return;
+	}
+
+	const RaceProgress* rp = &w->mainPlayerState.progress;
+	if (!audio.racing) {
+		audio.racing = true;
+		audio.lastLap = rp->lap;
+		audio.lastFinishPlace = rp->finishPlace;
+	}
+
+	Audio_UpdateEngines(w);
+
+	if (w->mainPlayerState.bump > AUDIO_BUMP_MIN) {
+		Audio_PlayEffect(Sound_Bump, clampf(w->mainPlayerState.bump / (4 * AUDIO_BUMP_MIN), 0.25f, 1));
+	}
+	if (rp->finishPlace != audio.lastFinishPlace) {
+		Audio_PlayEffect(Sound_Finish, 1);
+	}
+	else if (rp->lap > audio.lastLap && rp->lap > 1) {
+		Audio_PlayEffect(Sound_Lap, 1);
+	}
+	audio.lastLap = rp->lap;
+	audio.lastFinishPlace = rp->finishPlace;
+}
+
+// No sound hardware isn't an error, the game just runs silent
+void Audio_Open() {
+	for (int v = 0; v < AUDIO_ENGINES; v++) {
+		audio.engineSource[v] = -1;
+	}
+	Audio_MakeSounds();
+
+	SDL_AudioSpec want = {
+		.freq = AUDIO_RATE,
+		.format = AUDIO_S16SYS,
+		.channels = 2,
+		.samples = AUDIO_BUFFER,
+		.callback = Audio_Callback,
+	};
+	SDL_AudioSpec have;
+	// With no changes allowed SDL converts to whatever the device wants
+	audio.device = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
+	if (audio.device == 0) {
+		fprintf(stderr, "Playing without sound: %s\n", SDL_GetError());
+		return;
+	}
+	printf("Audio: %s driver, %d Hz, %d samples per buffer\n", SDL_GetCurrentAudioDriver(), have.freq, have.samples);
+	SDL_PauseAudioDevice(audio.device, 0);
+}
+
+void Audio_Close() {
+	if (audio.device != 0) {
+		SDL_CloseAudioDevice(audio.device);
+		audio.device = 0;
+
+		int callbacks = SDL_AtomicGet(&audio.callbacks);
+		if (showStats && callbacks > 0) {
+			printf("Audio: %d buffers, %.3f ms average mix, %d voices at most, %d commands dropped\n",
+				callbacks, SDL_AtomicGet(&audio.mixMicroseconds) / 1000.0 / callbacks, SDL_AtomicGet(&audio.maxVoices), audio.numDropped);
+		}
+	}
+	for (int i = 0; i < NUM_SOUNDS; i++) {
+		free(audio.sounds[i].samples);
+	}
+}
+
+////////////////////
+// Input recording and replay (--record and --replay)
+//
+// A recording is a header, the track sequence, then one entry per simulation
+// tick holding the keys and mouse motion the simulation read, plus a hash of
+// the simulation state after the tick so that a replay can check it stays in
+// lockstep.
+
+#define REPLAY_MAGIC "SBKR"
+#define REPLAY_VERSION 1
+
+typedef enum InputMode {
+	Input_Live,
+	Input_Record,
+	Input_Replay,
+} InputMode;
+
+typedef struct ReplayHeader {
+	char magic[4];
+	uint32_t version;
+	uint32_t numEnemies;
+	float dt;
+	uint32_t numTracks;
+} ReplayHeader;
+
+typedef struct ReplayTick {
+	uint32_t stateHash;
+	uint16_t keys; // INPUT_BIT flags
+	int16_t mousex;
+	int16_t mousey;
+} ReplayTick;
+
+InputMode inputMode = Input_Live;
+FILE* replayFile;
+int replayTick;
+bool replayDiverged;
+
+// Draw timings over a replay, for comparing builds on the same race
+double replayDrawTotal;
+float replayDrawMax;
+int replayDrawMaxTick;
+int replayFrames;
+
+void Replay_WriteTick(FILE* f, const ReplayTick* rt) {
+	fwrite(&rt->stateHash, sizeof(rt->stateHash), 1, f);
+	fwrite(&rt->keys, sizeof(rt->keys), 1, f);
+	fwrite(&rt->mousex, sizeof(rt->mousex), 1, f);
+	fwrite(&rt->mousey, sizeof(rt->mousey), 1, f);
+}
+
+bool Replay_ReadTick(FILE* f, ReplayTick* rt) {
+	return
+		fread(&rt->stateHash, sizeof(rt->stateHash), 1, f) == 1 &&
+		fread(&rt->keys, sizeof(rt->keys), 1, f) == 1 &&
+		fread(&rt->mousex, sizeof(rt->mousex), 1, f) == 1 &&
+		fread(&rt->mousey, sizeof(rt->mousey), 1, f) == 1;
+}
+
+// Called once every option is parsed, so the header records the settings
+// the race actually uses
+void Replay_Open(const char* path, InputMode mode) {
+	replayFile = fopen(path, mode == Input_Record ? "wb" : "rb");
+	if (replayFile == NULL) {
+		fprintf(stderr, "Unable to open replay %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	int numTracks = sizeof(trackNames) / sizeof(trackNames[0]);
+
+	if (mode == Input_Record) {
+		ReplayHeader header = {
+			.version = REPLAY_VERSION,
+			.numEnemies = numEnemies,
+			.dt = global_dt,
+			.numTracks = numTracks,
+		};
+		memcpy(header.magic, REPLAY_MAGIC, 4);
+		fwrite(&header, sizeof(header), 1, replayFile);
+
+		for (int i = 0; i < numTracks; i++) {
+			uint32_t len = strlen(trackNames[i]);
+			fwrite(&len, sizeof(len), 1, replayFile);
+			fwrite(trackNames[i], 1, len, replayFile);
+		}
+		return;
+	}
+
+	ReplayHeader header;
+	if (fread(&header, sizeof(header), 1, replayFile) != 1 || memcmp(header.magic, REPLAY_MAGIC, 4) != 0 || header.version != REPLAY_VERSION) {
+		fprintf(stderr, "%s is not a replay\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	if (header.numEnemies > MAX_ENEMIES) {
+		fprintf(stderr, "Replay %s has %u karts, at most %d are allowed\n", path, header.numEnemies, MAX_ENEMIES);
+		exit(EXIT_FAILURE);
+	}
+	if (header.numTracks != (uint32_t)numTracks || header.dt != global_dt) {
+		fprintf(stderr, "Replay %s was recorded with different game settings\n", path);
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < numTracks; i++) {
+		char name[1024];
+		uint32_t len;
+		if (fread(&len, sizeof(len), 1, replayFile) != 1 || len >= sizeof(name) || fread(name, 1, len, replayFile) != len) {
+			fprintf(stderr, "Replay %s is truncated\n", path);
+			exit(EXIT_FAILURE);
+		}
+		name[len] = 0;
+		if (strcmp(name, trackNames[i]) != 0) {
+			fprintf(stderr, "Replay %s was recorded with track %s, expected %s\n", path, name, trackNames[i]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// The replay decides the start state
+	numEnemies = header.numEnemies;
+}
+
+// FNV-1a over the parts of the simulation state that input affects
+uint32_t Hash_Bytes(uint32_t h, const void* data, size_t size) {
+	const uint8_t* p = data;
+	for (size_t i = 0; i < size; i++) {
+		h ^= p[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+// Carries h on over where every kart in the race is
+uint32_t World_HashRace(const World* w, uint32_t h) {
+	const Camera* cam = &w->mainCamera;
+	const Enemies* e = &w->enemies;
+	h = Hash_Bytes(h, &cam->position, sizeof(cam->position));
+	h = Hash_Bytes(h, &cam->yaw, sizeof(cam->yaw));
+	h = Hash_Bytes(h, &cam->pitch, sizeof(cam->pitch));
+	h = Hash_Bytes(h, &w->velocity, sizeof(w->velocity));
+	h = Hash_Bytes(h, e->posX, e->count * sizeof(float));
+	h = Hash_Bytes(h, e->posY, e->count * sizeof(float));
+	h = Hash_Bytes(h, e->speed, e->count * sizeof(float));
+	return h;
+}
+
+uint32_t Sim_Hash(const World* w) {
+	uint32_t h = 2166136261u;
+	h = Hash_Bytes(h, &gameState, sizeof(gameState));
+	h = Hash_Bytes(h, &w->trackNumber, sizeof(w->trackNumber));
+	if (gameState == State_Game) {
+		h = World_HashRace(w, h);
+	}
+	return h;
+}
+
+ReplayTick currentTick;
+bool currentTickUsed = true;
+
+// Called before the simulation runs a tick. In replay mode this replaces the
+// live input with the recorded input.
+void Replay_BeginTick() {
+	tickStalled = false;
+
+	if (inputMode != Input_Replay) {
+		return;
+	}
+
+	// A stalled tick leaves its input to be used by the next one
+	if (currentTickUsed && !Replay_ReadTick(replayFile, &currentTick)) {
+		printf("Replay finished after %d ticks%s\n", replayTick, replayDiverged ? ", but the simulation diverged" : ", simulation matched");
+		if (replayFrames > 0) {
+			printf("Draw: %.3f ms average, %.3f ms worst (tick %d)\n", replayDrawTotal / replayFrames, replayDrawMax, replayDrawMaxTick);
+		}
+		SDL_AtomicSet(&gameRunning, 0);
+		memset(&currentTick, 0, sizeof(currentTick));
+	}
+	currentTickUsed = false;
+
+	memset(keyboardState, 0, numKeyboardKeys);
+	Input_SetKeyBits(keyboardState, currentTick.keys);
+	mousexrel = currentTick.mousex;
+	mouseyrel = currentTick.mousey;
+}
+
+// Called after the simulation ran a tick
+void Replay_EndTick(const World* w) {
+	if (tickStalled || !SDL_AtomicGet(&gameRunning)) {
+		return;
+	}
+	currentTickUsed = true;
+
+	if (inputMode == Input_Record) {
+		ReplayTick rt = {
+			.stateHash = Sim_Hash(w),
+			.mousex = clampf(mousexrel, INT16_MIN, INT16_MAX),
+			.mousey = clampf(mouseyrel, INT16_MIN, INT16_MAX),
+			.keys = Input_GetKeyBits(keyboardState),
+		};
+		Replay_WriteTick(replayFile, &rt);
+	}
+	else if (inputMode == Input_Replay) {
+		if (!replayDiverged && Sim_Hash(w) != currentTick.stateHash) {
+			printf("Replay diverged from the recording at tick %d\n", replayTick);
+			replayDiverged = true;
+		}
+	}
+
+	replayTick++;
+}
+
+void Replay_ReportDraw(float ms) {
+	if (inputMode != Input_Replay) {
+		return;
+	}
+
+	replayDrawTotal += ms;
+	replayFrames++;
+	if (ms > replayDrawMax) {
+		replayDrawMax = ms;
+		replayDrawMaxTick = replayTick;
+	}
+}
+
+void Replay_Close() {
+	if (replayFile != NULL) {
+		fclose(replayFile);
+		replayFile = NULL;
+	}
+}
+
+////////////////////
+// Networked races (--server, --connect and --bot)
+//
+// The server owns the race. It drives every client's kart from the inputs
+// the client sends, runs the enemy karts and keeps the standings. Clients
+// predict their own kart from their input, correct it whenever a snapshot
+// arrives, and otherwise just draw what the server sent.
+//
+// Snapshots are delta coded against the last snapshot the client
+// acknowledged, with positions and yaw quantized to 16 bits, so a kart that
+// didn't move costs one bit.
+
+#define NET_PROTOCOL_VERSION 1
+#define NET_MAX_PACKET 65507
+#define NET_HISTORY 64 // Snapshots kept around as delta baselines
+#define NET_INPUT_RING 64
+#define NET_INPUT_REDUNDANCY 8 // Inputs resent in every packet, in case one is lost
+#define NET_MAX_CATCHUP 2 // Most inputs the server runs for a client in one tick
+#define NET_TIMEOUT_MS 10000
+#define NET_POS_SCALE 8 // Positions are sent in 1/8 pixels, or coarser on big tracks
+
+typedef enum PacketType {
+	Packet_Connect,
+	Packet_Welcome,
+	Packet_Full,
+	Packet_Input,
+	Packet_Snapshot,
+	Packet_Disconnect,
+} PacketType;
+
+typedef struct NetBuffer {
+	uint8_t data[NET_MAX_PACKET];
+	int size;
+	int pos;
+	bool error; // Set when reading past the end, or writing past the space
+} NetBuffer;
+
+void Net_Write8(NetBuffer* b, uint8_t x) {
+	if (b->size >= NET_MAX_PACKET) {
+		b->error = true;
+		return;
+	}
+	b->data[b->size++] = x;
+}
+
+void Net_Write16(NetBuffer* b, uint16_t x) {
+	Net_Write8(b, x);
+	Net_Write8(b, x >> 8);
+}
+
+void Net_Write32(NetBuffer* b, uint32_t x) {
+	Net_Write16(b, x);
+	Net_Write16(b, x >> 16);
+}
+
+void Net_WriteFloat(NetBuffer* b, float x) {
+	uint32_t u;
+	memcpy(&u, &x, sizeof(u));
+	Net_Write32(b, u);
+}
+
+uint8_t Net_Read8(NetBuffer* b) {
+	if (b->pos >= b->size) {
+		b->error = true;
+		return 0;
+	}
+	return b->data[b->pos++];
+}
+
+uint16_t Net_Read16(NetBuffer* b) {
+	uint16_t lo = Net_Read8(b);
+	return lo | (uint16_t)Net_Read8(b) << 8;
+}
+
+uint32_t Net_Read32(NetBuffer* b) {
+	uint32_t lo = Net_Read16(b);
+	return lo | (uint32_t)Net_Read16(b) << 16;
+}
+
+float Net_ReadFloat(NetBuffer* b) {
+	uint32_t u = Net_Read32(b);
+	float x;
+	memcpy(&x, &u, sizeof(x));
+	return x;
+}
+
+void Net_Begin(NetBuffer* b, PacketType type) {
+	b->size = 0;
+	b->pos = 0;
+	b->error = false;
+	Net_Write8(b, type);
+}
+
+int netSocket = -1;
+int netBytesSent;
+
+int Net_OpenSocket(int port) {
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock < 0) {
+		perror("Unable to create socket");
+		exit(EXIT_FAILURE);
+	}
+
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_ANY),
+	};
+	if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		perror("Unable to bind socket");
+		exit(EXIT_FAILURE);
+	}
+
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+	return sock;
 }
 
-typedef struct Skybox {
-	SDL_Surface* imgs[6];
-} Skybox;
+void Net_Send(NetBuffer* b, const struct sockaddr_in* to) {
+	if (b->error) {
+		fprintf(stderr, "Packet too big\n");
+		exit(EXIT_FAILURE);
+	}
+	if (sendto(netSocket, b->data, b->size, 0, (const struct sockaddr*)to, sizeof(*to)) == b->size) {
+		netBytesSent += b->size;
+	}
+}
 
-Skybox mainSkybox;
+bool Net_Receive(NetBuffer* b, struct sockaddr_in* from) {
+	socklen_t len = sizeof(*from);
+	int n = recvfrom(netSocket, b->data, NET_MAX_PACKET, 0, (struct sockaddr*)from, &len);
+	if (n <= 0) {
+		return false;
+	}
+	b->size = n;
+	b->pos = 0;
+	b->error = false;
+	return true;
+}
 
-void LoadSkybox(Skybox* sb, const char** paths) {
-	for (int i = 0; i < 6; i++) {
-		SDL_Surface* surf = IMG_Load(paths[i]);
-		sb->imgs[i] = surf;
+// A kart as it is sent over the network
+typedef struct NetKart {
+	uint16_t x;
+	uint16_t y;
+	uint16_t yaw;
+} NetKart;
+
+// Every kart at one server tick. The player slots come first, then the
+// enemies.
+typedef struct NetFrame {
+	uint32_t tick; // 0 if the slot holds nothing
+	uint16_t players; // Bit i is set if player slot i is in the race
+	NetKart* karts;
+} NetFrame;
+
+NetFrame netFrames[NET_HISTORY];
+NetFrame netZeroFrame; // Baseline for clients that haven't acknowledged anything yet
+int netNumKarts;
+
+void Net_InitFrames(int numEnemies) {
+	netNumKarts = MAX_CLIENTS + numEnemies;
+	for (int i = 0; i < NET_HISTORY; i++) {
+		netFrames[i].tick = 0;
+		netFrames[i].karts = calloc(netNumKarts, sizeof(NetKart));
 	}
+	netZeroFrame.karts = calloc(netNumKarts, sizeof(NetKart));
 }
 
-void DrawSky(Skybox* sb) {
-	for (int i = 0; i < GAME_HEIGHT; i++) {
-		for (int j = 0; j < GAME_WIDTH; j++) {
-			float x = mapf(j, 0, GAME_WIDTH, -1, 1);
-			float y = mapf(i, 0, GAME_HEIGHT, 1, -1);
+NetFrame* Net_GetFrame(uint32_t tick) {
+	if (tick == 0) {
+		return &netZeroFrame;
+	}
+	NetFrame* f = &netFrames[tick % NET_HISTORY];
+	return f->tick == tick ? f : NULL;
+}
 
-			vec3 dir = vec3_scale(vec3_normalize(vec3_add(
-				vec3_scale(mainCamera.forward, mainCamera.cam_dist), 
-				vec3_add(vec3_scale(mainCamera.right, x * GAME_WIDTH / 2), vec3_scale(mainCamera.up, y * GAME_HEIGHT / 2)))), 255);
+// Positions have to fit in 16 bits all the way across the track, so tracks
+// bigger than 8192 pixels send them in 1/4 pixels, then 1/2 and so on. The
+// client has the same track loaded by the time it reads a snapshot.
+float Net_PosScale(const Track* tr) {
+	return fminf(NET_POS_SCALE, 65536.0f / (1 << tr->size_log2));
+}
 
-			int index;
-			float u;
-			float v;
-			convert_xyz_to_cube_uv(dir.x, dir.y, dir.z, &index, &u, &v);
+uint16_t Net_QuantizePos(float x, float scale) {
+	return clampf(roundf(x * scale), 0, UINT16_MAX);
+}
 
-			int tx = mapf(u, 0, 1, 0, sb->imgs[0]->w);
-			int ty = mapf(v, 0, 1, 0, sb->imgs[0]->h);
+float Net_DequantizePos(uint16_t x, float scale) {
+	return (float)x / scale;
+}
 
-			rgb colour = SampleSurface(sb->imgs[index], tx, ty);
+uint16_t Net_QuantizeYaw(float yaw) {
+	return (uint16_t)(int32_t)lroundf(yaw * (65536 / (2 * M_PI)));
+}
 
-			// SetPixel(j, i, (rgb){(uint8_t)(j ^ i), 0, 0});
-			SetPixel(j, i, colour);
-		}
+float Net_DequantizeYaw(uint16_t yaw) {
+	return (int16_t)yaw * (float)(2 * M_PI / 65536);
+}
+
+NetKart Net_QuantizeKart(float x, float y, float yaw, float scale) {
+	return (NetKart){Net_QuantizePos(x, scale), Net_QuantizePos(y, scale), Net_QuantizeYaw(yaw)};
+}
+
+// Each field of a changed kart is sent as one of these. Differences wrap
+// around, so yaw always goes the short way round.
+enum {
+	NetField_Same,
+	NetField_Delta8,
+	NetField_Full,
+};
+
+int Net_FieldMode(uint16_t base, uint16_t x) {
+	int16_t d = x - base;
+	if (d == 0) {
+		return NetField_Same;
+	}
+	if (d >= INT8_MIN && d <= INT8_MAX) {
+		return NetField_Delta8;
 	}
+	return NetField_Full;
 }
 
-void DrawFloor() {
-	vec3 pos = mainCamera.position;
+void Net_WriteField(NetBuffer* b, int mode, uint16_t base, uint16_t x) {
+	if (mode == NetField_Delta8) {
+		Net_Write8(b, (uint8_t)(x - base));
+	}
+	else if (mode == NetField_Full) {
+		Net_Write16(b, x);
+	}
+}
 
-	for (int i = 0; i < GAME_HEIGHT; i++) {
-		for (int j = 0; j < GAME_WIDTH; j++) {
-			float x = mapf(j, 0, GAME_WIDTH, -1, 1);
-			float y = mapf(i, 0, GAME_HEIGHT, 1, -1);
+uint16_t Net_ReadField(NetBuffer* b, int mode, uint16_t base) {
+	if (mode == NetField_Delta8) {
+		return base + (int8_t)Net_Read8(b);
+	}
+	if (mode == NetField_Full) {
+		return Net_Read16(b);
+	}
+	return base;
+}
 
-			vec3 dir = vec3_add(
-				vec3_scale(mainCamera.forward, mainCamera.cam_dist), 
-				vec3_add(vec3_scale(mainCamera.right, x * GAME_WIDTH / 2), vec3_scale(mainCamera.up, y * GAME_HEIGHT / 2)));
+// A bitmap of which karts changed since the baseline, then for each changed
+// kart a byte of field modes followed by the fields
+void Net_WriteKarts(NetBuffer* b, const NetFrame* base, const NetFrame* f) {
+	int bitmap = b->size;
+	for (int i = 0; i < (netNumKarts + 7) / 8; i++) {
+		Net_Write8(b, 0);
+	}
+	if (b->error) {
+		return;
+	}
 
-			float t = -pos.z / dir.z;
+	for (int i = 0; i < netNumKarts; i++) {
+		const NetKart* a = &base->karts[i];
+		const NetKart* k = &f->karts[i];
 
-			if (t < 0) {
-				continue;
-			}
+		int mx = Net_FieldMode(a->x, k->x);
+		int my = Net_FieldMode(a->y, k->y);
+		int myaw = Net_FieldMode(a->yaw, k->yaw);
+		if (mx == NetField_Same && my == NetField_Same && myaw == NetField_Same) {
+			continue;
+		}
 
-			float fx = pos.x + t * dir.x;
-			float fy = pos.y + t * dir.y;
+		b->data[bitmap + i / 8] |= 1 << (i % 8);
+		Net_Write8(b, mx | my << 2 | myaw << 4);
+		Net_WriteField(b, mx, a->x, k->x);
+		Net_WriteField(b, my, a->y, k->y);
+		Net_WriteField(b, myaw, a->yaw, k->yaw);
+	}
+}
 
-			SDL_Surface* surf = track.trackImage;
+void Net_ReadKarts(NetBuffer* b, const NetFrame* base, NetFrame* f) {
+	int bitmap = b->pos;
+	b->pos += (netNumKarts + 7) / 8;
+	if (b->pos > b->size) {
+		b->error = true;
+		return;
+	}
 
-			if (fx < 0 || fx > surf->w || fy < 0 || fy > surf->h) {
-				// SetPixel(j, i, (rgb){0, 0, 0});
-				continue;
-			}
+	for (int i = 0; i < netNumKarts; i++) {
+		const NetKart* a = &base->karts[i];
+		NetKart* k = &f->karts[i];
 
-			int mask = (1 << track.size_log2) - 1;
-			int tx = (int)fx & mask;
-			int ty = (int)fy & mask;
+		if ((b->data[bitmap + i / 8] & (1 << (i % 8))) == 0) {
+			*k = *a;
+			continue;
+		}
 
-			uint8_t* pixelData = surf->pixels;
-			uint8_t r = pixelData[ty * surf->pitch + tx * 3 + 0];
-			uint8_t g = pixelData[ty * surf->pitch + tx * 3 + 1];
-			uint8_t b = pixelData[ty * surf->pitch + tx * 3 + 2];
+		int modes = Net_Read8(b);
+		k->x = Net_ReadField(b, modes & 3, a->x);
+		k->y = Net_ReadField(b, (modes >> 2) & 3, a->y);
+		k->yaw = Net_ReadField(b, (modes >> 4) & 3, a->yaw);
+	}
+}
 
-			if (r == 255 && g == 0 && b == 255) {
-				continue;
-			}
+bool Net_SameAddress(const struct sockaddr_in* a, const struct sockaddr_in* b) {
+	return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
 
-			SetPixel(j, i, (rgb){r, g, b});
+////////////////////
+// Server
+
+typedef struct NetClient {
+	bool connected;
+	struct sockaddr_in addr;
+	Uint32 lastHeard;
+
+	Camera camera;
+	vec2 velocity;
+	PlayerState state;
+
+	// Inputs by sequence number. The kart has driven up to lastInput.
+	uint16_t queuedKeys[NET_INPUT_RING];
+	uint32_t queuedSeq[NET_INPUT_RING];
+	uint32_t newestInput;
+	uint32_t lastInput;
+	uint16_t lastKeys;
+
+	uint32_t ackedTick;
+} NetClient;
+
+NetClient netClients[MAX_CLIENTS];
+uint32_t netTick;
+bool raceStarted;
+PlayerState serverStartState;
+vec2 serverStartPosition;
+
+void Server_RebuildStandings(World* w) {
+	w->numRacers = 0;
+	for (int i = 0; i < w->enemies.count; i++) {
+		w->standings[w->numRacers++] = &w->enemies.progress[i];
+	}
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		if (netClients[i].connected) {
+			w->standings[w->numRacers++] = &netClients[i].state.progress;
 		}
 	}
+	Standings_Sort(w);
 }
 
-int AddSprite(const char* path) {
-	if (numSprites == MAX_SPRITES) {
-		fprintf(stderr, "Ran out of sprites\n");
-		exit(EXIT_FAILURE);
+void Server_SendWelcome(const World* w, int id) {
+	static NetBuffer b;
+	Net_Begin(&b, Packet_Welcome);
+	Net_Write8(&b, id);
+	Net_Write8(&b, w->trackNumber - 1);
+	Net_Write16(&b, w->enemies.count);
+	Net_Send(&b, &netClients[id].addr);
+}
+
+void Server_Connect(World* w, const struct sockaddr_in* from) {
+	int id = -1;
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		if (netClients[i].connected && Net_SameAddress(&netClients[i].addr, from)) {
+			// The welcome got lost
+			Server_SendWelcome(w, i);
+			return;
+		}
+		if (!netClients[i].connected && id == -1) {
+			id = i;
+		}
 	}
 
-	SDL_Surface* surf = IMG_Load(path);
-	if (surf == NULL) {
-		fprintf(stderr, "Unable to load sprite: %s\n", IMG_GetError());
-		exit(EXIT_FAILURE);
+	if (id == -1) {
+		static NetBuffer b;
+		Net_Begin(&b, Packet_Full);
+		Net_Send(&b, from);
+		return;
 	}
 
-	sprites[numSprites].img = surf;
-	sprites[numSprites].numAngles = 1;
-	sprites[numSprites].w = surf->w;
-	sprites[numSprites].h = surf->h;
-	numSprites++;
-	return numSprites - 1;
+	NetClient* c = &netClients[id];
+	memset(c, 0, sizeof(*c));
+	c->connected = true;
+	c->addr = *from;
+	c->lastHeard = SDL_GetTicks();
+
+	// Players line up in rows of four behind the start
+	Camera_SetFovX(&c->camera, deg2rad(90));
+	Camera_SetYawPitch(&c->camera, deg2rad(-90), deg2rad(-20));
+	vec2 forward = c->camera.forward_2d;
+	vec2 right = {-forward.y, forward.x};
+	vec2 start = vec2_add(serverStartPosition, vec2_add(
+		vec2_scale(right, (id % 4 - 1.5f) * 2 * KART_RADIUS),
+		vec2_scale(forward, -(id / 4) * ENEMY_SPACING)
+	));
+	c->camera.position = (vec3){start.x, start.y, 20};
+	c->camera.mode = FirstPerson;
+
+	c->state = serverStartState;
+	RaceProgress_Init(&c->state.progress, serverStartState.progress.route, start, 0, 1);
+
+	printf("Player %d connected from %s:%d\n", id, inet_ntoa(from->sin_addr), ntohs(from->sin_port));
+	Server_SendWelcome(w, id);
+	Server_RebuildStandings(w);
+	raceStarted = true;
 }
 
-int AddSpriteRotations(const char* path) {
-	if (numSprites == MAX_SPRITES) {
-		fprintf(stderr, "Ran out of sprites\n");
-		exit(EXIT_FAILURE);
+void Server_Disconnect(World* w, int id) {
+	printf("Player %d left\n", id);
+	netClients[id].connected = false;
+	Server_RebuildStandings(w);
+}
+
+void Server_ReadInput(NetClient* c, NetBuffer* b) {
+	uint32_t ack = Net_Read32(b);
+	uint32_t newest = Net_Read32(b);
+	int count = Net_Read8(b);
+	if (b->error) {
+		return;
 	}
 
-	SDL_Surface* surf = IMG_Load(path);
-	if (surf == NULL) {
-		fprintf(stderr, "Unable to load sprite: %s\n", IMG_GetError());
-		exit(EXIT_FAILURE);
+	if (ack > c->ackedTick && ack <= netTick) {
+		c->ackedTick = ack;
 	}
 
-	sprites[numSprites].img = surf;
-	sprites[numSprites].numAngles = surf->w / surf->h;
-	sprites[numSprites].w = surf->h;
-	sprites[numSprites].h = surf->h;
-	return numSprites++;
+	for (int i = 0; i < count; i++) {
+		uint32_t seq = newest - i;
+		uint16_t keys = Net_Read16(b);
+		if (b->error || seq == 0 || seq <= c->lastInput) {
+			break;
+		}
+		c->queuedKeys[seq % NET_INPUT_RING] = keys;
+		c->queuedSeq[seq % NET_INPUT_RING] = seq;
+	}
+	if (newest > c->newestInput) {
+		c->newestInput = newest;
+	}
 }
 
-vec2 ProjectPoint(vec3 p) {
-	Camera* cam = &mainCamera;
+void Server_Receive(World* w) {
+	static NetBuffer b;
+	struct sockaddr_in from;
+	while (Net_Receive(&b, &from)) {
+		PacketType type = Net_Read8(&b);
+		if (type == Packet_Connect) {
+			if (Net_Read16(&b) == NET_PROTOCOL_VERSION && !b.error) {
+				Server_Connect(w, &from);
+			}
+			continue;
+		}
 
-	p = vec3_sub(p, cam->position);
-	mat3 m = {
-		cam->forward.x * cam->cam_dist, cam->right.x * GAME_WIDTH / 2, cam->up.x * GAME_HEIGHT / 2,
-		cam->forward.y * cam->cam_dist, cam->right.y * GAME_WIDTH / 2, cam->up.y * GAME_HEIGHT / 2,
-		cam->forward.z * cam->cam_dist, cam->right.z * GAME_WIDTH / 2, cam->up.z * GAME_HEIGHT / 2,
-	};
-	mat3_invert(&m);
-	vec3 v = mat3_mul(m, p);
-	v.y /= v.x;
-	v.z /= v.x;
+		for (int i = 0; i < MAX_CLIENTS; i++) {
+			NetClient* c = &netClients[i];
+			if (!c->connected || !Net_SameAddress(&c->addr, &from)) {
+				continue;
+			}
 
-	return (vec2){
-		mapf(v.y, -1, 1, 0, GAME_WIDTH),
-		mapf(v.z, 1, -1, 0, GAME_HEIGHT)
-	};
+			c->lastHeard = SDL_GetTicks();
+			if (type == Packet_Input) {
+				Server_ReadInput(c, &b);
+			}
+			else if (type == Packet_Disconnect) {
+				Server_Disconnect(w, i);
+			}
+			break;
+		}
+	}
 }
 
-int cmp_sprites(const void* a, const void* b) {
-	Camera* cam = &mainCamera;
+void Server_DriveClients(World* w) {
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		NetClient* c = &netClients[i];
+		if (!c->connected) {
+			continue;
+		}
 
-	int ia = *(int*)a;
-	int ib = *(int*)b;
+		// A client that fell a long way behind skips ahead rather than
+		// lagging forever
+		if (c->newestInput - c->lastInput > NET_INPUT_RING / 2) {
+			c->lastInput = c->newestInput - NET_MAX_CATCHUP;
+		}
 
-	const Sprite* sa = &sprites[ia];
-	const Sprite* sb = &sprites[ib];
+		for (int n = 0; n < NET_MAX_CATCHUP && c->lastInput < c->newestInput; n++) {
+			uint32_t seq = c->lastInput + 1;
+			// Inputs lost in every packet that carried them repeat the last one
+			if (c->queuedSeq[seq % NET_INPUT_RING] == seq) {
+				c->lastKeys = c->queuedKeys[seq % NET_INPUT_RING];
+			}
+			Player_Drive(w, &c->camera, &c->velocity, &c->state, c->lastKeys);
+			c->lastInput = seq;
+		}
+	}
+}
 
-	float da = vec3_dot(cam->forward, vec3_sub(sa->pos, cam->position));
-	float db = vec3_dot(cam->forward, vec3_sub(sb->pos, cam->position));
+void Server_StoreFrame(const World* w) {
+	const Enemies* e = &w->enemies;
+	NetFrame* f = &netFrames[netTick % NET_HISTORY];
+	f->tick = netTick;
+	f->players = 0;
+	float scale = Net_PosScale(&w->track);
+
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		NetClient* c = &netClients[i];
+		if (c->connected) {
+			f->players |= 1 << i;
+			f->karts[i] = Net_QuantizeKart(c->camera.position.x, c->camera.position.y, c->camera.yaw, scale);
+		}
+		else {
+			f->karts[i] = (NetKart){0};
+		}
+	}
 
-	if (da < db) {
-		return 1;
+	for (int i = 0; i < e->count; i++) {
+		f->karts[MAX_CLIENTS + i] = Net_QuantizeKart(e->posX[i], e->posY[i], atan2f(e->dirY[i], e->dirX[i]), scale);
 	}
-	else {
-		return -1;
+}
+
+// Returns the size of the snapshot
+int Server_SendSnapshot(const World* w, int id) {
+	static NetBuffer b;
+	NetClient* c = &netClients[id];
+
+	uint32_t baseTick = c->ackedTick;
+	if (netTick - baseTick >= NET_HISTORY || Net_GetFrame(baseTick) == NULL) {
+		baseTick = 0;
 	}
+
+	Net_Begin(&b, Packet_Snapshot);
+	Net_Write32(&b, netTick);
+	Net_Write32(&b, baseTick);
+
+	// The client's own kart is sent exactly, since it predicts from it
+	Net_Write32(&b, c->lastInput);
+	Net_WriteFloat(&b, c->camera.position.x);
+	Net_WriteFloat(&b, c->camera.position.y);
+	Net_WriteFloat(&b, c->camera.yaw);
+	Net_WriteFloat(&b, c->velocity.x);
+	Net_WriteFloat(&b, c->velocity.y);
+
+	const RaceProgress* rp = &c->state.progress;
+	Net_Write16(&b, rp->target);
+	Net_WriteFloat(&b, rp->segStart.x);
+	Net_WriteFloat(&b, rp->segStart.y);
+	Net_Write8(&b, rp->lap);
+	Net_Write16(&b, rp->finishPlace);
+	Net_Write16(&b, Standings_Place(w, rp));
+
+	const NetFrame* f = Net_GetFrame(netTick);
+	Net_Write16(&b, f->players);
+	Net_Write16(&b, netNumKarts);
+	Net_WriteKarts(&b, Net_GetFrame(baseTick), f);
+
+	Net_Send(&b, &c->addr);
+	return b.size;
 }
 
-void DrawSprites() {
-	// TODO: Fix sprite rotations
+void Server_Run(World* w, int port) {
+	netSocket = Net_OpenSocket(port);
 
-	Camera* cam = &mainCamera;
+	TrackLoad_Publish(w, TrackLoad_Begin(w, trackNames[w->trackNumber], numEnemies));
+	Arena_Report(w->track.arena);
+	w->trackNumber++;
+	serverStartPosition = (vec2){w->mainCamera.position.x, w->mainCamera.position.y};
+	serverStartState = w->mainPlayerState;
+	w->numFinishedKarts = 0;
 
-	int drawOrder[MAX_SPRITES];
-	for (int i = 0; i < numSprites; i++) {
-		drawOrder[i] = i;
-	}
-	qsort(drawOrder, numSprites, sizeof(int), cmp_sprites);
+	Net_InitFrames(w->enemies.count);
+	Server_RebuildStandings(w);
 
-	for (int i = 0; i < numSprites; i++) {
-		Sprite* spr = &sprites[drawOrder[i]];
+	printf("Serving %s with %d karts on port %d\n", w->track.trackName, w->enemies.count, port);
 
-		int rotationIndex = 0;
-		bool flipX = false;
-		if (spr->numAngles > 1) {
-			// Select which sprite
-			//rotationIndex = (frame / 10) % spr->numAngles;
+	// Stats over the last second
+	int statTicks = 0;
+	double statTickTime = 0;
+	float statTickMax = 0;
+	int statSnapshots = 0;
+	int statSnapshotBytes = 0;
+	int statFullSnapshots = 0;
+	Uint32 statStart = SDL_GetTicks();
 
-			vec2 diff = (vec2){spr->pos.x - cam->position.x, spr->pos.y - cam->position.y};
-			vec2 right = (vec2){cam->right.x, cam->right.y};
+	Uint64 freq = SDL_GetPerformanceFrequency();
+	Uint64 nextTick = SDL_GetPerformanceCounter();
+	while (true) {
+		Uint64 tickStart = SDL_GetPerformanceCounter();
 
-			float theta = spr->angle - cam->yaw - atanf(GAME_WIDTH/(2*cam->cam_dist)* vec2_dot(diff, right) / vec2_dot(diff, cam->forward_2d));
-			// printf("%f\n", theta);
-			if (theta < 0) {
-				flipX = true;
-				theta = -theta;
-			}
-			rotationIndex = mapf(theta, 0, M_PI, 0, spr->numAngles);
-			rotationIndex %= spr->numAngles * 2;
-			if (rotationIndex > spr->numAngles) {
-				rotationIndex = rotationIndex - spr->numAngles;
-				flipX = true;
+		Server_Receive(w);
+
+		int numClients = 0;
+		for (int i = 0; i < MAX_CLIENTS; i++) {
+			NetClient* c = &netClients[i];
+			if (c->connected && SDL_GetTicks() - c->lastHeard > NET_TIMEOUT_MS) {
+				printf("Player %d timed out\n", i);
+				Server_Disconnect(w, i);
 			}
+			numClients += c->connected;
 		}
 
-		vec3 left3 = vec3_sub(spr->pos, vec3_scale(cam->right, spr->w/2.0f));
-		vec3 right3 = vec3_add(spr->pos, vec3_scale(cam->right, spr->w/2.0f));
+		if (raceStarted && numClients == 0) {
+			printf("Everyone left, stopping\n");
+			break;
+		}
 
-		vec3 top3 = vec3_add(spr->pos, vec3_scale(cam->up, spr->h));
+		if (raceStarted) {
+			netTick++;
 
-		vec2 left = ProjectPoint(left3);
-		vec2 right = ProjectPoint(right3);
-		vec2 top = ProjectPoint(top3);
+			Collision_InsertKarts(w);
+			Server_DriveClients(w);
+			Enemies_Update(w);
+			Standings_Sort(w);
 
-		int leftx = clampf(left.x, 0, GAME_WIDTH);
-		int rightx = clampf(right.x, 0, GAME_WIDTH);
+			Server_StoreFrame(w);
+			for (int i = 0; i < MAX_CLIENTS; i++) {
+				if (netClients[i].connected) {
+					statFullSnapshots += netClients[i].ackedTick == 0 || netTick - netClients[i].ackedTick >= NET_HISTORY;
+					statSnapshotBytes += Server_SendSnapshot(w, i);
+					statSnapshots++;
+				}
+			}
 
-		int topy = clampf(top.y, 0, GAME_HEIGHT);
-		int bottomy = clampf(left.y, 0, GAME_HEIGHT);
+			float ms = (SDL_GetPerformanceCounter() - tickStart) * 1000.0 / freq;
+			statTickTime += ms;
+			if (ms > statTickMax) {
+				statTickMax = ms;
+			}
+			statTicks++;
+		}
 
-		for (int y = topy; y < bottomy; y++) {
-			for (int x = leftx; x < rightx; x++) {
-				int tx;
-				if (flipX) {
-					tx = mapf(x, right.x, left.x, 0, spr->w) + spr->w * rotationIndex;
-				}
-				else {
-					tx = mapf(x, left.x, right.x, 0, spr->w) + spr->w * rotationIndex;
-				}
-				int ty = mapf(y, top.y, left.y, 0, spr->h);
-				rgba c = SampleSurface_rgba(spr->img, tx, ty);
-				if (c.a < 1) {
-					continue;
-				}
-				SetPixel(x, y, (rgb){c.r,c.g,c.b});
+		Uint32 now = SDL_GetTicks();
+		if (now - statStart >= 1000) {
+			if (statTicks > 0) {
+				printf("Tick %u: %d clients, %d karts, tick %.3f ms avg %.3f ms max, %.1f KB/s, %d bytes/snapshot (%d full)\n",
+					netTick, numClients, w->enemies.count + numClients,
+					statTickTime / statTicks, statTickMax,
+					netBytesSent / 1024.0f * 1000 / (now - statStart),
+					statSnapshots > 0 ? statSnapshotBytes / statSnapshots : 0, statFullSnapshots);
 			}
+			statTicks = 0;
+			statTickTime = 0;
+			statTickMax = 0;
+			statSnapshots = 0;
+			statSnapshotBytes = 0;
+			statFullSnapshots = 0;
+			netBytesSent = 0;
+			statStart = now;
+		}
+
+		// Run at the same fixed rate as the game
+		nextTick += freq * global_dt;
+		Uint64 now64 = SDL_GetPerformanceCounter();
+		if (now64 < nextTick) {
+			SDL_Delay((nextTick - now64) * 1000 / freq);
+		}
+		else {
+			nextTick = now64;
 		}
 	}
 }
 
-void UpdateFreeFlyCamera() {
-	const float flySpeed = 200;
-	const float mouseSensitivity = 1;
-
-	Camera* cam = &mainCamera;
+////////////////////
+// Client
 
-	float newYaw = cam->yaw + mousexrel * mouseSensitivity * global_dt;
-	float newPitch = cam->pitch - mouseyrel * mouseSensitivity * global_dt;
+struct sockaddr_in netServerAddr;
+int netClientId;
+Uint32 netLastHeard;
 
-	newPitch = clampf(newPitch, -M_PI_2, M_PI_2);
+// Inputs by sequence number, kept until the server has run them
+uint16_t netInputs[NET_INPUT_RING];
+uint32_t netInputSeq;
 
-	Camera_SetYawPitch(cam, newYaw, newPitch);
+uint32_t netLatestTick; // Newest snapshot, acknowledged in every input packet
+int netFinishPlace;
 
-	if (keyboardState[SDL_SCANCODE_W]) {
-		cam->position.x += cam->forward_2d.x * flySpeed * global_dt;
-		cam->position.y += cam->forward_2d.y * flySpeed * global_dt;
-	}
-	if (keyboardState[SDL_SCANCODE_S]) {
-		cam->position.x -= cam->forward_2d.x * flySpeed * global_dt;
-		cam->position.y -= cam->forward_2d.y * flySpeed * global_dt;
-	}
-	if (keyboardState[SDL_SCANCODE_D]) {
-		cam->position.x += cam->right.x * flySpeed * global_dt;
-		cam->position.y += cam->right.y * flySpeed * global_dt;
-	}
-	if (keyboardState[SDL_SCANCODE_A]) {
-		cam->position.x -= cam->right.x * flySpeed * global_dt;
-		cam->position.y -= cam->right.y * flySpeed * global_dt;
+void Net_Connect(World* w, const char* address) {
+	char host[256];
+	const char* colon = strrchr(address, ':');
+	if (colon == NULL || colon - address >= (int)sizeof(host)) {
+		fprintf(stderr, "Expected HOST:PORT, got %s\n", address);
+		exit(EXIT_FAILURE);
 	}
+	memcpy(host, address, colon - address);
+	host[colon - address] = 0;
 
-	if (keyboardState[SDL_SCANCODE_SPACE]) {
-		cam->position.z += flySpeed * global_dt;
-	}
-	if (keyboardState[SDL_SCANCODE_LSHIFT]) {
-		cam->position.z -= flySpeed * global_dt;
+	struct addrinfo hints = {
+		.ai_family = AF_INET,
+		.ai_socktype = SOCK_DGRAM,
+	};
+	struct addrinfo* res;
+	if (getaddrinfo(host, colon + 1, &hints, &res) != 0) {
+		fprintf(stderr, "Unable to find server %s\n", address);
+		exit(EXIT_FAILURE);
 	}
+	memcpy(&netServerAddr, res->ai_addr, sizeof(netServerAddr));
+	freeaddrinfo(res);
 
-	if (keyboardState[SDL_SCANCODE_I]) {
-		Camera_SetFovX(cam, cam->fov_x + deg2rad(10) * global_dt);
-	}
-	if (keyboardState[SDL_SCANCODE_K]) {
-		Camera_SetFovX(cam, cam->fov_x - deg2rad(10) * global_dt);
-	}
-}
+	netSocket = Net_OpenSocket(0);
 
-int positions[3];
+	static NetBuffer b;
+	for (int attempt = 0; attempt < 20; attempt++) {
+		Net_Begin(&b, Packet_Connect);
+		Net_Write16(&b, NET_PROTOCOL_VERSION);
+		Net_Send(&b, &netServerAddr);
 
-vec2 velocity = {0};
-void UpdateFirstPersonCamera() {
-	const float acceleration = 20;
-	const float turnSpeed = deg2rad(90);
-	
-	Camera* cam = &mainCamera;
-	PlayerState* ps = &mainPlayerState;
+		for (int wait = 0; wait < 25; wait++) {
+			SDL_Delay(10);
 
-	float drag;
-	rgb c = SampleSurface(track.attributeImage, cam->position.x, cam->position.y);
-	if (memcmp(&c, &(rgb){255,0,0}, sizeof(rgb)) == 0) {
-		drag = 5;
-	}
-	else if (memcmp(&c, &(rgb){0,255,0}, sizeof(rgb)) == 0) {
-		// drag = 30;
-	}
-	else {
-		drag = 15;
-	}
+			struct sockaddr_in from;
+			if (!Net_Receive(&b, &from) || !Net_SameAddress(&from, &netServerAddr)) {
+				continue;
+			}
 
-	if (keyboardState[SDL_SCANCODE_W]) {
-		velocity.x += cam->forward_2d.x * acceleration * global_dt;
-		velocity.y += cam->forward_2d.y * acceleration * global_dt;
-	}
-	if (keyboardState[SDL_SCANCODE_S]) {
-		velocity.x -= cam->forward_2d.x * acceleration * global_dt;
-		velocity.y -= cam->forward_2d.y * acceleration * global_dt;
-	}
+			PacketType type = Net_Read8(&b);
+			if (type == Packet_Full) {
+				fprintf(stderr, "Server %s is full\n", address);
+				exit(EXIT_FAILURE);
+			}
+			if (type != Packet_Welcome) {
+				continue;
+			}
 
-	if (keyboardState[SDL_SCANCODE_A]) {
-		Camera_SetYawPitch(cam, cam->yaw - turnSpeed * global_dt, cam->pitch);
-	}
-	if (keyboardState[SDL_SCANCODE_D]) {
-		Camera_SetYawPitch(cam, cam->yaw + turnSpeed * global_dt, cam->pitch);
+			netClientId = Net_Read8(&b);
+			w->trackNumber = Net_Read8(&b);
+			numEnemies = Net_Read16(&b);
+			if (b.error || w->trackNumber >= (int)(sizeof(trackNames) / sizeof(trackNames[0])) || numEnemies > MAX_ENEMIES) {
+				fprintf(stderr, "Bad welcome from server %s\n", address);
+				exit(EXIT_FAILURE);
+			}
+
+			printf("Joined %s as player %d\n", address, netClientId);
+			netLastHeard = SDL_GetTicks();
+			return;
+		}
 	}
 
-	velocity.x -= drag * velocity.x * global_dt;
-	velocity.y -= drag * velocity.y * global_dt;
+	fprintf(stderr, "No reply from server %s\n", address);
+	exit(EXIT_FAILURE);
+}
 
-	// printf("Player velocity: %f\n", hypotf(velocity.x, velocity.y));
+void Net_SendInputs() {
+	static NetBuffer b;
+	Net_Begin(&b, Packet_Input);
+	Net_Write32(&b, netLatestTick);
+	Net_Write32(&b, netInputSeq);
 
-	cam->position.x += velocity.x;
-	cam->position.y += velocity.y;
+	int count = netInputSeq < NET_INPUT_REDUNDANCY ? netInputSeq : NET_INPUT_REDUNDANCY;
+	Net_Write8(&b, count);
+	for (int i = 0; i < count; i++) {
+		Net_Write16(&b, netInputs[(netInputSeq - i) % NET_INPUT_RING]);
+	}
 
-	// Check player markers
+	Net_Send(&b, &netServerAddr);
+}
 
-	for (int i = 0; i < ps->pathLen; i++) {
-		vec2 pathPoint = ps->path[i];
-		float dx = pathPoint.x - cam->position.x;
-		float dy = pathPoint.y - cam->position.y;
-		float d = hypotf(dx, dy);
+void Net_ClientReadSnapshot(World* w, NetBuffer* b) {
+	uint32_t tick = Net_Read32(b);
+	uint32_t baseTick = Net_Read32(b);
+	if (b->error || tick <= netLatestTick) {
+		return;
+	}
 
-		if (d < 100) {
-			if (i == ps->markerNumber) {
-				printf("Player passed marker %d\n", ps->markerNumber);
-				ps->markerNumber++;
+	// Without the baseline this can't be decoded. It will be acknowledged
+	// again, so the server sends a full snapshot soon.
+	const NetFrame* base = Net_GetFrame(baseTick);
+	if (base == NULL) {
+		return;
+	}
 
-				if (ps->markerNumber == ps->pathLen) {
-					ps->markerNumber = 0;
-					printf("Lap\n");
+	uint32_t lastInput = Net_Read32(b);
+	vec2 pos;
+	pos.x = Net_ReadFloat(b);
+	pos.y = Net_ReadFloat(b);
+	float yaw = Net_ReadFloat(b);
+	vec2 vel;
+	vel.x = Net_ReadFloat(b);
+	vel.y = Net_ReadFloat(b);
+
+	int target = Net_Read16(b);
+	vec2 segStart;
+	segStart.x = Net_ReadFloat(b);
+	segStart.y = Net_ReadFloat(b);
+	int lap = Net_Read8(b);
+	int finishPlace = Net_Read16(b);
+	int place = Net_Read16(b);
+
+	NetFrame* f = &netFrames[tick % NET_HISTORY];
+	f->tick = 0;
+	f->players = Net_Read16(b);
+	if (Net_Read16(b) != netNumKarts || target >= w->mainPlayerState.progress.route->length) {
+		b->error = true;
+	}
+	Net_ReadKarts(b, base, f);
+	if (b->error) {
+		return;
+	}
+	f->tick = tick;
+	netLatestTick = tick;
+	netLastHeard = SDL_GetTicks();
+
+	// Put the local kart where the server had it, then run the inputs the
+	// server hadn't got to yet again on top
+	Camera* cam = &w->mainCamera;
+	PlayerState* ps = &w->mainPlayerState;
+	cam->position.x = pos.x;
+	cam->position.y = pos.y;
+	Camera_SetYawPitch(cam, yaw, cam->pitch);
+	w->velocity = vel;
+
+	ps->progress.lap = lap;
+	RaceProgress_BeginSegment(&ps->progress, segStart, target);
+	RaceProgress_Update(&ps->progress, pos);
+	ps->progress.finishPlace = finishPlace;
+
+	if (netInputSeq - lastInput < NET_INPUT_RING) {
+		for (uint32_t seq = lastInput + 1; seq <= netInputSeq; seq++) {
+			Player_Predict(w, cam, &w->velocity, ps, netInputs[seq % NET_INPUT_RING]);
+		}
+	}
 
-					ps->lapNumber++;
+	w->localPlayers[0].place = place;
+	netFinishPlace = finishPlace;
+
+	float scale = Net_PosScale(&w->track);
+	Enemies* e = &w->enemies;
+	for (int i = 0; i < e->count; i++) {
+		const NetKart* k = &f->karts[MAX_CLIENTS + i];
+		float enemyYaw = Net_DequantizeYaw(k->yaw);
+		e->posX[i] = Net_DequantizePos(k->x, scale);
+		e->posY[i] = Net_DequantizePos(k->y, scale);
+		e->dirX[i] = cosf(enemyYaw);
+		e->dirY[i] = sinf(enemyYaw);
+		Sprite_Place(&w->sprites, e->sprite[i], e->posX[i], e->posY[i]);
+	}
 
-					if (ps->lapNumber == 4) {
-						int place = 1;
-						for (int i = 0; i < NUM_ENEMIES; i++) {
-							if (enemies[i].lap > 3) {
-								place++;
-							}
-						}
-						printf("Came %d\n", place);
-						positions[trackNumber - 1] = place;
-						Transition_init();
-					}
-				}
-			}
+	// The other players use the sprites after firstPlayerSprite, and only as
+	// many as there are players get drawn
+	int n = 0;
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		if (i == netClientId || (f->players & (1 << i)) == 0) {
+			continue;
 		}
+		const NetKart* k = &f->karts[i];
+		int s = w->track.firstPlayerSprite + n++;
+		Sprite_Place(&w->sprites, s, Net_DequantizePos(k->x, scale), Net_DequantizePos(k->y, scale));
+		w->sprites.angle[s] = Net_DequantizeYaw(k->yaw);
 	}
+	w->sprites.count = w->track.firstPlayerSprite + n;
 }
 
-void UpdateCamera() {
-	switch (mainCamera.mode) {
-	case FreeFlyCamera:
-		UpdateFreeFlyCamera();
-		break;
-	case FirstPerson:
-		UpdateFirstPersonCamera();
-		break;
-	default:
-		fprintf(stderr, "Invalid camera mode %d\n", mainCamera.mode);
+void Net_ClientReceive(World* w) {
+	static NetBuffer b;
+	struct sockaddr_in from;
+	while (Net_Receive(&b, &from)) {
+		if (!Net_SameAddress(&from, &netServerAddr)) {
+			continue;
+		}
+		if (Net_Read8(&b) == Packet_Snapshot && gameState == State_Game) {
+			Net_ClientReadSnapshot(w, &b);
+		}
+	}
+
+	if (SDL_GetTicks() - netLastHeard > NET_TIMEOUT_MS) {
+		fprintf(stderr, "Lost connection to the server\n");
 		exit(EXIT_FAILURE);
 	}
 }
 
-void updateKeyboard() {
-	int numKeys;
-	const uint8_t* kb = SDL_GetKeyboardState(&numKeys);
-
-	if (keyboardState == NULL) {
-		keyboardState = malloc(numKeys);
-		lastKeyboardState = malloc(numKeys);
+// One tick of a networked race on the client
+void Net_ClientTick(World* w, uint16_t keys) {
+	if (netNumKarts == 0) {
+		Net_InitFrames(w->enemies.count);
 	}
 
-	memcpy(lastKeyboardState, keyboardState, numKeys);
-	memcpy(keyboardState, kb, numKeys);
-}
+	Net_ClientReceive(w);
 
-void Enemy_BeginPathSegment(Enemy* enemy, int n) {
-	enemy->pathIndex = n;
-	
-	vec2 a = enemy->pos;
-	vec2 b = enemy->path[n + 1 == enemy->pathLength ? 0 : n + 1];
-	vec2 d = vec2_normalize(vec2_sub(b, a));
-	enemy->dir = d;
+	// Predict the kart straight away instead of waiting for the server
+	netInputSeq++;
+	netInputs[netInputSeq % NET_INPUT_RING] = keys;
+	Player_Predict(w, &w->mainCamera, &w->velocity, &w->mainPlayerState, keys);
+
+	Net_SendInputs();
+
+	if (netFinishPlace != 0) {
+		printf("Came %d\n", netFinishPlace);
+		w->positions[w->trackNumber - 1] = netFinishPlace;
+		Over_init();
+	}
 }
 
-void Enemy_Update(Enemy* enemy) {
-	sprites[enemy->sprite].pos = (vec3){enemy->pos.x, enemy->pos.y, 0};
+// Keeps the server from timing us out while the track loads or the results
+// are showing
+void Net_ClientKeepAlive(World* w) {
+	Net_ClientReceive(w);
+	netLastHeard = SDL_GetTicks();
+	Net_SendInputs();
+}
 
-	if (enemy->pathIndex == -1) {
-		Enemy_BeginPathSegment(enemy, 0);
+void Net_Close() {
+	if (netMode == Net_Client) {
+		static NetBuffer b;
+		Net_Begin(&b, Packet_Disconnect);
+		Net_Send(&b, &netServerAddr);
 	}
+	if (netSocket >= 0) {
+		close(netSocket);
+		netSocket = -1;
+	}
+}
 
-	vec2 old_pos = enemy->pos;
-	enemy->pos.x += enemy->dir.x * enemy->speed * global_dt;
-	enemy->pos.y += enemy->dir.y * enemy->speed * global_dt;
+////////////////////
+// Bots (--bot)
+//
+// A client without a window that drives itself round the player's racing
+// line. Running a few of these against a server is a quick way to load it.
 
-	float minx = fminf(old_pos.x, enemy->pos.x);
-	float maxx = fmaxf(old_pos.x, enemy->pos.x);
+uint16_t Bot_Steer(const World* w) {
+	const RaceProgress* rp = &w->mainPlayerState.progress;
+	vec2 pos = {w->mainCamera.position.x, w->mainCamera.position.y};
+	vec2 d = vec2_sub(rp->route->points[rp->target], pos);
+	vec2 f = w->mainCamera.forward_2d;
 
-	float miny = fminf(old_pos.y, enemy->pos.y);
-	float maxy = fmaxf(old_pos.y, enemy->pos.y);
+	float angle = atan2f(f.x * d.y - f.y * d.x, vec2_dot(f, d));
 
-	minx -= 10;
-	maxx += 10;
+	uint16_t keys = INPUT_BIT(INPUT_W);
+	if (angle > deg2rad(5)) {
+		keys |= INPUT_BIT(INPUT_D);
+	}
+	else if (angle < deg2rad(-5)) {
+		keys |= INPUT_BIT(INPUT_A);
+	}
+	return keys;
+}
 
-	miny -= 10;
-	maxx += 10;
+void Bot_Run(World* w) {
+	keyboardState = calloc(SDL_NUM_SCANCODES, 1);
+	numKeyboardKeys = SDL_NUM_SCANCODES;
 
-	int nextIndex = enemy->pathIndex + 1 == enemy->pathLength ? 0 : enemy->pathIndex + 1;
-	vec2 pathPoint = enemy->path[nextIndex];
+	TrackLoad_Publish(w, TrackLoad_Begin(w, trackNames[w->trackNumber], numEnemies));
+	w->trackNumber++;
+	Game_init(w);
 
-	if (pathPoint.x >= minx && pathPoint.x <= maxx && pathPoint.y >= miny && pathPoint.y <= maxy) {
-		Enemy_BeginPathSegment(enemy, nextIndex);
-		printf("Passed point %d\n", enemy->pathIndex);
+	Uint64 freq = SDL_GetPerformanceFrequency();
+	Uint64 nextTick = SDL_GetPerformanceCounter();
+	while (gameState == State_Game) {
+		memset(keyboardState, 0, numKeyboardKeys);
+		Input_SetKeyBits(keyboardState, Bot_Steer(w));
+		Game_update(w);
+		frame++;
 
-		if (enemy->pathIndex == 0) {
-			printf("Enemy lap\n");
-			enemy->lap++;
+		nextTick += freq * global_dt;
+		Uint64 now = SDL_GetPerformanceCounter();
+		if (now < nextTick) {
+			SDL_Delay((nextTick - now) * 1000 / freq);
+		}
+		else {
+			nextTick = now;
 		}
 	}
 }
 
-typedef enum GameState {
-	State_Menu,
-	State_Transition,
-	State_Game,
-	State_Over,
-} GameState;
-
-GameState gameState;
+////////////////////
+// Floor benchmark (--bench-floor)
+//
+// Draws the floor of the first track in every mode from the same camera
+// positions round the player's racing line, without a window.
 
-SDL_Texture* logo;
-SDL_Texture* logo_notext;
+#define BENCH_FLOOR_FRAMES 300
 
-void Menu_init() {
-	gameState = State_Menu;
+void Bench_PlaceCamera(Camera* cam, const RacePath* route, int frame) {
+	float along = (float)frame / BENCH_FLOOR_FRAMES * route->length;
+	int a = (int)along % route->length;
+	int b = (a + 1) % route->length;
+	vec2 d = vec2_sub(route->points[b], route->points[a]);
+	vec2 p = vec2_add(route->points[a], vec2_scale(d, along - (int)along));
 
-	logo = IMG_LoadTexture(renderer, "logo.png");
-	logo_notext = IMG_LoadTexture(renderer, "brummie.png");
+	cam->position = (vec3){p.x, p.y, 20};
+	Camera_SetFovX(cam, deg2rad(90));
+	Camera_SetYawPitch(cam, atan2f(d.y, d.x), deg2rad(-20));
 }
 
-void Menu_update() {
-	if (keyboardState[SDL_SCANCODE_RETURN]) {
-		Transition_init();
-	}
-}
+void Bench_Floor(World* w) {
+	TrackLoad_Publish(w, TrackLoad_Begin(w, trackNames[0], numEnemies));
+
+	rowPitch = GAME_WIDTH * 3;
+	textureData = malloc(rowPitch * GAME_HEIGHT);
+	uint8_t* reference = malloc(rowPitch * GAME_HEIGHT);
+
+	const RacePath* route = w->mainPlayerState.progress.route;
+	Viewport vp = {0, 0, GAME_WIDTH, GAME_HEIGHT};
+	double floatTime = 0;
+
+	printf("Floor of %s, %d frames of %dx%d\n", w->track.trackName, BENCH_FLOOR_FRAMES, GAME_WIDTH, GAME_HEIGHT);
+	for (int mode = 0; mode < NUM_FLOOR_MODES; mode++) {
+		floorMode = mode;
+
+		double total = 0;
+		long differentPixels = 0;
+		for (int f = 0; f < BENCH_FLOOR_FRAMES; f++) {
+			Camera cam;
+			Bench_PlaceCamera(&cam, route, f);
+			RenderView rv;
+			RenderView_Init(&rv, w, &cam, vp);
+			if (w->track.pages != NULL) {
+				VirtualTexture_Stream(w->track.pages, &rv, 1);
+			}
 
-void Menu_draw() {
-	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
-	SDL_RenderClear(renderer);
+			memset(textureData, 127, rowPitch * GAME_HEIGHT);
+			Uint64 start = SDL_GetPerformanceCounter();
+			DrawFloor(&rv);
+			total += (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+
+			// Compared against the float sampler drawing the same frame
+			uint8_t* pixels = textureData;
+			if (mode != Floor_Float) {
+				floorMode = Floor_Float;
+				textureData = reference;
+				memset(textureData, 127, rowPitch * GAME_HEIGHT);
+				DrawFloor(&rv);
+				textureData = pixels;
+				floorMode = mode;
+
+				for (int i = 0; i < rowPitch * GAME_HEIGHT; i += 3) {
+					differentPixels += memcmp(pixels + i, reference + i, 3) != 0;
+				}
+			}
+		}
 
-	SDL_RenderCopy(renderer, logo, NULL, NULL);
+		double ms = total / BENCH_FLOOR_FRAMES;
+		if (mode == Floor_Float) {
+			floatTime = ms;
+		}
+		printf("%-8s %.3f ms/frame, %.2fx float, %.2f%% of pixels differ from float\n",
+			floorModeNames[mode], ms, floatTime / ms,
+			100.0 * differentPixels / ((double)BENCH_FLOOR_FRAMES * GAME_WIDTH * GAME_HEIGHT));
+	}
 
-	SDL_RenderPresent(renderer);
+	free(reference);
 }
 
-int transition_timer;
-
-const char* trackNames[] = {
-	"tracks/mario_circuit",
-	"tracks/ghost",
-	"tracks/rainbow"
-};
-
-void Transition_init() {
-	gameState = State_Transition;
-
-	numSprites = 0;
+////////////////////
+// Headless simulation (--simulate)
+//
+// Races the AI karts and a player driven by the bot round a track as fast as
+// the CPU allows, without a window, for tuning the paths/N.txt files. Every
+// tick is global_dt long, so a track and --karts always give the same race.
+
+#define SIMULATE_MAX_TICKS (20 * 60 * 60) // Karts still racing after this long are given up on
+
+// What one race did. Kart 0 is the player and kart i + 1 is enemy i, as in
+// Kart_GetPos.
+typedef struct SimulateRace {
+	const char* trackPath;
+	int numEnemies;
+
+	float lapTimes[MAX_ENEMIES + 1][NUM_LAPS];
+	int lapStart[MAX_ENEMIES + 1];
+	int lastLap[MAX_ENEMIES + 1];
+	int finishPlace[MAX_ENEMIES + 1];
+	int path[MAX_ENEMIES + 1]; // -1 for the player
+	int order[MAX_ENEMIES + 1]; // Karts from first to last place
+
+	int numKarts;
+	int ticks;
+	int laps;
+	double seconds; // Racing, not counting loading the track
+	uint32_t hash;
+} SimulateRace;
+
+const RaceProgress* Simulate_Progress(const World* w, int kart) {
+	if (kart == 0) {
+		return &w->mainPlayerState.progress;
+	}
+	return &w->enemies.progress[kart - 1];
+}
 
-	NextTrack();
+// A lap is timed from crossing the line, or from the start for karts that
+// are already past it on the grid
+void Simulate_RecordLap(SimulateRace* r, const World* w, int kart) {
+	int lap = Simulate_Progress(w, kart)->lap;
+	if (lap == r->lastLap[kart]) {
+		return;
+	}
 
-	transition_timer = 60;
+	int finished = r->lastLap[kart];
+	if (finished >= 1 && finished <= NUM_LAPS) {
+		r->lapTimes[kart][finished - 1] = (r->ticks - r->lapStart[kart]) * global_dt;
+		r->laps++;
+	}
+	r->lapStart[kart] = r->ticks;
+	r->lastLap[kart] = lap;
 }
 
-void NextTrack() {
-	if (trackNumber == 3) {
-		Over_init();
-		return;
+// Runs the race r describes in w, which can be reused for the next one
+void Simulate_Race(SimulateRace* r, World* w) {
+	TrackLoad_Publish(w, TrackLoad_Begin(w, r->trackPath, r->numEnemies));
+	World_StartRace(w);
+
+	r->numKarts = w->enemies.count + 1;
+	r->ticks = 0;
+	r->laps = 0;
+	for (int k = 0; k < r->numKarts; k++) {
+		r->lastLap[k] = Simulate_Progress(w, k)->lap;
+		r->lapStart[k] = 0;
+		memset(r->lapTimes[k], 0, sizeof(r->lapTimes[k]));
 	}
 
-	Track_Load(&track, trackNames[trackNumber]);
-	trackNumber++;
+	Uint64 start = SDL_GetPerformanceCounter();
+	while (w->numFinishedKarts < r->numKarts && r->ticks < SIMULATE_MAX_TICKS) {
+		Collision_InsertKarts(w);
+		Player_Drive(w, &w->mainCamera, &w->velocity, &w->mainPlayerState, Bot_Steer(w));
+		Enemies_Update(w);
+		r->ticks++;
 
-}
+		for (int k = 0; k < r->numKarts; k++) {
+			Simulate_RecordLap(r, w, k);
+		}
+	}
+	r->seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
 
-void Transition_update() {
-	transition_timer--;
-	if (transition_timer == 0) {
-		Game_init();
+	Standings_Sort(w);
+	for (int i = 0; i < w->numRacers; i++) {
+		int kart = 0;
+		while (Simulate_Progress(w, kart) != w->standings[i]) {
+			kart++;
+		}
+		r->order[i] = kart;
+		r->finishPlace[kart] = w->standings[i]->finishPlace;
+		r->path[kart] = kart == 0 ? -1 : w->enemies.path[kart - 1];
 	}
+	r->hash = World_HashRace(w, 2166136261u);
 }
 
-void Transition_draw() {
-	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
-	SDL_RenderClear(renderer);
-	
-	SDL_RenderCopy(renderer, logo_notext, NULL, NULL);
-	
-	DrawStringInfo dsi = {
-		.font = font,
-		.colour = {0xff, 0xff, 0xff, 0xff},
-		.x = GAME_WIDTH / 2,
-		.y = GAME_HEIGHT / 2,
-		.alignX = TEXT_ALIGN_CENTRE,
-		.alignY = TEXT_ALIGN_CENTRE,
-	};
-	drawString(&dsi, track.trackName);
-
-	SDL_RenderPresent(renderer);
+void Simulate_KartName(const SimulateRace* r, int kart, char* name, size_t size) {
+	if (kart == 0) {
+		snprintf(name, size, "Player");
+	}
+	else {
+		snprintf(name, size, "Kart %d, path %d", kart, r->path[kart]);
+	}
 }
 
-void Game_init() {
-	gameState = State_Game;
+// When the kart crossed the line for the last time. Karts further back on
+// the grid start later, so this rather than the lap times decides places.
+float Simulate_FinishTime(const SimulateRace* r, int kart) {
+	return r->lapStart[kart] * global_dt;
 }
 
-void Game_update() {
-	UpdateCamera();
+void Simulate_Print(const SimulateRace* r) {
+	for (int i = 0; i < r->numKarts; i++) {
+		int kart = r->order[i];
+		int place = r->finishPlace[kart];
+		char name[32];
+		Simulate_KartName(r, kart, name, sizeof(name));
+
+		if (place == 0) {
+			printf("DNF   %-16s", name);
+		}
+		else {
+			printf("%2d%s  %-16s", place, OrdinalSuffix(place), name);
+		}
 
-	for (int i = 0; i < NUM_ENEMIES; i++) {
-		Enemy_Update(&enemies[i]);
+		for (int lap = 0; lap < NUM_LAPS; lap++) {
+			float t = r->lapTimes[kart][lap];
+			if (t > 0) {
+				printf("  %7.3f", t);
+			}
+			else {
+				printf("  %7s", "-");
+			}
+		}
+		if (place != 0) {
+			printf("  finished at %7.3f", Simulate_FinishTime(r, kart));
+		}
+		printf("\n");
 	}
 }
 
-void Game_draw() {
-	////////////////////
-	// Prepare draw
-
-	// Clear screen
-	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
-	SDL_RenderClear(renderer);
+void Simulate_Run(World* w, const char* trackPath) {
+	SimulateRace r = {.trackPath = trackPath, .numEnemies = numEnemies};
 
-	// Get pointer to pixel data for frame
-	SDL_LockTexture(frameTexture, NULL, &textureData, &rowPitch);
-	memset(textureData, 127, rowPitch * GAME_HEIGHT);
+	Simulate_Race(&r, w);
+	double seconds = r.seconds;
 
-	DrawSky(&mainSkybox);
-	DrawFloor();
-	DrawSprites();
+	Arena_Report(w->track.arena);
+	printf("%s, %d karts, %d ticks of %.4f s\n", w->track.trackName, r.numKarts, r.ticks, global_dt);
+	Simulate_Print(&r);
+	printf("%d laps in %.3f s, %.0f laps per second, %.0fx real time\n", r.laps, seconds, r.laps / seconds, r.ticks * global_dt / seconds);
+	printf("State hash %08x\n", r.hash);
+}
 
-	// Present frame
-	SDL_UnlockTexture(frameTexture);
-	SDL_RenderCopy(renderer, frameTexture, NULL, NULL);
+////////////////////
+// Batch simulation (--simulate TRACK --batch N)
+//
+// Runs N headless races on a thread per core, each thread with a World of
+// its own. Race i has i % (--karts + 1) AI karts, so a batch sweeps every
+// field size from an empty track up. Races of the same size have to come
+// out the same, which checks that the worlds really are independent.
 
-	DrawStringInfo dsi = {
-		.font = font,
-		.colour = {0xff, 0xff, 0xff, 0xff},
-		.x = 0,
-		.y = GAME_HEIGHT,
-		.alignX = TEXT_ALIGN_LEFT,
-		.alignY = TEXT_ALIGN_ABOVE,
-	};
-	drawStringf(&dsi, "Lap %d", mainPlayerState.lapNumber);
+#define BATCH_MAX_THREADS 64
 
-	SDL_RenderPresent(renderer);
-}
+typedef struct BatchJob {
+	SimulateRace* races;
+	int numRaces;
+	SDL_atomic_t next;
+} BatchJob;
 
-void Over_init() {
-	gameState = State_Over;
-}
+int Batch_Thread(void* data) {
+	BatchJob* job = data;
+	World* w = World_Create();
 
-void Over_update() {
+	while (true) {
+		int i = SDL_AtomicAdd(&job->next, 1);
+		if (i >= job->numRaces) {
+			break;
+		}
+		Simulate_Race(&job->races[i], w);
+	}
 
+	World_Destroy(w);
+	return 0;
 }
 
-void Over_draw() {
-	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
-	SDL_RenderClear(renderer);
-	
-	SDL_RenderCopy(renderer, logo_notext, NULL, NULL);
-	
-	DrawStringInfo dsi = {
-		.font = font_small,
-		.colour = {0xff, 0xff, 0xff, 0xff},
-		.x = 0,
-		.y = 0,
-		.alignX = TEXT_ALIGN_LEFT,
-		.alignY = TEXT_ALIGN_BELOW,
+void Batch_Run(const char* trackPath, int numRaces) {
+	BatchJob job = {
+		.races = calloc(numRaces, sizeof(SimulateRace)),
+		.numRaces = numRaces,
 	};
-	drawStringf(&dsi, "Thankyou for playing Super Brummie Kart. You came in places %d, %d, %d.", positions[0], positions[1], positions[2]);
+	for (int i = 0; i < numRaces; i++) {
+		job.races[i].trackPath = trackPath;
+		job.races[i].numEnemies = i % (numEnemies + 1);
+	}
+	SDL_AtomicSet(&job.next, 0);
 
-	SDL_RenderPresent(renderer);
+	int numThreads = SDL_GetCPUCount();
+	if (numThreads > numRaces) {
+		numThreads = numRaces;
+	}
+	SDL_Thread* threads[BATCH_MAX_THREADS];
+	if (numThreads > BATCH_MAX_THREADS) {
+		numThreads = BATCH_MAX_THREADS;
+	}
+
+	Uint64 start = SDL_GetPerformanceCounter();
+	for (int t = 0; t < numThreads; t++) {
+		threads[t] = SDL_CreateThread(Batch_Thread, "Batch", &job);
+		if (threads[t] == NULL) {
+			fprintf(stderr, "Unable to create batch thread: %s\n", SDL_GetError());
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (int t = 0; t < numThreads; t++) {
+		SDL_WaitThread(threads[t], NULL);
+	}
+	double seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+	// The first race of each size is what the others have to match
+	uint32_t expected[MAX_ENEMIES + 1];
+	int mismatches = 0;
+	int laps = 0;
+	double simulated = 0;
+	double racing = 0;
+	for (int i = 0; i < numRaces; i++) {
+		const SimulateRace* r = &job.races[i];
+		laps += r->laps;
+		simulated += r->ticks * global_dt;
+		racing += r->seconds;
+
+		if (i <= numEnemies) {
+			expected[i] = r->hash;
+		}
+		bool matched = r->hash == expected[r->numEnemies];
+		mismatches += !matched;
+
+		int winner = r->order[0];
+		char name[32];
+		Simulate_KartName(r, winner, name, sizeof(name));
+		printf("Race %d: %2d karts, %5d ticks, won by %-16s in %7.3f, hash %08x%s\n",
+			i, r->numKarts, r->ticks, name, Simulate_FinishTime(r, winner), r->hash,
+			matched ? "" : " DIFFERENT");
+	}
+
+	// Every race loads its own track, which takes longer than a short race
+	printf("%d races, %d laps in %.3f s on %d threads, %.0f laps per second, %.0fx real time\n",
+		numRaces, laps, seconds, numThreads, laps / seconds, simulated / seconds);
+	printf("%.3f s of thread time racing, %.0f laps per second per thread while racing\n", racing, laps / racing);
+	if (mismatches > 0) {
+		printf("%d races didn't match the first race with as many karts\n", mismatches);
+	}
+	else {
+		printf("Every race matched the first race with as many karts\n");
+	}
+
+	free(job.races);
 }
 
-void update() {
+// One tick of the simulation, once its input is in keyboardState and
+// mousexrel/mouseyrel
+void Sim_Tick(World* w) {
 	lastGlobalTime = globalTime;
 	globalTime += global_dt;
 
-	updateKeyboard();
+	Replay_BeginTick();
+
+	if (netMode == Net_Client && gameState != State_Game) {
+		Net_ClientKeepAlive(w);
+	}
 
 	switch (gameState) {
 	case State_Menu:
-		Menu_update();
+		Menu_update(w);
 		break;
 	case State_Transition:
-		Transition_update();
+		Transition_update(w);
 		break;
 	case State_Game:
-		Game_update();
+		Game_update(w);
 		break;
 	case State_Over:
 		Over_update();
@@ -1274,10 +7103,18 @@ void update() {
 		exit(EXIT_FAILURE);
 	}
 
-	// printf("%f %f %f\n", mainCamera.position.x, mainCamera.position.y, mainCamera.position.z);
+	Audio_Update(w);
+	Replay_EndTick(w);
+
+	// printf("%f %f %f\n", w->mainCamera.position.x, w->mainCamera.position.y, w->mainCamera.position.z);
+}
+
+void update(World* w) {
+	updateKeyboard();
+	Sim_Tick(w);
 }
 
-void draw() {
+void draw(World* w) {
 	switch (gameState) {
 	case State_Menu:
 		Menu_draw();
@@ -1286,10 +7123,10 @@ void draw() {
 		Transition_draw();
 		break;
 	case State_Game:
-		Game_draw();
+		Game_draw(w);
 		break;
 	case State_Over:
-		Over_draw();
+		Over_draw(w);
 		break;
 	default:
 		fprintf(stderr, "Invalid game state %d\n", gameState);
@@ -1297,10 +7134,301 @@ void draw() {
 	}
 }
 
-int main() {
+////////////////////
+// Simulation thread
+
+// Input for the simulation thread. The main thread keeps polling events, and
+// each tick takes the newest key state and the mouse motion since the last.
+SDL_SpinLock simInputLock;
+uint8_t simInputKeys[SDL_NUM_SCANCODES];
+int simInputMouseX;
+int simInputMouseY;
+Uint64 simInputTime;
+
+// Set once the race is over and the thread can be joined
+SDL_atomic_t simThreadDone;
+
+void SimThread_PostInput(int mousex, int mousey) {
+	int numKeys;
+	const uint8_t* kb = SDL_GetKeyboardState(&numKeys);
+
+	SDL_AtomicLock(&simInputLock);
+	memcpy(simInputKeys, kb, numKeys < SDL_NUM_SCANCODES ? numKeys : SDL_NUM_SCANCODES);
+	simInputMouseX += mousex;
+	simInputMouseY += mousey;
+	simInputTime = inputLatchTime;
+	SDL_AtomicUnlock(&simInputLock);
+}
+
+Uint64 SimThread_TakeInput() {
+	SDL_AtomicLock(&simInputLock);
+	memcpy(lastKeyboardState, keyboardState, numKeyboardKeys);
+	memcpy(keyboardState, simInputKeys, numKeyboardKeys < SDL_NUM_SCANCODES ? numKeyboardKeys : SDL_NUM_SCANCODES);
+	mousexrel = simInputMouseX;
+	mouseyrel = simInputMouseY;
+	simInputMouseX = 0;
+	simInputMouseY = 0;
+	Uint64 inputTime = simInputTime;
+	SDL_AtomicUnlock(&simInputLock);
+	return inputTime;
+}
+
+// Ticks at a steady global_dt until the race is over, however long frames
+// take to draw
+int SimThread_Run(void* data) {
+	World* w = data;
+
+	SDL_SetThreadPriority(SDL_THREAD_PRIORITY_HIGH);
+	Uint64 freq = SDL_GetPerformanceFrequency();
+	Uint64 period = global_dt * freq;
+	Uint64 next = SDL_GetPerformanceCounter() + period;
+
+	while (SDL_AtomicGet(&gameRunning) && gameState == State_Game) {
+		Uint64 now = SDL_GetPerformanceCounter();
+		if (now < next) {
+			// Rounded up, so a tick can run late but never early
+			SDL_Delay(((next - now) * 1000 + freq - 1) / freq);
+			now = SDL_GetPerformanceCounter();
+		}
+
+		float late = (now - next) * 1000.0 / freq;
+		simTickJitter = lerpf(simTickJitter, late, 0.05f);
+		simTickJitterMax = fmaxf(simTickJitterMax, late);
+
+		if (now - next > 4 * period) {
+			// Too far behind to catch up, e.g. after a stall. Carry on from now.
+			next = now;
+		}
+		next += period;
+
+		Uint64 inputTime = SimThread_TakeInput();
+		Sim_Tick(w);
+
+		WorldSnapshot_Capture(&snapshots[snapshotBack], w, inputTime);
+		WorldSnapshot_Publish();
+	}
+
+	SDL_AtomicSet(&simThreadDone, 1);
+	return 0;
+}
+
+void SimThread_Start(World* w) {
+	// The renderer starts out with a snapshot of the starting grid
+	snapshotFront = 0;
+	snapshotBack = 1;
+	SDL_AtomicSet(&snapshotMiddle, 2);
+	SDL_AtomicSet(&simThreadDone, 0);
+	simInputTime = SDL_GetPerformanceCounter();
+	WorldSnapshot_Capture(&snapshots[snapshotFront], w, simInputTime);
+
+	simThread = SDL_CreateThread(SimThread_Run, "Simulation", w);
+	if (simThread == NULL) {
+		fprintf(stderr, "Unable to create simulation thread: %s\n", SDL_GetError());
+		exit(EXIT_FAILURE);
+	}
+}
+
+void SimThread_Stop() {
+	SDL_WaitThread(simThread, NULL);
+	simThread = NULL;
+}
+
+int main(int argc, char** argv) {
+	int serverPort = 0;
+	bool benchFloor = false;
+	const char* serverAddress = NULL;
+	bool bot = false;
+	const char* buildPages = NULL;
+	const char* capturePath = NULL;
+	const char* simulateTrack = NULL;
+	int batchRaces = 0;
+	bool kartsGiven = false;
+	const char* replayPath = NULL;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--karts") == 0 && i + 1 < argc) {
+			kartsGiven = true;
+			numEnemies = atoi(argv[++i]);
+			if (numEnemies < 0 || numEnemies > MAX_ENEMIES) {
+				fprintf(stderr, "Number of karts must be between 0 and %d\n", MAX_ENEMIES);
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if (strcmp(argv[i], "--stats") == 0) {
+			showStats = true;
+		}
+		else if (strcmp(argv[i], "--floor") == 0 && i + 1 < argc) {
+			i++;
+			int mode = 0;
+			while (mode < NUM_FLOOR_MODES && strcmp(argv[i], floorModeNames[mode]) != 0) {
+				mode++;
+			}
+			if (mode == NUM_FLOOR_MODES) {
+				fprintf(stderr, "Floor mode must be float, fixed or bilinear\n");
+				exit(EXIT_FAILURE);
+			}
+			floorMode = mode;
+		}
+		else if (strcmp(argv[i], "--heatmap") == 0 && i + 1 < argc) {
+			i++;
+			int mode = Heatmap_Writes;
+			while (mode < NUM_HEATMAP_MODES && strcmp(argv[i], heatmapModeNames[mode]) != 0) {
+				mode++;
+			}
+			if (mode == NUM_HEATMAP_MODES) {
+				fprintf(stderr, "Heatmap mode must be writes, texels or time\n");
+				exit(EXIT_FAILURE);
+			}
+			heatmapMode = mode;
+		}
+		else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+			capturePath = argv[++i];
+		}
+		else if (strcmp(argv[i], "--interlace") == 0) {
+			interlace = true;
+		}
+		else if (strcmp(argv[i], "--bench-floor") == 0) {
+			benchFloor = true;
+		}
+		else if (strcmp(argv[i], "--simulate") == 0 && i + 1 < argc) {
+			simulateTrack = argv[++i];
+		}
+		else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+			batchRaces = atoi(argv[++i]);
+			if (batchRaces < 1) {
+				fprintf(stderr, "Number of races must be at least 1\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if (strcmp(argv[i], "--players") == 0 && i + 1 < argc) {
+			numLocalPlayers = atoi(argv[++i]);
+			if (numLocalPlayers < 1 || numLocalPlayers > MAX_LOCAL_PLAYERS) {
+				fprintf(stderr, "Number of players must be between 1 and %d\n", MAX_LOCAL_PLAYERS);
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if ((strcmp(argv[i], "--record") == 0 || strcmp(argv[i], "--replay") == 0) && i + 1 < argc) {
+			InputMode mode = strcmp(argv[i], "--record") == 0 ? Input_Record : Input_Replay;
+			if (inputMode != Input_Live) {
+				fprintf(stderr, "Only one of --record and --replay can be given\n");
+				exit(EXIT_FAILURE);
+			}
+			inputMode = mode;
+			replayPath = argv[++i];
+		}
+		else if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+			netMode = Net_Server;
+			serverPort = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--connect") == 0 && i + 1 < argc) {
+			netMode = Net_Client;
+			serverAddress = argv[++i];
+		}
+		else if (strcmp(argv[i], "--bot") == 0) {
+			bot = true;
+		}
+		else if (strcmp(argv[i], "--build-pages") == 0 && i + 1 < argc) {
+			buildPages = argv[++i];
+		}
+		else if (strcmp(argv[i], "--late-latch") == 0) {
+			lateLatch = true;
+		}
+		else if (strcmp(argv[i], "--sim-thread") == 0) {
+			useSimThread = true;
+		}
+		else {
+			fprintf(stderr, "Unknown option %s\n", argv[i]);
+			fprintf(stderr, "Usage: %s [--karts N] [--players N] [--floor float|fixed|bilinear] [--interlace] [--bench-floor] [--simulate TRACK [--batch N]] [--stats] [--heatmap writes|texels|time] [--record FILE | --replay FILE] [--capture FILE] [--server PORT | --connect HOST:PORT [--bot]] [--build-pages TRACK] [--late-latch] [--sim-thread]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (netMode != Net_None && inputMode != Input_Live) {
+		fprintf(stderr, "Networked races can't be recorded or replayed\n");
+		exit(EXIT_FAILURE);
+	}
+	if (numLocalPlayers > 1 && (netMode != Net_None || inputMode != Input_Live)) {
+		fprintf(stderr, "Split-screen races can't be networked, recorded or replayed\n");
+		exit(EXIT_FAILURE);
+	}
+	if (useSimThread && netMode != Net_None) {
+		fprintf(stderr, "Networked races are ticked by the network, so they can't use --sim-thread\n");
+		exit(EXIT_FAILURE);
+	}
+	if (lateLatch && inputMode == Input_Replay) {
+		fprintf(stderr, "A replay's input comes from the file, so it can't be late latched\n");
+		exit(EXIT_FAILURE);
+	}
+	if (bot && netMode != Net_Client) {
+		fprintf(stderr, "--bot needs --connect\n");
+		exit(EXIT_FAILURE);
+	}
+	if (simulateTrack != NULL && (numLocalPlayers > 1 || netMode != Net_None || inputMode != Input_Live)) {
+		fprintf(stderr, "--simulate races the AI karts and one bot, on their own\n");
+		exit(EXIT_FAILURE);
+	}
+	if (batchRaces > 0 && simulateTrack == NULL) {
+		fprintf(stderr, "--batch needs --simulate\n");
+		exit(EXIT_FAILURE);
+	}
+	if (kartsGiven && inputMode == Input_Replay) {
+		fprintf(stderr, "A replay races as many karts as it was recorded with, so it can't take --karts\n");
+		exit(EXIT_FAILURE);
+	}
+	if (replayPath != NULL) {
+		Replay_Open(replayPath, inputMode);
+	}
+
+	World* world = World_Create();
+
+	if (buildPages != NULL) {
+		IMG_Init(IMG_INIT_PNG);
+		PageFile_Build(buildPages);
+		return 0;
+	}
+	if (benchFloor) {
+		SDL_Init(SDL_INIT_TIMER);
+		IMG_Init(IMG_INIT_PNG);
+		Bench_Floor(world);
+		World_Destroy(world);
+		return 0;
+	}
+	if (simulateTrack != NULL) {
+		SDL_Init(SDL_INIT_TIMER);
+		IMG_Init(IMG_INIT_PNG);
+		if (batchRaces > 0) {
+			Batch_Run(simulateTrack, batchRaces);
+		}
+		else {
+			Simulate_Run(world, simulateTrack);
+		}
+		World_Destroy(world);
+		return 0;
+	}
+	if (netMode == Net_Server) {
+		SDL_Init(SDL_INIT_TIMER);
+		IMG_Init(IMG_INIT_PNG);
+		Server_Run(world, serverPort);
+		Net_Close();
+		World_Destroy(world);
+		return 0;
+	}
+	if (bot) {
+		SDL_Init(SDL_INIT_TIMER);
+		IMG_Init(IMG_INIT_PNG);
+		Net_Connect(world, serverAddress);
+		Bot_Run(world);
+		printf("Bot %d came %d%s\n", netClientId, netFinishPlace, OrdinalSuffix(netFinishPlace));
+		Net_Close();
+		World_Destroy(world);
+		return 0;
+	}
+
 	SDL_Init(SDL_INIT_EVERYTHING);
 	IMG_Init(IMG_INIT_PNG);
 	TTF_Init();
+	BlendSpan_Init();
+	Audio_Open();
 
     SDL_version sdlVersion;
     SDL_GetVersion(&sdlVersion);
@@ -1313,6 +7441,12 @@ int main() {
 	SDL_RenderSetIntegerScale(renderer, true);
 
 	frameTexture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB24, SDL_TEXTUREACCESS_STREAMING, GAME_WIDTH, GAME_HEIGHT);
+	if (capturePath != NULL) {
+		Capture_Open(capturePath);
+	}
+	if (interlace) {
+		Interlace_Init();
+	}
 
 	SDL_SetRelativeMouseMode(true);
 
@@ -1329,43 +7463,107 @@ int main() {
 	font = TTF_OpenFont("Blinker-Regular.ttf", 72);
 	font_small = TTF_OpenFont("Blinker-Regular.ttf", 20);
 	
+	RenderWorkers_Init();
+
 	Menu_init();
 	// Game_init();
 
-    gameRunning = true;
+	if (netMode == Net_Client) {
+		// The server picks the track, so there's no menu
+		Net_Connect(world, serverAddress);
+		Transition_init(world);
+	}
+
+    SDL_AtomicSet(&gameRunning, 1);
 	frame = 0;
-    while (gameRunning) {
-		mousexrel = 0;
-		mouseyrel = 0;
+    while (SDL_AtomicGet(&gameRunning)) {
+		// The simulation thread reads mousexrel/mouseyrel itself, so motion is
+		// summed here and handed over
+		int mousex = 0;
+		int mousey = 0;
 
         SDL_Event ev;
         while (SDL_PollEvent(&ev)) {
             switch (ev.type) {
             case SDL_QUIT:
-				gameRunning = false; 
+				SDL_AtomicSet(&gameRunning, 0);
                 break;
 
 			case SDL_KEYDOWN:
 				if (ev.key.keysym.sym == SDLK_ESCAPE) {
-					gameRunning = false;
+					SDL_AtomicSet(&gameRunning, 0);
+				}
+				else if (ev.key.keysym.sym == SDLK_F3) {
+					heatmapMode = (heatmapMode + 1) % NUM_HEATMAP_MODES;
 				}
 				break;
 
 			case SDL_MOUSEMOTION:
-				mousexrel = ev.motion.xrel;
-				mouseyrel = ev.motion.yrel;
+				mousex += ev.motion.xrel;
+				mousey += ev.motion.yrel;
 				break;
 
             default:
                 break;
             }
         }
+		inputLatchTime = SDL_GetPerformanceCounter();
+
+		// Once the race is over the simulation carries on here
+		if (simThread != NULL && SDL_AtomicGet(&simThreadDone)) {
+			SimThread_Stop();
+		}
 
-		update();
-		draw();
+		if (simThread != NULL) {
+			SimThread_PostInput(mousex, mousey);
+		}
+		else {
+			mousexrel = mousex;
+			mouseyrel = mousey;
+			update(world);
+
+			// From the first tick of a race until the end of it, the race
+			// runs on the simulation thread
+			if (useSimThread && gameState == State_Game) {
+				SimThread_Start(world);
+			}
+		}
+
+		// Frames only line up with ticks when they run one after the other
+		if (simThread != NULL) {
+			Game_draw(world);
+		}
+		else {
+			Uint64 drawStart = SDL_GetPerformanceCounter();
+			draw(world);
+			Replay_ReportDraw((SDL_GetPerformanceCounter() - drawStart) * 1000.0 / SDL_GetPerformanceFrequency());
+		}
+		InputLatency_Update();
 
 		frame++;
     }
 
+	if (simThread != NULL) {
+		SimThread_Stop();
+	}
+
+	if (showStats && inputLatencyFrames > 0) {
+		printf("Input to present: %.2f ms average over %d frames\n", inputLatencyTotal / inputLatencyFrames, inputLatencyFrames);
+	}
+	if (showStats && useSimThread) {
+		printf("Sim thread tick jitter: %.2f ms smoothed, %.2f ms worst\n", simTickJitter, simTickJitterMax);
+	}
+
+	Audio_Close();
+	Capture_Close();
+	Replay_Close();
+	Net_Close();
+
+	// A track still loading is writing into the world's arenas
+	if (pendingTrack != NULL) {
+		TrackLoad_Publish(world, pendingTrack);
+	}
+	World_Destroy(world);
+
     return 0;
 }